@@ -48,6 +48,9 @@ static char *opt_runtime_repo;
 static gboolean opt_runtime = FALSE;
 static char **opt_gpg_file;
 static gboolean opt_oci = FALSE;
+static char *opt_oci_compression;
+static int opt_oci_compression_level = -1;
+static int opt_oci_threads = 0;
 
 static GOptionEntry options[] = {
   { "runtime", 0, 0, G_OPTION_ARG_NONE, &opt_runtime, N_("Export runtime instead of app"), NULL },
@@ -56,6 +59,9 @@ static GOptionEntry options[] = {
   { "runtime-repo", 0, 0, G_OPTION_ARG_STRING, &opt_runtime_repo, N_("Url for runtime flatpakrepo file"), N_("URL") },
   { "gpg-keys", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_gpg_file, N_("Add GPG key from FILE (- for stdin)"), N_("FILE") },
   { "oci", 0, 0, G_OPTION_ARG_NONE, &opt_oci, N_("Export oci image instead of flatpak bundle"), NULL },
+  { "oci-compression", 0, 0, G_OPTION_ARG_STRING, &opt_oci_compression, N_("Compression of the oci layer (gzip or zstd)"), N_("TYPE") },
+  { "oci-compression-level", 0, 0, G_OPTION_ARG_INT, &opt_oci_compression_level, N_("Compression level of the oci layer"), N_("LEVEL") },
+  { "oci-threads", 0, 0, G_OPTION_ARG_INT, &opt_oci_threads, N_("Number of threads used to compress the oci layer"), N_("N") },
 
   { NULL }
 };
@@ -299,6 +305,7 @@ export_commit_to_archive (OstreeRepo *repo,
 static gboolean
 build_oci (OstreeRepo *repo, GFile *dir,
            const char *name, const char *ref,
+           FlatpakOciLayerCompression compression,
            GCancellable *cancellable, GError **error)
 {
   g_autoptr(GFile) root = NULL;
@@ -343,6 +350,13 @@ build_oci (OstreeRepo *repo, GFile *dir,
   if (layer_writer == NULL)
     return FALSE;
 
+  if (!flatpak_oci_layer_writer_set_compression (layer_writer,
+                                                 compression,
+                                                 opt_oci_compression_level,
+                                                 opt_oci_threads,
+                                                 error))
+    return FALSE;
+
   archive = flatpak_oci_layer_writer_get_archive (layer_writer);
 
   if (!export_commit_to_archive (repo, root, ostree_commit_get_timestamp (commit_data),
@@ -414,6 +428,8 @@ flatpak_builtin_build_bundle (int argc, char **argv, GCancellable *cancellable,
   const char *name;
   const char *branch;
   g_autofree char *full_branch = NULL;
+  FlatpakOciLayerCompression compression;
+  int max_compression_level;
 
   context = g_option_context_new (_("LOCATION FILENAME NAME [BRANCH] - Create a single file bundle from a local repository"));
   g_option_context_set_translation_domain (context, GETTEXT_PACKAGE);
@@ -427,6 +443,29 @@ flatpak_builtin_build_bundle (int argc, char **argv, GCancellable *cancellable,
   if (argc > 5)
     return usage_error (context, _("Too many arguments"), error);
 
+  if (opt_oci_compression == NULL || strcmp (opt_oci_compression, "gzip") == 0)
+    {
+      compression = FLATPAK_OCI_LAYER_COMPRESSION_GZIP;
+      max_compression_level = 9;
+    }
+  else if (strcmp (opt_oci_compression, "zstd") == 0)
+    {
+      compression = FLATPAK_OCI_LAYER_COMPRESSION_ZSTD;
+      max_compression_level = 19;
+    }
+  else
+    return usage_error (context, _("Compression must be gzip or zstd"), error);
+
+  if (opt_oci_compression_level != -1 &&
+      (opt_oci_compression_level < 1 || opt_oci_compression_level > max_compression_level))
+    {
+      g_autofree char *msg = g_strdup_printf (_("Compression level must be between 1 and %d"), max_compression_level);
+      return usage_error (context, msg, error);
+    }
+
+  if (opt_oci_threads < 0)
+    return usage_error (context, _("Number of threads must not be negative"), error);
+
   location = argv[1];
   filename = argv[2];
   name = argv[3];
@@ -460,7 +499,7 @@ flatpak_builtin_build_bundle (int argc, char **argv, GCancellable *cancellable,
 
   if (opt_oci)
     {
-      if (!build_oci (repo, file, name, full_branch, cancellable, error))
+      if (!build_oci (repo, file, name, full_branch, compression, cancellable, error))
         return FALSE;
     }
   else
@@ -215,7 +215,7 @@ flatpak_builtin_build (int argc, char **argv, GCancellable *cancellable, GError
                                     app_context, NULL);
 
   if (!custom_usr &&
-      !flatpak_run_add_extension_args (argv_array, runtime_metakey, runtime_ref, cancellable, error))
+      !flatpak_run_add_extension_args (argv_array, runtime_metakey, runtime_ref, NULL, NULL, cancellable, error))
     return FALSE;
 
   for (i = 0; opt_bind_mounts != NULL && opt_bind_mounts[i] != NULL; i++)
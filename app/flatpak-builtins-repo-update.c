@@ -39,6 +39,9 @@ static char **opt_gpg_key_ids;
 static gboolean opt_prune;
 static gboolean opt_generate_deltas;
 static gint opt_prune_depth = -1;
+static gint opt_static_delta_jobs;
+static gint opt_static_delta_concurrent_size;
+static char *opt_static_delta_report;
 
 static GOptionEntry options[] = {
   { "title", 0, 0, G_OPTION_ARG_STRING, &opt_title, N_("A nice name to use for this repository"), N_("TITLE") },
@@ -46,71 +49,100 @@ static GOptionEntry options[] = {
   { "gpg-sign", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_gpg_key_ids, N_("GPG Key ID to sign the summary with"), N_("KEY-ID") },
   { "gpg-homedir", 0, 0, G_OPTION_ARG_STRING, &opt_gpg_homedir, N_("GPG Homedir to use when looking for keyrings"), N_("HOMEDIR") },
   { "generate-static-deltas", 0, 0, G_OPTION_ARG_NONE, &opt_generate_deltas, N_("Generate delta files"), NULL },
+  { "static-delta-jobs", 0, 0, G_OPTION_ARG_INT, &opt_static_delta_jobs, N_("Max parallel jobs when creating deltas (default: NUMCPUs)"), N_("NUM-JOBS") },
+  { "static-delta-concurrent-size", 0, 0, G_OPTION_ARG_INT, &opt_static_delta_concurrent_size, N_("Max total size of commits to create deltas for at the same time (default: half of RAM)"), N_("MB") },
+  { "static-delta-report", 0, 0, G_OPTION_ARG_FILENAME, &opt_static_delta_report, N_("Write a JSON report of the generated deltas to FILE"), N_("FILE") },
   { "prune", 0, 0, G_OPTION_ARG_NONE, &opt_prune, N_("Prune unused objects"), NULL },
   { "prune-depth", 0, 0, G_OPTION_ARG_INT, &opt_prune_depth, N_("Only traverse DEPTH parents for each commit (default: -1=infinite)"), N_("DEPTH") },
   { NULL }
 };
 
 typedef struct {
-  OstreeRepo *repo;
-  GVariant *params;
   char *ref;
   char *from;
   char *to;
+  guint64 cost;
+  gint64 elapsed;
+  char *error;
 } DeltaData;
 
 static void
 delta_data_free (DeltaData *data)
 {
-  g_object_unref (data->repo);
-  g_variant_unref (data->params);
   g_free (data->ref);
   g_free (data->from);
   g_free (data->to);
+  g_free (data->error);
   g_free (data);
 }
 
 static DeltaData *
-delta_data_push (GThreadPool *pool,
-                 OstreeRepo *repo,
-                 GVariant *params,
-                 const char *ref,
-                 const char *from,
-                 const char *to,
-                 GError **error)
+delta_data_new (const char *ref,
+                const char *from,
+                const char *to,
+                guint64     cost)
 {
   DeltaData *data = g_new0 (DeltaData, 1);
 
-  data->repo = g_object_ref (repo);
-  data->params = g_variant_ref (params);
   data->ref = g_strdup (ref);
   data->from = g_strdup (from);
   data->to = g_strdup (to);
-
-  if (!g_thread_pool_push (pool, data, error))
-    {
-      delta_data_free (data);
-      return NULL;
-    }
+  data->cost = cost;
 
   return data;
 }
 
+/* Sort the most expensive deltas first, so that we don't end up
+   waiting for one large delta at the end */
+static gint
+delta_data_compare_cost (gconstpointer a,
+                         gconstpointer b)
+{
+  const DeltaData *da = *(const DeltaData **) a;
+  const DeltaData *db = *(const DeltaData **) b;
+  int res;
+
+  if (da->cost != db->cost)
+    return da->cost < db->cost ? 1 : -1;
+
+  res = strcmp (da->ref, db->ref);
+  if (res != 0)
+    return res;
+
+  return g_strcmp0 (da->from, db->from);
+}
+
+/* Limits the total estimated size of the deltas generated at the same
+   time, as generating a delta needs memory in proportion to the size
+   of the commits involved. */
+typedef struct {
+  OstreeRepo *repo;
+  GVariant *params;
+  GMutex lock;
+  GCond cond;
+  guint64 running_cost;
+  guint n_running;
+  guint n_done;
+  guint n_total;
+} DeltaScheduler;
+
 static void
 generate_delta_thread (gpointer       _data,
                        gpointer       user_data)
 {
   DeltaData *data = (DeltaData*) _data;
+  DeltaScheduler *scheduler = user_data;
   g_autoptr(GError) error = NULL;
+  gint64 start = g_get_monotonic_time ();
 
   if (data->from == NULL)
     g_print (_("Generating delta: %s (%.10s)\n"), data->ref, data->to);
   else
     g_print (_("Generating delta: %s (%.10s-%.10s)\n"), data->ref, data->from, data->to);
 
-  if (!ostree_repo_static_delta_generate (data->repo, OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR,
+  if (!ostree_repo_static_delta_generate (scheduler->repo, OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR,
                                           data->from, data->to, NULL,
-                                          data->params,
+                                          scheduler->params,
                                           NULL, &error))
     {
       if (data->from == NULL)
@@ -119,8 +151,18 @@ generate_delta_thread (gpointer       _data,
       else
         g_printerr (_("Failed to generate delta %s (%.10s-%.10s): %s\n"),
                     data->ref, data->from, data->to, error->message);
+      data->error = g_strdup (error->message);
     }
-  delta_data_free (data);
+
+  data->elapsed = g_get_monotonic_time () - start;
+
+  g_mutex_lock (&scheduler->lock);
+  scheduler->running_cost -= data->cost;
+  scheduler->n_running--;
+  scheduler->n_done++;
+  g_print (_("Generated %u of %u deltas\n"), scheduler->n_done, scheduler->n_total);
+  g_cond_signal (&scheduler->cond);
+  g_mutex_unlock (&scheduler->lock);
 }
 
 static void
@@ -225,6 +267,174 @@ _ostree_repo_static_delta_delete (OstreeRepo                    *self,
 }
 
 
+/* ostree writes the superblock last, so a delta without one was
+   interrupted while being generated */
+static gboolean
+static_delta_is_complete (OstreeRepo *repo,
+                          const char *delta_id)
+{
+  g_autofree char *from = NULL;
+  g_autofree char *to = NULL;
+  g_autofree char *superblock = NULL;
+  struct stat buf;
+
+  _ostree_parse_delta_name (delta_id, &from, &to);
+  superblock = _ostree_get_relative_static_delta_path (from, to, "superblock");
+
+  return fstatat (ostree_repo_get_dfd (repo), superblock, &buf, 0) == 0;
+}
+
+/* Get the installed sizes we already know from the current summary */
+static GHashTable *
+load_known_commit_sizes (OstreeRepo *repo)
+{
+  g_autoptr(GHashTable) sizes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_autoptr(GVariant) summary = NULL;
+  g_autoptr(GVariant) extensions = NULL;
+  g_autoptr(GVariant) cache_v = NULL;
+  g_autoptr(GVariant) cache = NULL;
+  gsize n, i;
+
+  summary = flatpak_repo_load_summary (repo, NULL);
+  if (summary == NULL)
+    return g_steal_pointer (&sizes);
+
+  extensions = g_variant_get_child_value (summary, 1);
+  cache_v = g_variant_lookup_value (extensions, "xa.cache", NULL);
+  if (cache_v == NULL)
+    return g_steal_pointer (&sizes);
+
+  cache = g_variant_get_child_value (cache_v, 0);
+  n = g_variant_n_children (cache);
+  for (i = 0; i < n; i++)
+    {
+      const char *ref;
+      guint64 installed_size;
+      guint64 download_size;
+      const char *metadata;
+      g_autofree char *rev = NULL;
+
+      g_variant_get_child (cache, i, "{&s(tt&s)}", &ref, &installed_size, &download_size, &metadata);
+      if (flatpak_summary_lookup_ref (summary, ref, &rev))
+        {
+          guint64 *size = g_new (guint64, 1);
+          *size = GUINT64_FROM_BE (installed_size);
+          g_hash_table_replace (sizes, g_steal_pointer (&rev), size);
+        }
+    }
+
+  return g_steal_pointer (&sizes);
+}
+
+/* The cost of a delta is estimated by the size of the commit it
+   generates. For new commits that are not in the summary yet, the size
+   of the parent is usually a good enough guess, otherwise we have to
+   walk the tree. */
+static guint64
+estimate_commit_size (OstreeRepo *repo,
+                      GHashTable *known_sizes,
+                      const char *commit,
+                      const char *parent_commit)
+{
+  guint64 *size;
+  g_autoptr(GFile) root = NULL;
+  guint64 installed_size = 0;
+
+  size = g_hash_table_lookup (known_sizes, commit);
+  if (size == NULL && parent_commit != NULL)
+    size = g_hash_table_lookup (known_sizes, parent_commit);
+  if (size != NULL)
+    return *size;
+
+  if (!ostree_repo_read_commit (repo, commit, &root, NULL, NULL, NULL) ||
+      !flatpak_repo_collect_sizes (repo, root, &installed_size, NULL, NULL, NULL))
+    return 0;
+
+  size = g_new (guint64, 1);
+  *size = installed_size;
+  g_hash_table_insert (known_sizes, g_strdup (commit), size);
+
+  return installed_size;
+}
+
+static guint64
+get_default_concurrent_size (void)
+{
+  long pages = sysconf (_SC_PHYS_PAGES);
+  long page_size = sysconf (_SC_PAGESIZE);
+
+  if (pages <= 0 || page_size <= 0)
+    return G_MAXUINT64;
+
+  return ((guint64) pages * page_size) / 2;
+}
+
+static gboolean
+write_delta_report (const char *path,
+                    GPtrArray  *deltas,
+                    guint       n_existing,
+                    guint       n_incomplete,
+                    GError    **error)
+{
+  g_autoptr(JsonBuilder) builder = json_builder_new ();
+  g_autoptr(JsonGenerator) generator = NULL;
+  g_autoptr(JsonNode) root = NULL;
+  guint n_failed = 0;
+  int i;
+
+  json_builder_begin_object (builder);
+
+  json_builder_set_member_name (builder, "deltas");
+  json_builder_begin_array (builder);
+  for (i = 0; i < deltas->len; i++)
+    {
+      DeltaData *data = g_ptr_array_index (deltas, i);
+
+      json_builder_begin_object (builder);
+      json_builder_set_member_name (builder, "ref");
+      json_builder_add_string_value (builder, data->ref);
+      json_builder_set_member_name (builder, "from");
+      if (data->from)
+        json_builder_add_string_value (builder, data->from);
+      else
+        json_builder_add_null_value (builder);
+      json_builder_set_member_name (builder, "to");
+      json_builder_add_string_value (builder, data->to);
+      json_builder_set_member_name (builder, "estimated-size");
+      json_builder_add_int_value (builder, data->cost);
+      json_builder_set_member_name (builder, "seconds");
+      json_builder_add_double_value (builder, data->elapsed / (double) G_USEC_PER_SEC);
+      json_builder_set_member_name (builder, "status");
+      json_builder_add_string_value (builder, data->error ? "failed" : "generated");
+      if (data->error)
+        {
+          json_builder_set_member_name (builder, "error");
+          json_builder_add_string_value (builder, data->error);
+          n_failed++;
+        }
+      json_builder_end_object (builder);
+    }
+  json_builder_end_array (builder);
+
+  json_builder_set_member_name (builder, "generated");
+  json_builder_add_int_value (builder, deltas->len - n_failed);
+  json_builder_set_member_name (builder, "failed");
+  json_builder_add_int_value (builder, n_failed);
+  json_builder_set_member_name (builder, "existing");
+  json_builder_add_int_value (builder, n_existing);
+  json_builder_set_member_name (builder, "incomplete");
+  json_builder_add_int_value (builder, n_incomplete);
+
+  json_builder_end_object (builder);
+
+  root = json_builder_get_root (builder);
+  generator = json_generator_new ();
+  json_generator_set_pretty (generator, TRUE);
+  json_generator_set_root (generator, root);
+
+  return json_generator_to_file (generator, path, error);
+}
+
 static gboolean
 generate_all_deltas (OstreeRepo *repo,
                      GPtrArray **unwanted_deltas,
@@ -234,13 +444,20 @@ generate_all_deltas (OstreeRepo *repo,
   g_autoptr(GHashTable) all_refs = NULL;
   g_autoptr(GHashTable) all_deltas_hash = NULL;
   g_autoptr(GHashTable) wanted_deltas_hash = NULL;
+  g_autoptr(GHashTable) known_sizes = NULL;
   g_autoptr(GPtrArray) all_deltas = NULL;
+  g_autoptr(GPtrArray) deltas = NULL;
   int i;
   GHashTableIter iter;
   gpointer key, value;
   g_autoptr(GVariantBuilder) parambuilder = NULL;
   g_autoptr(GVariant) params = NULL;
   GThreadPool *thread_pool;
+  DeltaScheduler scheduler = { NULL };
+  guint64 concurrent_size;
+  guint n_jobs;
+  guint n_incomplete = 0;
+  gboolean cancelled = FALSE;
 
   g_print ("Generating static deltas\n");
 
@@ -256,21 +473,31 @@ generate_all_deltas (OstreeRepo *repo,
 
   wanted_deltas_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
+  /* Deltas from an interrupted run are removed and generated again */
   all_deltas_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
   for (i = 0; i < all_deltas->len; i++)
-    g_hash_table_insert (all_deltas_hash,
-                         g_strdup (g_ptr_array_index (all_deltas, i)),
-                         NULL);
+    {
+      const char *delta = g_ptr_array_index (all_deltas, i);
+      g_autoptr(GError) my_error = NULL;
+
+      if (static_delta_is_complete (repo, delta))
+        {
+          g_hash_table_insert (all_deltas_hash, g_strdup (delta), NULL);
+          continue;
+        }
+
+      g_print ("Deleting incomplete delta: %s\n", delta);
+      if (!_ostree_repo_static_delta_delete (repo, delta, cancellable, &my_error))
+        g_printerr ("Unable to delete delta %s: %s\n", delta, my_error->message);
+      n_incomplete++;
+    }
 
   if (!ostree_repo_list_refs (repo, NULL, &all_refs,
                               cancellable, error))
     return FALSE;
 
-  thread_pool = g_thread_pool_new (generate_delta_thread, NULL,
-                                   g_get_num_processors (), FALSE,
-                                   error);
-  if (thread_pool == NULL)
-    return FALSE;
+  known_sizes = load_known_commit_sizes (repo);
+  deltas = g_ptr_array_new_with_free_func ((GDestroyNotify) delta_data_free);
 
   g_hash_table_iter_init (&iter, all_refs);
   while (g_hash_table_iter_next (&iter, &key, &value))
@@ -280,6 +507,7 @@ generate_all_deltas (OstreeRepo *repo,
       g_autoptr(GVariant) variant = NULL;
       g_autoptr(GVariant) parent_variant = NULL;
       g_autofree char *parent_commit = NULL;
+      guint64 cost;
 
       if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, commit,
                                      &variant, NULL))
@@ -288,20 +516,19 @@ generate_all_deltas (OstreeRepo *repo,
           continue;
         }
 
+      parent_commit = ostree_commit_get_parent (variant);
+
       /* From empty */
-      if (!g_hash_table_contains (all_deltas_hash, commit))
+      if (!g_hash_table_contains (all_deltas_hash, commit) &&
+          !g_hash_table_contains (wanted_deltas_hash, commit))
         {
-          if (!delta_data_push (thread_pool, repo, params,
-                                ref, NULL, commit,
-                                error))
-            goto error;
+          cost = estimate_commit_size (repo, known_sizes, commit, parent_commit);
+          g_ptr_array_add (deltas, delta_data_new (ref, NULL, commit, cost));
         }
 
       /* Mark this one as wanted */
       g_hash_table_insert (wanted_deltas_hash, g_strdup (commit), GINT_TO_POINTER (1));
 
-      parent_commit = ostree_commit_get_parent (variant);
-
       if (parent_commit != NULL &&
           !ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, parent_commit,
                                      &parent_variant, NULL))
@@ -315,12 +542,11 @@ generate_all_deltas (OstreeRepo *repo,
         {
           g_autofree char *from_parent = g_strdup_printf ("%s-%s", parent_commit, commit);
 
-          if (!g_hash_table_contains (all_deltas_hash, from_parent))
+          if (!g_hash_table_contains (all_deltas_hash, from_parent) &&
+              !g_hash_table_contains (wanted_deltas_hash, from_parent))
             {
-              if (!delta_data_push (thread_pool, repo, params,
-                                    ref, parent_commit, commit,
-                                    error))
-                goto error;
+              cost = estimate_commit_size (repo, known_sizes, commit, parent_commit);
+              g_ptr_array_add (deltas, delta_data_new (ref, parent_commit, commit, cost));
             }
 
           /* Mark this one as wanted */
@@ -328,23 +554,84 @@ generate_all_deltas (OstreeRepo *repo,
         }
     }
 
+  g_ptr_array_sort (deltas, delta_data_compare_cost);
+
+  n_jobs = opt_static_delta_jobs > 0 ? opt_static_delta_jobs : g_get_num_processors ();
+  if (opt_static_delta_concurrent_size > 0)
+    concurrent_size = (guint64) opt_static_delta_concurrent_size * 1024 * 1024;
+  else
+    concurrent_size = get_default_concurrent_size ();
+
+  scheduler.repo = repo;
+  scheduler.params = params;
+  scheduler.n_total = deltas->len;
+  g_mutex_init (&scheduler.lock);
+  g_cond_init (&scheduler.cond);
+
+  thread_pool = g_thread_pool_new (generate_delta_thread, &scheduler,
+                                   n_jobs, FALSE, error);
+  if (thread_pool == NULL)
+    goto out;
+
+  for (i = 0; i < deltas->len; i++)
+    {
+      DeltaData *data = g_ptr_array_index (deltas, i);
+
+      g_mutex_lock (&scheduler.lock);
+      /* Always allow one delta to run, even if it's larger than the limit */
+      while (scheduler.n_running > 0 &&
+             scheduler.running_cost + data->cost > concurrent_size)
+        g_cond_wait (&scheduler.cond, &scheduler.lock);
+      scheduler.running_cost += data->cost;
+      scheduler.n_running++;
+      g_mutex_unlock (&scheduler.lock);
+
+      if (g_cancellable_is_cancelled (cancellable))
+        {
+          g_mutex_lock (&scheduler.lock);
+          scheduler.running_cost -= data->cost;
+          scheduler.n_running--;
+          g_mutex_unlock (&scheduler.lock);
+          cancelled = TRUE;
+          break;
+        }
+
+      /* Can't fail for non-exclusive pools */
+      g_thread_pool_push (thread_pool, data, NULL);
+    }
+
+  /* This block until all are done */
+  g_thread_pool_free (thread_pool, FALSE, TRUE);
+
+  if (cancelled)
+    {
+      g_cancellable_set_error_if_cancelled (cancellable, error);
+      goto out;
+    }
+
+  if (opt_static_delta_report != NULL &&
+      !write_delta_report (opt_static_delta_report, deltas,
+                           g_hash_table_size (all_deltas_hash),
+                           n_incomplete, error))
+    goto out;
+
   *unwanted_deltas = g_ptr_array_new_with_free_func (g_free);
   for (i = 0; i < all_deltas->len; i++)
     {
       const char *delta = g_ptr_array_index (all_deltas, i);
-      if (!g_hash_table_contains (wanted_deltas_hash, delta))
+      if (g_hash_table_contains (all_deltas_hash, delta) &&
+          !g_hash_table_contains (wanted_deltas_hash, delta))
         g_ptr_array_add (*unwanted_deltas, g_strdup (delta));
     }
 
-  /* This block until all are done */
-  g_thread_pool_free (thread_pool, FALSE, TRUE);
+  g_mutex_clear (&scheduler.lock);
+  g_cond_clear (&scheduler.cond);
 
   return TRUE;
 
- error:
-  /* TODO: In this error case we're leaking all the DeltaDatas we have not yet
-     processed. I don't know how to fix this though... */
-  g_thread_pool_free (thread_pool, TRUE, FALSE);
+ out:
+  g_mutex_clear (&scheduler.lock);
+  g_cond_clear (&scheduler.cond);
   return FALSE;
 }
 
@@ -26,8 +26,11 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 
 #include <glib/gi18n.h>
+#include <gio/gunixinputstream.h>
 
 #include "libglnx/libglnx.h"
 
@@ -45,6 +48,7 @@ static gboolean opt_log_session_bus;
 static gboolean opt_log_system_bus;
 static char *opt_runtime;
 static char *opt_runtime_version;
+static int opt_pool;
 
 static GOptionEntry options[] = {
   { "arch", 0, 0, G_OPTION_ARG_STRING, &opt_arch, N_("Arch to use"), N_("ARCH") },
@@ -55,9 +59,396 @@ static GOptionEntry options[] = {
   { "runtime-version", 0, 0, G_OPTION_ARG_STRING, &opt_runtime_version, N_("Runtime version to use"), N_("VERSION") },
   { "log-session-bus", 0, 0, G_OPTION_ARG_NONE, &opt_log_session_bus, N_("Log session bus calls"), NULL },
   { "log-system-bus", 0, 0, G_OPTION_ARG_NONE, &opt_log_system_bus, N_("Log system bus calls"), NULL },
+  { "pool", 0, 0, G_OPTION_ARG_INT, &opt_pool, N_("Keep N sandboxes ready and run one command per line of stdin"), N_("N") },
   { NULL }
 };
 
+/* A pooled sandbox runs this with the real command as $0 and the fixed
+ * arguments as $@. It blocks until a line of shell-quoted arguments is
+ * written to the control socket (its stdin) and then execs the command
+ * with them. If the socket is closed without a line it just exits.
+ */
+#define POOL_WAITER_SCRIPT \
+  "IFS= read -r args || exit 0\n" \
+  "eval \"set -- \\\"\\$@\\\" $args\"\n" \
+  "exec \"$0\" \"$@\" < /dev/null\n"
+
+typedef struct
+{
+  GPid pid;
+  int  control_fd;
+} PooledSandbox;
+
+typedef struct
+{
+  const char     *ref;
+  FlatpakDeploy  *deploy;
+  FlatpakContext *context;
+  FlatpakRunFlags flags;
+  char          **argv;
+  int             argc;
+} PoolSpec;
+
+typedef struct
+{
+  PoolSpec         *spec;
+  int               pool_size;
+  GMainContext     *main_context;
+  GDataInputStream *data_in;
+  GCancellable     *read_cancellable;
+  gboolean          reading;
+  gboolean          eof;
+  GQueue            ready;     /* PooledSandbox *, set up and waiting */
+  int               n_running;
+  GSource          *refill_source;
+  guint             n_failed;
+  GError           *error;
+} Pool;
+
+static PooledSandbox *
+pooled_sandbox_spawn (PoolSpec *spec,
+                      GError  **error)
+{
+  PooledSandbox *sandbox;
+  int control_fds[2];
+  GPid pid;
+
+  /* A socket rather than a pipe, so that writing to a sandbox that
+     already exited can use MSG_NOSIGNAL instead of ignoring SIGPIPE,
+     which the sandboxed commands would inherit */
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, control_fds) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return NULL;
+    }
+
+  /* Everything is prepared here, the child only execs bwrap. The
+     namespace and mount setup then happens in bwrap while we go on. */
+  if (!flatpak_run_app_full (spec->ref, spec->deploy, spec->context,
+                             opt_runtime, opt_runtime_version,
+                             spec->flags | FLATPAK_RUN_FLAG_BACKGROUND,
+                             "/bin/sh", spec->argv, spec->argc,
+                             control_fds[0], &pid,
+                             NULL, error))
+    {
+      close (control_fds[0]);
+      close (control_fds[1]);
+      return NULL;
+    }
+
+  close (control_fds[0]);
+
+  sandbox = g_new0 (PooledSandbox, 1);
+  sandbox->pid = pid;
+  sandbox->control_fd = control_fds[1];
+
+  return sandbox;
+}
+
+/* Closes the control socket of a sandbox that wasn't used, which makes
+ * its waiter exit, and reaps it */
+static void
+pooled_sandbox_free (PooledSandbox *sandbox)
+{
+  int status;
+
+  if (sandbox->control_fd != -1)
+    close (sandbox->control_fd);
+
+  if (sandbox->pid > 0)
+    {
+      while (waitpid (sandbox->pid, &status, 0) < 0 && errno == EINTR)
+        ;
+      g_spawn_close_pid (sandbox->pid);
+    }
+
+  g_free (sandbox);
+}
+
+/* Hands the arguments in line to the sandbox, which then execs the
+ * command. On success the caller owns the returned pid and has to reap
+ * it; the sandbox is consumed either way. */
+static gboolean
+pooled_sandbox_start (PooledSandbox *sandbox,
+                      const char    *line,
+                      GPid          *pid_out,
+                      GError       **error)
+{
+  g_auto(GStrv) line_argv = NULL;
+  g_autoptr(GString) quoted = g_string_new ("");
+  gsize len;
+  const char *p;
+  int i;
+
+  if (!g_shell_parse_argv (line, NULL, &line_argv, error))
+    {
+      pooled_sandbox_free (sandbox);
+      return FALSE;
+    }
+
+  /* Re-quote so that the sandbox sees exactly the parsed arguments */
+  for (i = 0; line_argv[i] != NULL; i++)
+    {
+      g_autofree char *q = g_shell_quote (line_argv[i]);
+      if (i > 0)
+        g_string_append_c (quoted, ' ');
+      g_string_append (quoted, q);
+    }
+  g_string_append_c (quoted, '\n');
+
+  p = quoted->str;
+  len = quoted->len;
+  while (len > 0)
+    {
+      ssize_t res = send (sandbox->control_fd, p, len, MSG_NOSIGNAL);
+      if (res < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          glnx_set_error_from_errno (error);
+          pooled_sandbox_free (sandbox);
+          return FALSE;
+        }
+      p += res;
+      len -= res;
+    }
+
+  *pid_out = sandbox->pid;
+  sandbox->pid = 0;
+  pooled_sandbox_free (sandbox);
+
+  return TRUE;
+}
+
+static void pool_maybe_read (Pool *pool);
+
+static gboolean
+pool_is_done (Pool *pool)
+{
+  return pool->error != NULL || pool->eof;
+}
+
+static void
+pool_child_exited (GPid     pid,
+                   gint     status,
+                   gpointer user_data)
+{
+  Pool *pool = user_data;
+
+  g_spawn_close_pid (pid);
+  pool->n_running--;
+
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    pool->n_failed++;
+
+  pool_maybe_read (pool);
+}
+
+/* Sets up one replacement sandbox per main loop iteration, at a lower
+ * priority than dispatching, so that the setup happens while commands
+ * run rather than between reading a command and starting it */
+static gboolean
+pool_refill (gpointer user_data)
+{
+  Pool *pool = user_data;
+  PooledSandbox *sandbox;
+
+  if (!pool_is_done (pool) && (int) pool->ready.length < pool->pool_size)
+    {
+      sandbox = pooled_sandbox_spawn (pool->spec, &pool->error);
+      if (sandbox != NULL)
+        g_queue_push_tail (&pool->ready, sandbox);
+    }
+
+  if (!pool_is_done (pool) && (int) pool->ready.length < pool->pool_size)
+    return G_SOURCE_CONTINUE;
+
+  g_clear_pointer (&pool->refill_source, g_source_unref);
+  return G_SOURCE_REMOVE;
+}
+
+static void
+pool_schedule_refill (Pool *pool)
+{
+  if (pool->refill_source != NULL)
+    return;
+
+  pool->refill_source = g_idle_source_new ();
+  g_source_set_priority (pool->refill_source, G_PRIORITY_LOW);
+  g_source_set_callback (pool->refill_source, pool_refill, pool, NULL);
+  g_source_attach (pool->refill_source, pool->main_context);
+}
+
+static void
+pool_dispatch (Pool       *pool,
+               const char *line)
+{
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GSource) child_source = NULL;
+  PooledSandbox *sandbox;
+  GPid pid;
+
+  /* Normally a sandbox is ready, unless commands come in faster than
+     they can be set up */
+  sandbox = g_queue_pop_head (&pool->ready);
+  if (sandbox == NULL)
+    {
+      sandbox = pooled_sandbox_spawn (pool->spec, &pool->error);
+      if (sandbox == NULL)
+        return;
+    }
+
+  pool_schedule_refill (pool);
+
+  if (!pooled_sandbox_start (sandbox, line, &pid, &local_error))
+    {
+      g_printerr (_("Failed to run '%s': %s\n"), line, local_error->message);
+      pool->n_failed++;
+      return;
+    }
+
+  pool->n_running++;
+  child_source = g_child_watch_source_new (pid);
+  g_source_set_callback (child_source, (GSourceFunc) pool_child_exited, pool, NULL);
+  g_source_attach (child_source, pool->main_context);
+}
+
+static void
+pool_read_line_cb (GObject      *source_object,
+                   GAsyncResult *result,
+                   gpointer      user_data)
+{
+  Pool *pool = user_data;
+  g_autofree char *line = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  pool->reading = FALSE;
+
+  line = g_data_input_stream_read_line_finish (pool->data_in, result, NULL, &local_error);
+  if (line == NULL)
+    {
+      if (local_error != NULL &&
+          !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED) &&
+          pool->error == NULL)
+        pool->error = g_steal_pointer (&local_error);
+      pool->eof = TRUE;
+      return;
+    }
+
+  if (pool_is_done (pool))
+    return;
+
+  g_strstrip (line);
+  if (*line != 0)
+    pool_dispatch (pool, line);
+
+  pool_maybe_read (pool);
+}
+
+/* Reads the next command once there is room to run it */
+static void
+pool_maybe_read (Pool *pool)
+{
+  if (pool->reading || pool_is_done (pool) ||
+      pool->n_running >= pool->pool_size)
+    return;
+
+  pool->reading = TRUE;
+  g_data_input_stream_read_line_async (pool->data_in, G_PRIORITY_DEFAULT,
+                                       pool->read_cancellable,
+                                       pool_read_line_cb, pool);
+}
+
+static void
+pool_cancel_read (GCancellable *cancellable,
+                  gpointer      user_data)
+{
+  g_cancellable_cancel (G_CANCELLABLE (user_data));
+}
+
+/* Runs the commands read from stdin in the pooled sandboxes, up to
+ * pool_size at a time, while replacement sandboxes are set up for the
+ * ones that were used */
+static gboolean
+run_pool (PoolSpec     *spec,
+          int           pool_size,
+          GCancellable *cancellable,
+          GError      **error)
+{
+  g_autoptr(GMainContext) main_context = g_main_context_new ();
+  g_autoptr(GCancellable) read_cancellable = g_cancellable_new ();
+  g_autoptr(GInputStream) in = NULL;
+  g_autoptr(GDataInputStream) data_in = NULL;
+  Pool pool = { 0, };
+  gulong cancelled_id = 0;
+  PooledSandbox *sandbox;
+
+  g_main_context_push_thread_default (main_context);
+
+  in = g_unix_input_stream_new (STDIN_FILENO, FALSE);
+  data_in = g_data_input_stream_new (in);
+
+  pool.spec = spec;
+  pool.pool_size = pool_size;
+  pool.main_context = main_context;
+  pool.data_in = data_in;
+  pool.read_cancellable = read_cancellable;
+  g_queue_init (&pool.ready);
+
+  if (cancellable)
+    cancelled_id = g_cancellable_connect (cancellable, G_CALLBACK (pool_cancel_read),
+                                          read_cancellable, NULL);
+
+  /* The first sandboxes are set up before reading any commands */
+  while (pool.error == NULL && (int) pool.ready.length < pool_size)
+    {
+      sandbox = pooled_sandbox_spawn (spec, &pool.error);
+      if (sandbox != NULL)
+        g_queue_push_tail (&pool.ready, sandbox);
+    }
+
+  pool_maybe_read (&pool);
+
+  /* Running commands are always waited for, even after an error */
+  while (!pool_is_done (&pool) || pool.n_running > 0)
+    g_main_context_iteration (main_context, TRUE);
+
+  if (pool.reading)
+    {
+      g_cancellable_cancel (read_cancellable);
+      while (pool.reading)
+        g_main_context_iteration (main_context, TRUE);
+    }
+
+  if (pool.refill_source)
+    {
+      g_source_destroy (pool.refill_source);
+      g_clear_pointer (&pool.refill_source, g_source_unref);
+    }
+
+  while ((sandbox = g_queue_pop_head (&pool.ready)) != NULL)
+    pooled_sandbox_free (sandbox);
+
+  if (cancellable)
+    g_cancellable_disconnect (cancellable, cancelled_id);
+
+  g_main_context_pop_thread_default (main_context);
+
+  if (pool.error)
+    {
+      g_propagate_error (error, pool.error);
+      return FALSE;
+    }
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  if (pool.n_failed > 0)
+    return flatpak_fail (error, _("%u commands failed"), pool.n_failed);
+
+  return TRUE;
+}
+
 gboolean
 flatpak_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **error)
 {
@@ -181,6 +572,42 @@ flatpak_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
       g_clear_error (&local_error);
     }
 
+  if (opt_pool > 0)
+    {
+      g_autoptr(GPtrArray) sh_argv = g_ptr_array_new_with_free_func (g_free);
+      g_autofree char *command = NULL;
+      PoolSpec spec = { 0, };
+
+      if (opt_command)
+        command = g_strdup (opt_command);
+      else if (app_deploy)
+        {
+          g_autoptr(GKeyFile) metakey = flatpak_deploy_get_metadata (app_deploy);
+          command = g_key_file_get_string (metakey, "Application", "command", error);
+          if (command == NULL)
+            return FALSE;
+        }
+      else
+        command = g_strdup ("/bin/sh");
+
+      g_ptr_array_add (sh_argv, g_strdup ("-c"));
+      g_ptr_array_add (sh_argv, g_strdup (POOL_WAITER_SCRIPT));
+      g_ptr_array_add (sh_argv, g_steal_pointer (&command));
+      for (i = rest_argv_start + 1; i < rest_argv_start + rest_argc; i++)
+        g_ptr_array_add (sh_argv, g_strdup (argv[i]));
+
+      spec.ref = app_deploy ? app_ref : runtime_ref;
+      spec.deploy = app_deploy;
+      spec.context = arg_context;
+      spec.flags = (opt_devel ? FLATPAK_RUN_FLAG_DEVEL : 0) |
+                   (opt_log_session_bus ? FLATPAK_RUN_FLAG_LOG_SESSION_BUS : 0) |
+                   (opt_log_system_bus ? FLATPAK_RUN_FLAG_LOG_SYSTEM_BUS : 0);
+      spec.argv = (char **) sh_argv->pdata;
+      spec.argc = sh_argv->len;
+
+      return run_pool (&spec, opt_pool, cancellable, error);
+    }
+
   if (!flatpak_run_app (app_deploy ? app_ref : runtime_ref,
                         app_deploy,
                         arg_context,
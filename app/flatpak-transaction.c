@@ -648,6 +648,9 @@ flatpak_transaction_run (FlatpakTransaction *self,
 
   self->ops = g_list_reverse (self->ops);
 
+  /* Run the triggers once for the whole transaction */
+  flatpak_dir_begin_triggers_batch (self->dir);
+
   for (l = self->ops; l != NULL; l = l->next)
     {
       FlatpakTransactionOp *op = l->data;
@@ -741,10 +744,15 @@ flatpak_transaction_run (FlatpakTransaction *self,
           else
             {
               g_propagate_error (error, g_steal_pointer (&local_error));
+              /* Still update caches for what did get deployed */
+              flatpak_dir_end_triggers_batch (self->dir, NULL, NULL);
               return FALSE;
             }
         }
     }
 
+  if (!flatpak_dir_end_triggers_batch (self->dir, cancellable, succeeded ? error : NULL))
+    return FALSE;
+
   return succeeded;
 }
@@ -22,12 +22,18 @@
 #include "config.h"
 
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/statfs.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 #include <gio/gio.h>
+#include <gio/gunixinputstream.h>
 #include <ostree.h>
 #include "libglnx/libglnx.h"
 
@@ -47,8 +53,46 @@ struct BuilderCache
   char       *last_parent;
   OstreeRepo *repo;
   gboolean    disabled;
+  GHashTable *devino_cache;
+  GHashTable *last_paths;
+
+  /* Optional cache shared with other machines, looked up on local
+     misses. Stages are only pushed to it if it is a local path. */
+  char       *shared_url;
+  GFile      *shared_dir;
+  OstreeRepo *shared_repo;
+  char       *shared_arch;
 };
 
+/* The paths in last_paths map to the checksum of the file, or to one
+   of these */
+#define PATH_IS_DIR ""
+#define PATH_CHECKSUM_UNKNOWN "?"
+
+/* The changes a stage made compared to its parent, as (added,
+   modified, removed) paths. Recorded in the commit so that we don't
+   have to diff the trees to find them. Stages that change more than
+   MAX_RECORDED_CHANGES paths don't record them, as that would bloat
+   the commit object, and readers diff the trees instead. */
+#define CHANGES_METADATA_KEY "xa.builder-changes"
+#define MAX_RECORDED_CHANGES 10000
+
+/* Maps the device and inode of the files in the app dir to their
+   ostree checksum, as of the last commit or checkout. Any change to a
+   file updates its ctime, so if the stat data still matches we don't
+   have to read and checksum the file again. */
+typedef struct
+{
+  dev_t           dev;
+  ino_t           ino;
+  struct timespec ctime;
+  off_t           size;
+  mode_t          mode;
+  uid_t           uid;
+  gid_t           gid;
+  char            checksum[OSTREE_SHA256_STRING_LEN + 1];
+} BuilderDevIno;
+
 typedef struct
 {
   GObjectClass parent_class;
@@ -64,6 +108,10 @@ enum {
   LAST_PROP
 };
 
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
 #define OSTREE_GIO_FAST_QUERYINFO ("standard::name,standard::type,standard::size,standard::is-symlink,standard::symlink-target," \
                                    "unix::device,unix::inode,unix::mode,unix::uid,unix::gid,unix::rdev")
 
@@ -75,12 +123,20 @@ builder_cache_finalize (GObject *object)
   g_clear_object (&self->cache_dir);
   g_clear_object (&self->app_dir);
   g_clear_object (&self->repo);
+  g_free (self->shared_url);
+  g_clear_object (&self->shared_dir);
+  g_clear_object (&self->shared_repo);
+  g_free (self->shared_arch);
   g_checksum_free (self->checksum);
   g_free (self->branch);
   g_free (self->last_parent);
   g_free (self->stage);
   if (self->unused_stages)
     g_hash_table_unref (self->unused_stages);
+  if (self->devino_cache)
+    g_hash_table_unref (self->devino_cache);
+  if (self->last_paths)
+    g_hash_table_unref (self->last_paths);
 
   G_OBJECT_CLASS (builder_cache_parent_class)->finalize (object);
 }
@@ -172,6 +228,75 @@ builder_cache_class_init (BuilderCacheClass *klass)
                                                         G_PARAM_READWRITE));
 }
 
+static guint
+devino_hash (gconstpointer a)
+{
+  const BuilderDevIno *devino = a;
+
+  return (guint) (devino->ino ^ devino->dev);
+}
+
+static gboolean
+devino_equal (gconstpointer a,
+              gconstpointer b)
+{
+  const BuilderDevIno *devino_a = a;
+  const BuilderDevIno *devino_b = b;
+
+  return devino_a->dev == devino_b->dev && devino_a->ino == devino_b->ino;
+}
+
+static GHashTable *
+devino_cache_new (void)
+{
+  return g_hash_table_new_full (devino_hash, devino_equal, g_free, NULL);
+}
+
+static void
+devino_cache_add (GHashTable        *cache,
+                  const struct stat *stbuf,
+                  const char        *checksum)
+{
+  BuilderDevIno *devino = g_new0 (BuilderDevIno, 1);
+
+  devino->dev = stbuf->st_dev;
+  devino->ino = stbuf->st_ino;
+  devino->ctime = stbuf->st_ctim;
+  devino->size = stbuf->st_size;
+  devino->mode = stbuf->st_mode;
+  devino->uid = stbuf->st_uid;
+  devino->gid = stbuf->st_gid;
+  strncpy (devino->checksum, checksum, OSTREE_SHA256_STRING_LEN);
+
+  g_hash_table_replace (cache, devino, devino);
+}
+
+static const char *
+devino_cache_lookup (GHashTable        *cache,
+                     const struct stat *stbuf)
+{
+  BuilderDevIno key = { 0 };
+  BuilderDevIno *devino;
+
+  if (cache == NULL)
+    return NULL;
+
+  key.dev = stbuf->st_dev;
+  key.ino = stbuf->st_ino;
+
+  devino = g_hash_table_lookup (cache, &key);
+  if (devino == NULL ||
+      devino->ctime.tv_sec != stbuf->st_ctim.tv_sec ||
+      devino->ctime.tv_nsec != stbuf->st_ctim.tv_nsec ||
+      devino->size != stbuf->st_size ||
+      devino->mode != stbuf->st_mode ||
+      devino->uid != stbuf->st_uid ||
+      devino->gid != stbuf->st_gid)
+    return NULL;
+
+  return devino->checksum;
+}
+
 static void
 builder_cache_init (BuilderCache *self)
 {
@@ -190,6 +315,48 @@ builder_cache_new (GFile      *cache_dir,
                        NULL);
 }
 
+/* location is a path or URL of an ostree repo that caches stages for
+   several machines. Stages are stored there by the checksum of their
+   inputs, so any build with the same inputs can reuse them.
+
+   The stages are not signed, so pulls can't be gpg verified, and
+   whatever the repo contains ends up in the build. Remote repos must
+   therefore use https, so that at least the server is authenticated. */
+gboolean
+builder_cache_set_shared (BuilderCache *self,
+                          const char   *location,
+                          const char   *arch,
+                          GError      **error)
+{
+  g_autoptr(GFile) file = NULL;
+
+  g_clear_pointer (&self->shared_url, g_free);
+  g_clear_object (&self->shared_dir);
+  g_clear_object (&self->shared_repo);
+  g_free (self->shared_arch);
+  self->shared_arch = g_strdup (arch);
+
+  if (location == NULL)
+    return TRUE;
+
+  file = g_file_new_for_commandline_arg (location);
+  if (g_file_is_native (file))
+    {
+      self->shared_url = g_file_get_uri (file);
+      self->shared_dir = g_steal_pointer (&file);
+    }
+  else if (g_file_has_uri_scheme (file, "https"))
+    {
+      self->shared_url = g_strdup (location);
+    }
+  else
+    {
+      return flatpak_fail (error, "Cache repo %s is not a local path or an https url", location);
+    }
+
+  return TRUE;
+}
+
 GChecksum *
 builder_cache_get_checksum (BuilderCache *self)
 {
@@ -268,12 +435,267 @@ builder_cache_get_current (BuilderCache *self)
   return g_strdup (g_checksum_get_string (copy));
 }
 
+/* Records the checksums of a checked out tree, so that the next
+   commit doesn't have to read the files again */
+static gboolean
+devino_cache_add_checkout (BuilderCache *self,
+                           GHashTable   *cache,
+                           int           dfd,
+                           const char   *dirtree_checksum,
+                           GError      **error)
+{
+  g_autoptr(GVariant) dirtree = NULL;
+  g_autoptr(GVariant) files = NULL;
+  g_autoptr(GVariant) dirs = NULL;
+  gsize n, i;
+
+  if (!ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree_checksum,
+                                 &dirtree, error))
+    return FALSE;
+
+  files = g_variant_get_child_value (dirtree, 0);
+  n = g_variant_n_children (files);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) csum_v = NULL;
+      g_autofree char *checksum = NULL;
+      g_autoptr(GFileInfo) file_info = NULL;
+      struct stat stbuf;
+
+      g_variant_get_child (files, i, "(&s@ay)", &name, &csum_v);
+
+      if (TEMP_FAILURE_RETRY (fstatat (dfd, name, &stbuf, AT_SYMLINK_NOFOLLOW)) != 0)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      checksum = ostree_checksum_from_bytes_v (csum_v);
+
+      /* The checkout may not have been able to apply the ownership
+         in the commit, and then the file would checksum differently */
+      if (!ostree_repo_load_file (self->repo, checksum, NULL, &file_info, NULL,
+                                  NULL, error))
+        return FALSE;
+
+      if (g_file_info_get_attribute_uint32 (file_info, "unix::uid") == stbuf.st_uid &&
+          g_file_info_get_attribute_uint32 (file_info, "unix::gid") == stbuf.st_gid &&
+          g_file_info_get_attribute_uint32 (file_info, "unix::mode") == stbuf.st_mode)
+        devino_cache_add (cache, &stbuf, checksum);
+    }
+
+  dirs = g_variant_get_child_value (dirtree, 1);
+  n = g_variant_n_children (dirs);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) tree_csum_v = NULL;
+      g_autoptr(GVariant) meta_csum_v = NULL;
+      g_autofree char *tree_checksum = NULL;
+      glnx_fd_close int child_dfd = -1;
+
+      g_variant_get_child (dirs, i, "(&s@ay@ay)", &name, &tree_csum_v, &meta_csum_v);
+
+      if (!glnx_opendirat (dfd, name, FALSE, &child_dfd, error))
+        return FALSE;
+
+      tree_checksum = ostree_checksum_from_bytes_v (tree_csum_v);
+      if (!devino_cache_add_checkout (self, cache, child_dfd, tree_checksum, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+set_error_from_clone_errno (GError **error)
+{
+  int errsv = errno;
+
+  if (errsv == EOPNOTSUPP || errsv == ENOTTY || errsv == EXDEV ||
+      errsv == EINVAL || errsv == ENOSYS)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Reflinks are not supported: %s", g_strerror (errsv));
+      return FALSE;
+    }
+
+  errno = errsv;
+  glnx_set_error_from_errno (error);
+  return FALSE;
+}
+
+static gboolean
+checkout_file_reflink (BuilderCache *self,
+                       GHashTable   *cache,
+                       int           dfd,
+                       const char   *name,
+                       const char   *checksum,
+                       GError      **error)
+{
+  g_autoptr(GFileInfo) file_info = NULL;
+  g_autofree char *object_path = NULL;
+  glnx_fd_close int object_fd = -1;
+  glnx_fd_close int fd = -1;
+  guint32 uid, gid, mode;
+  struct stat stbuf;
+
+  if (!ostree_repo_load_file (self->repo, checksum, NULL, &file_info, NULL, NULL, error))
+    return FALSE;
+
+  uid = g_file_info_get_attribute_uint32 (file_info, "unix::uid");
+  gid = g_file_info_get_attribute_uint32 (file_info, "unix::gid");
+  mode = g_file_info_get_attribute_uint32 (file_info, "unix::mode");
+
+  if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_SYMBOLIC_LINK)
+    {
+      const struct timespec times[2] = { { 0, UTIME_OMIT }, { OSTREE_TIMESTAMP, } };
+
+      if (symlinkat (g_file_info_get_symlink_target (file_info), dfd, name) != 0 ||
+          ((uid != geteuid () || gid != getegid ()) &&
+           fchownat (dfd, name, uid, gid, AT_SYMLINK_NOFOLLOW) != 0) ||
+          utimensat (dfd, name, times, AT_SYMLINK_NOFOLLOW) != 0 ||
+          fstatat (dfd, name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+    }
+  else
+    {
+      const struct timespec times[2] = { { 0, UTIME_OMIT }, { OSTREE_TIMESTAMP, } };
+
+      /* In bare-user repos the object is the file content */
+      object_path = g_strdup_printf ("objects/%.2s/%s.file", checksum, checksum + 2);
+      object_fd = openat (ostree_repo_get_dfd (self->repo), object_path, O_RDONLY | O_CLOEXEC);
+      if (object_fd < 0)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      fd = openat (dfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_NOFOLLOW, 0600);
+      if (fd < 0)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      if (ioctl (fd, FICLONE, object_fd) != 0)
+        return set_error_from_clone_errno (error);
+
+      if (((uid != geteuid () || gid != getegid ()) && fchown (fd, uid, gid) != 0) ||
+          fchmod (fd, mode & 07777) != 0 ||
+          futimens (fd, times) != 0 ||
+          fstat (fd, &stbuf) != 0)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+    }
+
+  devino_cache_add (cache, &stbuf, checksum);
+
+  return TRUE;
+}
+
+/* Checks out a tree by cloning the objects of the bare-user cache repo,
+   so that the checkout shares the data with the cache but the build
+   can't modify the cache. */
+static gboolean
+checkout_tree_reflink (BuilderCache *self,
+                       GHashTable   *cache,
+                       int           parent_dfd,
+                       const char   *name,
+                       const char   *dirtree_checksum,
+                       const char   *dirmeta_checksum,
+                       GError      **error)
+{
+  g_autoptr(GVariant) dirtree = NULL;
+  g_autoptr(GVariant) dirmeta = NULL;
+  g_autoptr(GVariant) files = NULL;
+  g_autoptr(GVariant) dirs = NULL;
+  glnx_fd_close int dfd = -1;
+  const struct timespec times[2] = { { 0, UTIME_OMIT }, { OSTREE_TIMESTAMP, } };
+  guint32 uid, gid, mode;
+  gsize n, i;
+
+  if (!ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree_checksum,
+                                 &dirtree, error))
+    return FALSE;
+
+  if (!ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_DIR_META, dirmeta_checksum,
+                                 &dirmeta, error))
+    return FALSE;
+
+  g_variant_get (dirmeta, "(uuu@a(ayay))", &uid, &gid, &mode, NULL);
+  uid = GUINT32_FROM_BE (uid);
+  gid = GUINT32_FROM_BE (gid);
+  mode = GUINT32_FROM_BE (mode);
+
+  if (mkdirat (parent_dfd, name, 0700) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  if (!glnx_opendirat (parent_dfd, name, FALSE, &dfd, error))
+    return FALSE;
+
+  files = g_variant_get_child_value (dirtree, 0);
+  n = g_variant_n_children (files);
+  for (i = 0; i < n; i++)
+    {
+      const char *file_name;
+      g_autoptr(GVariant) csum_v = NULL;
+      g_autofree char *checksum = NULL;
+
+      g_variant_get_child (files, i, "(&s@ay)", &file_name, &csum_v);
+      checksum = ostree_checksum_from_bytes_v (csum_v);
+
+      if (!checkout_file_reflink (self, cache, dfd, file_name, checksum, error))
+        return FALSE;
+    }
+
+  dirs = g_variant_get_child_value (dirtree, 1);
+  n = g_variant_n_children (dirs);
+  for (i = 0; i < n; i++)
+    {
+      const char *dir_name;
+      g_autoptr(GVariant) tree_csum_v = NULL;
+      g_autoptr(GVariant) meta_csum_v = NULL;
+      g_autofree char *tree_checksum = NULL;
+      g_autofree char *meta_checksum = NULL;
+
+      g_variant_get_child (dirs, i, "(&s@ay@ay)", &dir_name, &tree_csum_v, &meta_csum_v);
+      tree_checksum = ostree_checksum_from_bytes_v (tree_csum_v);
+      meta_checksum = ostree_checksum_from_bytes_v (meta_csum_v);
+
+      if (!checkout_tree_reflink (self, cache, dfd, dir_name, tree_checksum, meta_checksum, error))
+        return FALSE;
+    }
+
+  /* Set the mode and mtime last, as adding the children changes them */
+  if (((uid != geteuid () || gid != getegid ()) && fchown (dfd, uid, gid) != 0) ||
+      fchmod (dfd, mode & 07777) != 0 ||
+      futimens (dfd, times) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 static gboolean
 builder_cache_checkout (BuilderCache *self, const char *commit, GError **error)
 {
   g_autoptr(GFile) root = NULL;
   g_autoptr(GFileInfo) file_info = NULL;
   g_autoptr(GError) my_error = NULL;
+  g_autoptr(GHashTable) cache = NULL;
+  glnx_fd_close int app_dfd = -1;
 
   if (!ostree_repo_read_commit (self->repo, commit, &root, NULL, NULL, error))
     return FALSE;
@@ -290,6 +712,38 @@ builder_cache_checkout (BuilderCache *self, const char *commit, GError **error)
       g_propagate_error (error, g_steal_pointer (&my_error));
       return FALSE;
     }
+  g_clear_error (&my_error);
+
+  g_clear_pointer (&self->devino_cache, g_hash_table_unref);
+
+  /* If the filesystem supports it we clone the files from the cache,
+     which is both fast and safe from the build modifying the cache */
+  if (ostree_repo_get_mode (self->repo) == OSTREE_REPO_MODE_BARE_USER)
+    {
+      cache = devino_cache_new ();
+
+      if (checkout_tree_reflink (self, cache, AT_FDCWD,
+                                 flatpak_file_get_path_cached (self->app_dir),
+                                 ostree_repo_file_tree_get_contents_checksum (OSTREE_REPO_FILE (root)),
+                                 ostree_repo_file_tree_get_metadata_checksum (OSTREE_REPO_FILE (root)),
+                                 &my_error))
+        {
+          self->devino_cache = g_steal_pointer (&cache);
+          return TRUE;
+        }
+
+      if (!g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+        {
+          g_propagate_error (error, g_steal_pointer (&my_error));
+          return FALSE;
+        }
+
+      g_debug ("Not using reflinks for checkout: %s", my_error->message);
+      g_clear_pointer (&cache, g_hash_table_unref);
+
+      if (!flatpak_rm_rf (self->app_dir, NULL, error))
+        return FALSE;
+    }
 
   /* We check out without user mode, not necessarily because we care
      about uids not owned by the user (they are all from the build,
@@ -311,6 +765,18 @@ builder_cache_checkout (BuilderCache *self, const char *commit, GError **error)
                            NULL, error))
     return FALSE;
 
+  if (!glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (self->app_dir), FALSE,
+                       &app_dfd, error))
+    return FALSE;
+
+  cache = devino_cache_new ();
+  if (!devino_cache_add_checkout (self, cache, app_dfd,
+                                  ostree_repo_file_tree_get_contents_checksum (OSTREE_REPO_FILE (root)),
+                                  error))
+    return FALSE;
+
+  self->devino_cache = g_steal_pointer (&cache);
+
   return TRUE;
 }
 
@@ -344,6 +810,120 @@ builder_cache_get_current_ref (BuilderCache *self)
   return get_ref (self, self->stage);
 }
 
+/* The stage checksum doesn't include the arch, as the local cache
+   is per-arch anyway, so add it to the shared ref */
+static char *
+get_shared_ref (BuilderCache *self,
+                const char   *current)
+{
+  return g_strdup_printf ("stages/%s/%s", self->shared_arch, current);
+}
+
+static GVariant *
+shared_pull_options (const char *ref)
+{
+  GVariantBuilder builder;
+  const char *refs[2] = { ref, NULL };
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&builder, "{s@v}", "refs",
+                         g_variant_new_variant (g_variant_new_strv (refs, -1)));
+  g_variant_builder_add (&builder, "{s@v}", "gpg-verify",
+                         g_variant_new_variant (g_variant_new_boolean (FALSE)));
+  g_variant_builder_add (&builder, "{s@v}", "gpg-verify-summary",
+                         g_variant_new_variant (g_variant_new_boolean (FALSE)));
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+static gboolean
+commit_has_subject (BuilderCache *self,
+                    const char   *commit,
+                    const char   *current)
+{
+  g_autoptr(GVariant) variant = NULL;
+  const gchar *subject;
+
+  if (!ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_COMMIT, commit,
+                                 &variant, NULL))
+    return FALSE;
+
+  g_variant_get (variant, "(a{sv}aya(say)&s&stayay)", NULL, NULL, NULL,
+                 &subject, NULL, NULL, NULL, NULL);
+
+  return strcmp (subject, current) == 0;
+}
+
+/* Returns the commit of the current stage if the shared cache has it */
+static char *
+pull_shared_stage (BuilderCache *self,
+                   const char   *current)
+{
+  g_autofree char *shared_ref = get_shared_ref (self, current);
+  g_autoptr(GVariant) options = shared_pull_options (shared_ref);
+  g_autofree char *commit = NULL;
+  g_autoptr(GError) error = NULL;
+
+  if (!ostree_repo_pull_with_options (self->repo, self->shared_url, options,
+                                      NULL, NULL, &error))
+    {
+      g_debug ("Stage %s not in shared cache: %s", self->stage, error->message);
+      return NULL;
+    }
+
+  if (!ostree_repo_resolve_rev (self->repo, shared_ref, FALSE, &commit, &error))
+    {
+      g_debug ("Stage %s not in shared cache: %s", self->stage, error->message);
+      return NULL;
+    }
+
+  /* Pulling by url creates a local ref, but only the stage ref should
+     keep the commit alive */
+  ostree_repo_set_ref_immediate (self->repo, NULL, shared_ref, NULL, NULL, NULL);
+
+  return g_steal_pointer (&commit);
+}
+
+static gboolean
+push_shared_stage (BuilderCache *self,
+                   const char   *current,
+                   const char   *commit,
+                   GError      **error)
+{
+  g_autofree char *shared_ref = get_shared_ref (self, current);
+  g_autofree char *cache_url = g_file_get_uri (self->cache_dir);
+  g_autoptr(GVariant) options = shared_pull_options (commit);
+
+  if (self->shared_repo == NULL)
+    {
+      g_autoptr(OstreeRepo) shared_repo = ostree_repo_new (self->shared_dir);
+
+      /* Use archive-z2 so the same repo can be served over http */
+      if (!g_file_query_exists (self->shared_dir, NULL))
+        {
+          g_autoptr(GFile) parent = g_file_get_parent (self->shared_dir);
+
+          if (!flatpak_mkdir_p (parent, NULL, error))
+            return FALSE;
+
+          if (!ostree_repo_create (shared_repo, OSTREE_REPO_MODE_ARCHIVE_Z2, NULL, error))
+            return FALSE;
+        }
+
+      if (!ostree_repo_open (shared_repo, NULL, error))
+        return FALSE;
+
+      self->shared_repo = g_steal_pointer (&shared_repo);
+    }
+
+  if (!ostree_repo_pull_with_options (self->shared_repo, cache_url, options,
+                                      NULL, NULL, error))
+    return FALSE;
+
+  return ostree_repo_set_ref_immediate (self->shared_repo, NULL, shared_ref, commit,
+                                        NULL, error);
+}
+
 gboolean
 builder_cache_lookup (BuilderCache *self,
                       const char   *stage)
@@ -366,27 +946,32 @@ builder_cache_lookup (BuilderCache *self,
 
   current = builder_cache_get_current (self);
 
-  if (commit != NULL)
+  if (commit == NULL || !commit_has_subject (self, commit, current))
     {
-      g_autoptr(GVariant) variant = NULL;
-      const gchar *subject;
-
-      if (!ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_COMMIT, commit,
-                                     &variant, NULL))
-        goto checkout;
-
-      g_variant_get (variant, "(a{sv}aya(say)&s&stayay)", NULL, NULL, NULL,
-                     &subject, NULL, NULL, NULL, NULL);
+      g_clear_pointer (&commit, g_free);
 
-      if (strcmp (subject, current) == 0)
+      if (self->shared_url != NULL)
         {
-          g_free (self->last_parent);
-          self->last_parent = g_steal_pointer (&commit);
-
-          return TRUE;
+          commit = pull_shared_stage (self, current);
+          if (commit != NULL && commit_has_subject (self, commit, current))
+            {
+              g_print ("Found %s in shared cache\n", stage);
+              ostree_repo_set_ref_immediate (self->repo, NULL, ref, commit, NULL, NULL);
+            }
+          else
+            g_clear_pointer (&commit, g_free);
         }
     }
 
+  if (commit != NULL)
+    {
+      g_free (self->last_parent);
+      self->last_parent = g_steal_pointer (&commit);
+      g_clear_pointer (&self->last_paths, g_hash_table_unref);
+
+      return TRUE;
+    }
+
 checkout:
   if (self->last_parent)
     {
@@ -402,19 +987,437 @@ checkout:
   return FALSE;
 }
 
+static GFileInfo *
+file_info_from_stat (const struct stat *stbuf)
+{
+  GFileInfo *file_info = g_file_info_new ();
+
+  g_file_info_set_attribute_uint32 (file_info, "unix::uid", stbuf->st_uid);
+  g_file_info_set_attribute_uint32 (file_info, "unix::gid", stbuf->st_gid);
+  g_file_info_set_attribute_uint32 (file_info, "unix::mode", stbuf->st_mode);
+
+  if (S_ISDIR (stbuf->st_mode))
+    g_file_info_set_file_type (file_info, G_FILE_TYPE_DIRECTORY);
+  else if (S_ISLNK (stbuf->st_mode))
+    g_file_info_set_file_type (file_info, G_FILE_TYPE_SYMBOLIC_LINK);
+  else
+    g_file_info_set_file_type (file_info, G_FILE_TYPE_REGULAR);
+
+  g_file_info_set_size (file_info, stbuf->st_size);
+
+  return file_info;
+}
+
+static gboolean
+open_content (int                dfd,
+              const char        *name,
+              const struct stat *stbuf,
+              GFileInfo        **out_file_info,
+              GInputStream     **out_in,
+              GError           **error)
+{
+  g_autoptr(GFileInfo) file_info = file_info_from_stat (stbuf);
+  g_autoptr(GInputStream) in = NULL;
+
+  if (S_ISLNK (stbuf->st_mode))
+    {
+      g_autofree char *target = glnx_readlinkat_malloc (dfd, name, NULL, error);
+
+      if (target == NULL)
+        return FALSE;
+
+      g_file_info_set_symlink_target (file_info, target);
+    }
+  else
+    {
+      int fd = openat (dfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+      if (fd < 0)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      in = g_unix_input_stream_new (fd, TRUE);
+    }
+
+  *out_file_info = g_steal_pointer (&file_info);
+  *out_in = g_steal_pointer (&in);
+  return TRUE;
+}
+
+static gboolean
+checksum_content (int                dfd,
+                  const char        *name,
+                  const struct stat *stbuf,
+                  char             **out_checksum,
+                  GError           **error)
+{
+  g_autoptr(GFileInfo) file_info = NULL;
+  g_autoptr(GInputStream) in = NULL;
+  g_autofree guchar *csum = NULL;
+
+  if (!open_content (dfd, name, stbuf, &file_info, &in, error))
+    return FALSE;
+
+  if (!ostree_checksum_file_from_input (file_info, NULL, in, OSTREE_OBJECT_TYPE_FILE,
+                                        &csum, NULL, error))
+    return FALSE;
+
+  *out_checksum = ostree_checksum_from_bytes (csum);
+  return TRUE;
+}
+
+static gboolean
+write_content (BuilderCache      *self,
+               int                dfd,
+               const char        *name,
+               const struct stat *stbuf,
+               char             **out_checksum,
+               GError           **error)
+{
+  g_autoptr(GFileInfo) file_info = NULL;
+  g_autoptr(GInputStream) in = NULL;
+  g_autoptr(GInputStream) content = NULL;
+  g_autofree guchar *csum = NULL;
+  guint64 length;
+
+  if (!open_content (dfd, name, stbuf, &file_info, &in, error))
+    return FALSE;
+
+  if (!ostree_raw_file_to_content_stream (in, file_info, NULL,
+                                          &content, &length, NULL, error))
+    return FALSE;
+
+  if (!ostree_repo_write_content (self->repo, NULL, content, length,
+                                  &csum, NULL, error))
+    return FALSE;
+
+  *out_checksum = ostree_checksum_from_bytes (csum);
+  return TRUE;
+}
+
+/* Like ostree_repo_write_directory_to_mtree(), but only reads the files
+   that changed since the last commit or checkout */
+static gboolean
+write_dir_to_mtree (BuilderCache      *self,
+                    GHashTable        *new_cache,
+                    GHashTable        *new_paths,
+                    int                dfd,
+                    const char        *path,
+                    const struct stat *dir_stbuf,
+                    OstreeMutableTree *mtree,
+                    GError           **error)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  g_autoptr(GFileInfo) dir_info = file_info_from_stat (dir_stbuf);
+  g_autoptr(GVariant) dirmeta = NULL;
+  g_autofree guchar *csum = NULL;
+  g_autofree char *dirmeta_checksum = NULL;
+
+  dirmeta = ostree_create_directory_metadata (dir_info, NULL);
+  if (!ostree_repo_write_metadata (self->repo, OSTREE_OBJECT_TYPE_DIR_META, NULL,
+                                   dirmeta, &csum, NULL, error))
+    return FALSE;
+
+  dirmeta_checksum = ostree_checksum_from_bytes (csum);
+  ostree_mutable_tree_set_metadata_checksum (mtree, dirmeta_checksum);
+
+  if (!glnx_dirfd_iterator_init_at (dfd, ".", FALSE, &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      struct stat stbuf;
+      g_autofree char *child_path = NULL;
+
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, NULL, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (TEMP_FAILURE_RETRY (fstatat (dfd_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW)) != 0)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      child_path = path ? g_build_filename (path, dent->d_name, NULL) : g_strdup (dent->d_name);
+
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          g_autoptr(OstreeMutableTree) child_mtree = NULL;
+          glnx_fd_close int child_dfd = -1;
+
+          if (!ostree_mutable_tree_ensure_dir (mtree, dent->d_name, &child_mtree, error))
+            return FALSE;
+
+          if (!glnx_opendirat (dfd_iter.fd, dent->d_name, FALSE, &child_dfd, error))
+            return FALSE;
+
+          if (!write_dir_to_mtree (self, new_cache, new_paths, child_dfd, child_path,
+                                   &stbuf, child_mtree, error))
+            return FALSE;
+
+          g_hash_table_insert (new_paths, g_steal_pointer (&child_path), g_strdup (PATH_IS_DIR));
+        }
+      else if (S_ISREG (stbuf.st_mode) || S_ISLNK (stbuf.st_mode))
+        {
+          const char *cached_checksum = devino_cache_lookup (self->devino_cache, &stbuf);
+          g_autofree char *checksum = NULL;
+
+          if (cached_checksum != NULL)
+            checksum = g_strdup (cached_checksum);
+          else if (!write_content (self, dfd_iter.fd, dent->d_name, &stbuf, &checksum, error))
+            return FALSE;
+
+          if (!ostree_mutable_tree_replace_file (mtree, dent->d_name, checksum, error))
+            return FALSE;
+
+          devino_cache_add (new_cache, &stbuf, checksum);
+          g_hash_table_insert (new_paths, g_steal_pointer (&child_path), g_steal_pointer (&checksum));
+        }
+      else
+        {
+          return flatpak_fail (error, "Unsupported file type for %s", dent->d_name);
+        }
+    }
+
+  return TRUE;
+}
+
+static gboolean
+add_tree_paths (BuilderCache *self,
+                GHashTable   *paths,
+                const char   *path,
+                const char   *dirtree_checksum,
+                GError      **error)
+{
+  g_autoptr(GVariant) dirtree = NULL;
+  g_autoptr(GVariant) files = NULL;
+  g_autoptr(GVariant) dirs = NULL;
+  gsize n, i;
+
+  if (!ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree_checksum,
+                                 &dirtree, error))
+    return FALSE;
+
+  files = g_variant_get_child_value (dirtree, 0);
+  n = g_variant_n_children (files);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) csum_v = NULL;
+
+      g_variant_get_child (files, i, "(&s@ay)", &name, &csum_v);
+      g_hash_table_insert (paths,
+                           path ? g_build_filename (path, name, NULL) : g_strdup (name),
+                           ostree_checksum_from_bytes_v (csum_v));
+    }
+
+  dirs = g_variant_get_child_value (dirtree, 1);
+  n = g_variant_n_children (dirs);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) tree_csum_v = NULL;
+      g_autoptr(GVariant) meta_csum_v = NULL;
+      g_autofree char *tree_checksum = NULL;
+      g_autofree char *child_path = NULL;
+
+      g_variant_get_child (dirs, i, "(&s@ay@ay)", &name, &tree_csum_v, &meta_csum_v);
+
+      child_path = path ? g_build_filename (path, name, NULL) : g_strdup (name);
+      tree_checksum = ostree_checksum_from_bytes_v (tree_csum_v);
+      if (!add_tree_paths (self, paths, child_path, tree_checksum, error))
+        return FALSE;
+
+      g_hash_table_insert (paths, g_steal_pointer (&child_path), g_strdup (PATH_IS_DIR));
+    }
+
+  return TRUE;
+}
+
+/* Returns the paths in the last commit, only reading the dirtree objects */
+static GHashTable *
+ensure_last_paths (BuilderCache *self,
+                   GError      **error)
+{
+  g_autoptr(GHashTable) paths = NULL;
+  g_autoptr(GFile) root = NULL;
+
+  if (self->last_paths)
+    return self->last_paths;
+
+  paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  if (self->last_parent)
+    {
+      if (!ostree_repo_read_commit (self->repo, self->last_parent, &root, NULL, NULL, error))
+        return NULL;
+
+      if (!ostree_repo_file_ensure_resolved (OSTREE_REPO_FILE (root), error))
+        return NULL;
+
+      if (!add_tree_paths (self, paths, NULL,
+                           ostree_repo_file_tree_get_contents_checksum (OSTREE_REPO_FILE (root)),
+                           error))
+        return NULL;
+    }
+
+  self->last_paths = g_steal_pointer (&paths);
+  return self->last_paths;
+}
+
+/* Same result as ostree_diff_dirs(): added directories are listed with
+   all their contents, removed ones are not, and a path that changes
+   between file and directory is both removed and added */
+static void
+compute_changes (GHashTable *old_paths,
+                 GHashTable *new_paths,
+                 GPtrArray  *added,
+                 GPtrArray  *modified,
+                 GPtrArray  *removed)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&iter, new_paths);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      const char *path = key;
+      const char *checksum = value;
+      const char *old_checksum = g_hash_table_lookup (old_paths, path);
+      gboolean is_dir = strcmp (checksum, PATH_IS_DIR) == 0;
+
+      if (old_checksum == NULL)
+        g_ptr_array_add (added, g_strdup (path));
+      else if (is_dir != (strcmp (old_checksum, PATH_IS_DIR) == 0))
+        {
+          g_ptr_array_add (removed, g_strdup (path));
+          g_ptr_array_add (added, g_strdup (path));
+        }
+      else if (!is_dir && strcmp (checksum, old_checksum) != 0)
+        g_ptr_array_add (modified, g_strdup (path));
+    }
+
+  g_hash_table_iter_init (&iter, old_paths);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      const char *path = key;
+      g_autofree char *parent = NULL;
+      const char *new_parent_checksum;
+
+      if (g_hash_table_contains (new_paths, path))
+        continue;
+
+      /* Only list the topmost removed path */
+      parent = g_path_get_dirname (path);
+      new_parent_checksum = g_hash_table_lookup (new_paths, parent);
+      if (strcmp (parent, ".") == 0 ||
+          (new_parent_checksum != NULL && strcmp (new_parent_checksum, PATH_IS_DIR) == 0))
+        g_ptr_array_add (removed, g_strdup (path));
+    }
+
+  g_ptr_array_sort (added, flatpak_strcmp0_ptr);
+  g_ptr_array_sort (modified, flatpak_strcmp0_ptr);
+  g_ptr_array_sort (removed, flatpak_strcmp0_ptr);
+}
+
+static GVariant *
+strv_variant_from_array (GPtrArray *array)
+{
+  GVariantBuilder builder;
+  int i;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("as"));
+  for (i = 0; i < array->len; i++)
+    g_variant_builder_add (&builder, "s", (const char *) g_ptr_array_index (array, i));
+
+  return g_variant_builder_end (&builder);
+}
+
+static GPtrArray *
+array_from_strv_variant (GVariant *variant)
+{
+  GPtrArray *array = g_ptr_array_new_with_free_func (g_free);
+  gsize n, i;
+
+  n = g_variant_n_children (variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *str;
+
+      g_variant_get_child (variant, i, "&s", &str);
+      g_ptr_array_add (array, g_strdup (str));
+    }
+
+  return array;
+}
+
+/* Returns FALSE if the commit has no recorded changes, e.g. because
+   it was created by an older version */
+static gboolean
+load_commit_changes (BuilderCache *self,
+                     const char   *commit,
+                     char        **out_parent,
+                     GPtrArray   **out_added,
+                     GPtrArray   **out_modified,
+                     GPtrArray   **out_removed)
+{
+  g_autoptr(GVariant) variant = NULL;
+  g_autoptr(GVariant) metadata = NULL;
+  g_autoptr(GVariant) changes = NULL;
+  g_autoptr(GVariant) added = NULL;
+  g_autoptr(GVariant) modified = NULL;
+  g_autoptr(GVariant) removed = NULL;
+
+  if (!ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_COMMIT, commit,
+                                 &variant, NULL))
+    return FALSE;
+
+  metadata = g_variant_get_child_value (variant, 0);
+  changes = g_variant_lookup_value (metadata, CHANGES_METADATA_KEY, G_VARIANT_TYPE ("(asasas)"));
+  if (changes == NULL)
+    return FALSE;
+
+  g_variant_get (changes, "(@as@as@as)", &added, &modified, &removed);
+
+  if (out_parent)
+    *out_parent = ostree_commit_get_parent (variant);
+  if (out_added)
+    *out_added = array_from_strv_variant (added);
+  if (out_modified)
+    *out_modified = array_from_strv_variant (modified);
+  if (out_removed)
+    *out_removed = array_from_strv_variant (removed);
+
+  return TRUE;
+}
+
 gboolean
 builder_cache_commit (BuilderCache *self,
                       const char   *body,
                       GError      **error)
 {
   g_autofree char *current = NULL;
-  OstreeRepoCommitModifier *modifier = NULL;
-
   g_autoptr(OstreeMutableTree) mtree = NULL;
   g_autoptr(GFile) root = NULL;
+  g_autoptr(GHashTable) new_cache = NULL;
+  g_autoptr(GHashTable) new_paths = NULL;
+  g_autoptr(GPtrArray) added = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) modified = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) removed = g_ptr_array_new_with_free_func (g_free);
+  GHashTable *old_paths;
+  GVariantBuilder metadata_builder;
+  g_autoptr(GVariant) metadata = NULL;
   g_autofree char *commit_checksum = NULL;
   gboolean res = FALSE;
   g_autofree char *ref = NULL;
+  glnx_fd_close int app_dfd = -1;
+  struct stat stbuf;
 
   g_print ("Committing stage %s to cache\n", self->stage);
 
@@ -424,23 +1427,48 @@ builder_cache_commit (BuilderCache *self,
                            NULL, NULL))
     return FALSE;
 
+  old_paths = ensure_last_paths (self, error);
+  if (old_paths == NULL)
+    return FALSE;
+
   if (!ostree_repo_prepare_transaction (self->repo, NULL, NULL, error))
     return FALSE;
 
   mtree = ostree_mutable_tree_new ();
+  new_cache = devino_cache_new ();
+  new_paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  if (!glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (self->app_dir), FALSE,
+                       &app_dfd, error))
+    goto out;
+
+  if (TEMP_FAILURE_RETRY (fstat (app_dfd, &stbuf)) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      goto out;
+    }
 
-  modifier = ostree_repo_commit_modifier_new (OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SKIP_XATTRS,
-                                              NULL, NULL, NULL);
-  if (!ostree_repo_write_directory_to_mtree (self->repo, self->app_dir,
-                                             mtree, modifier, NULL, error))
+  if (!write_dir_to_mtree (self, new_cache, new_paths, app_dfd, NULL, &stbuf, mtree, error))
     goto out;
 
+  compute_changes (old_paths, new_paths, added, modified, removed);
+
+  g_variant_builder_init (&metadata_builder, G_VARIANT_TYPE ("a{sv}"));
+  if (added->len + modified->len + removed->len <= MAX_RECORDED_CHANGES)
+    g_variant_builder_add (&metadata_builder, "{sv}", CHANGES_METADATA_KEY,
+                           g_variant_new ("(@as@as@as)",
+                                          strv_variant_from_array (added),
+                                          strv_variant_from_array (modified),
+                                          strv_variant_from_array (removed)));
+  metadata = g_variant_ref_sink (g_variant_builder_end (&metadata_builder));
+
   if (!ostree_repo_write_mtree (self->repo, mtree, &root, NULL, error))
     goto out;
 
   current = builder_cache_get_current (self);
 
-  if (!ostree_repo_write_commit (self->repo, self->last_parent, current, body, NULL,
+  if (!ostree_repo_write_commit (self->repo, self->last_parent, current, body,
+                                 metadata,
                                  OSTREE_REPO_FILE (root),
                                  &commit_checksum, NULL, error))
     goto out;
@@ -454,6 +1482,19 @@ builder_cache_commit (BuilderCache *self,
   g_free (self->last_parent);
   self->last_parent = g_steal_pointer (&commit_checksum);
 
+  if (self->shared_dir != NULL)
+    {
+      g_autoptr(GError) local_error = NULL;
+
+      if (!push_shared_stage (self, current, self->last_parent, &local_error))
+        g_warning ("Failed to store stage %s in shared cache: %s", self->stage, local_error->message);
+    }
+
+  g_clear_pointer (&self->devino_cache, g_hash_table_unref);
+  self->devino_cache = g_steal_pointer (&new_cache);
+  g_clear_pointer (&self->last_paths, g_hash_table_unref);
+  self->last_paths = g_steal_pointer (&new_paths);
+
   res = TRUE;
 
 out:
@@ -462,12 +1503,83 @@ out:
       if (!ostree_repo_abort_transaction (self->repo, NULL, NULL))
         g_warning ("failed to abort transaction");
     }
-  if (modifier)
-    ostree_repo_commit_modifier_unref (modifier);
 
   return res;
 }
 
+/* Only checksums the files that exist in the last commit and changed
+   since then, as everything else is either added or unchanged */
+static gboolean
+add_dir_paths (BuilderCache *self,
+               GHashTable   *old_paths,
+               GHashTable   *new_paths,
+               int           dfd,
+               const char   *path,
+               GError      **error)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+
+  if (!glnx_dirfd_iterator_init_at (dfd, ".", FALSE, &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      struct stat stbuf;
+      g_autofree char *child_path = NULL;
+      const char *old_checksum;
+
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, NULL, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (TEMP_FAILURE_RETRY (fstatat (dfd_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW)) != 0)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      child_path = path ? g_build_filename (path, dent->d_name, NULL) : g_strdup (dent->d_name);
+
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          glnx_fd_close int child_dfd = -1;
+
+          if (!glnx_opendirat (dfd_iter.fd, dent->d_name, FALSE, &child_dfd, error))
+            return FALSE;
+
+          if (!add_dir_paths (self, old_paths, new_paths, child_dfd, child_path, error))
+            return FALSE;
+
+          g_hash_table_insert (new_paths, g_steal_pointer (&child_path), g_strdup (PATH_IS_DIR));
+          continue;
+        }
+
+      old_checksum = g_hash_table_lookup (old_paths, child_path);
+      if (old_checksum == NULL || strcmp (old_checksum, PATH_IS_DIR) == 0)
+        {
+          g_hash_table_insert (new_paths, g_steal_pointer (&child_path),
+                               g_strdup (PATH_CHECKSUM_UNKNOWN));
+        }
+      else
+        {
+          const char *cached_checksum = devino_cache_lookup (self->devino_cache, &stbuf);
+          g_autofree char *checksum = NULL;
+
+          if (cached_checksum != NULL)
+            checksum = g_strdup (cached_checksum);
+          else if (!checksum_content (dfd_iter.fd, dent->d_name, &stbuf, &checksum, error))
+            return FALSE;
+
+          g_hash_table_insert (new_paths, g_steal_pointer (&child_path), g_steal_pointer (&checksum));
+        }
+    }
+
+  return TRUE;
+}
+
 gboolean
 builder_cache_get_outstanding_changes (BuilderCache *self,
                                        GPtrArray   **added_out,
@@ -475,52 +1587,26 @@ builder_cache_get_outstanding_changes (BuilderCache *self,
                                        GPtrArray   **removed_out,
                                        GError      **error)
 {
-  g_autoptr(GPtrArray) added = g_ptr_array_new_with_free_func (g_object_unref);
-  g_autoptr(GPtrArray) modified = g_ptr_array_new_with_free_func ((GDestroyNotify) ostree_diff_item_unref);
-  g_autoptr(GPtrArray) removed = g_ptr_array_new_with_free_func (g_object_unref);
   g_autoptr(GPtrArray) added_paths = g_ptr_array_new_with_free_func (g_free);
   g_autoptr(GPtrArray) modified_paths = g_ptr_array_new_with_free_func (g_free);
   g_autoptr(GPtrArray) removed_paths = g_ptr_array_new_with_free_func (g_free);
-  g_autoptr(GFile) last_root = NULL;
-  g_autoptr(GVariant) variant = NULL;
-  int i;
+  g_autoptr(GHashTable) new_paths = NULL;
+  GHashTable *old_paths;
+  glnx_fd_close int app_dfd = -1;
 
-  if (!ostree_repo_read_commit (self->repo, self->last_parent, &last_root, NULL, NULL, error))
+  old_paths = ensure_last_paths (self, error);
+  if (old_paths == NULL)
     return FALSE;
 
-  if (!ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_COMMIT, self->last_parent,
-                                 &variant, NULL))
+  if (!glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (self->app_dir), FALSE,
+                       &app_dfd, error))
     return FALSE;
 
-  if (!ostree_diff_dirs (OSTREE_DIFF_FLAGS_IGNORE_XATTRS,
-                         last_root,
-                         self->app_dir,
-                         modified,
-                         removed,
-                         added,
-                         NULL, error))
+  new_paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  if (!add_dir_paths (self, old_paths, new_paths, app_dfd, NULL, error))
     return FALSE;
 
-  for (i = 0; i < added->len; i++)
-    {
-      GFile *added_file = g_ptr_array_index (added, i);
-      char *path = g_file_get_relative_path (self->app_dir, added_file);
-      g_ptr_array_add (added_paths, path);
-    }
-
-  for (i = 0; i < modified->len; i++)
-    {
-      OstreeDiffItem *modified_item = g_ptr_array_index (modified, i);
-      char *path = g_file_get_relative_path (self->app_dir, modified_item->target);
-      g_ptr_array_add (modified_paths, path);
-    }
-
-  for (i = 0; i < removed->len; i++)
-    {
-      GFile *removed_file = g_ptr_array_index (removed, i);
-      char *path = g_file_get_relative_path (self->app_dir, removed_file);
-      g_ptr_array_add (removed_paths, path);
-    }
+  compute_changes (old_paths, new_paths, added_paths, modified_paths, removed_paths);
 
   if (added_out)
     *added_out = g_steal_pointer (&added_paths);
@@ -534,6 +1620,114 @@ builder_cache_get_outstanding_changes (BuilderCache *self,
   return TRUE;
 }
 
+static gboolean
+repo_paths_differ (GFile      *old_root,
+                   GFile      *new_root,
+                   const char *path)
+{
+  g_autoptr(GFile) old_file = g_file_resolve_relative_path (old_root, path);
+  g_autoptr(GFile) new_file = g_file_resolve_relative_path (new_root, path);
+  GFileType old_type, new_type;
+
+  old_type = g_file_query_file_type (old_file, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL);
+  new_type = g_file_query_file_type (new_file, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL);
+
+  if (old_type != new_type)
+    return TRUE;
+
+  if (new_type == G_FILE_TYPE_DIRECTORY || new_type == G_FILE_TYPE_UNKNOWN)
+    return FALSE;
+
+  return strcmp (ostree_repo_file_get_checksum (OSTREE_REPO_FILE (old_file)),
+                 ostree_repo_file_get_checksum (OSTREE_REPO_FILE (new_file))) != 0;
+}
+
+/* Combines the changes recorded in the commits between init and finish.
+   Returns NULL without setting an error if some commit has no
+   recorded changes. */
+static GPtrArray *
+get_recorded_changes_between (BuilderCache *self,
+                              const char   *init_commit,
+                              const char   *finish_commit,
+                              GError      **error)
+{
+  g_autoptr(GPtrArray) commits = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GHashTable) changed = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GPtrArray) all_paths = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GFile) init_root = NULL;
+  g_autoptr(GFile) finish_root = NULL;
+  g_autofree char *commit = g_strdup (finish_commit);
+  GHashTableIter iter;
+  gpointer key;
+  int i, j;
+
+  while (strcmp (commit, init_commit) != 0)
+    {
+      g_autofree char *parent = NULL;
+
+      if (!load_commit_changes (self, commit, &parent, NULL, NULL, NULL) ||
+          parent == NULL)
+        return NULL;
+
+      g_ptr_array_add (commits, g_steal_pointer (&commit));
+      commit = g_steal_pointer (&parent);
+    }
+
+  /* Replay the changes from init onwards */
+  for (i = commits->len - 1; i >= 0; i--)
+    {
+      g_autoptr(GPtrArray) added = NULL;
+      g_autoptr(GPtrArray) modified = NULL;
+      g_autoptr(GPtrArray) removed = NULL;
+
+      if (!load_commit_changes (self, g_ptr_array_index (commits, i), NULL,
+                                &added, &modified, &removed))
+        return NULL;
+
+      for (j = 0; j < removed->len; j++)
+        {
+          const char *removed_path = g_ptr_array_index (removed, j);
+          gsize len = strlen (removed_path);
+
+          g_hash_table_iter_init (&iter, changed);
+          while (g_hash_table_iter_next (&iter, &key, NULL))
+            {
+              const char *path = key;
+
+              if (strncmp (path, removed_path, len) == 0 &&
+                  (path[len] == 0 || path[len] == '/'))
+                g_hash_table_iter_remove (&iter);
+            }
+        }
+
+      for (j = 0; j < added->len; j++)
+        g_hash_table_add (changed, g_strdup (g_ptr_array_index (added, j)));
+
+      for (j = 0; j < modified->len; j++)
+        g_hash_table_add (changed, g_strdup (g_ptr_array_index (modified, j)));
+    }
+
+  if (!ostree_repo_read_commit (self->repo, init_commit, &init_root, NULL, NULL, error))
+    return NULL;
+
+  if (!ostree_repo_read_commit (self->repo, finish_commit, &finish_root, NULL, NULL, error))
+    return NULL;
+
+  /* Drop anything that was changed back */
+  g_hash_table_iter_init (&iter, changed);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      const char *path = key;
+
+      if (repo_paths_differ (init_root, finish_root, path))
+        g_ptr_array_add (all_paths, g_strdup (path));
+    }
+
+  g_ptr_array_sort (all_paths, flatpak_strcmp0_ptr);
+
+  return g_steal_pointer (&all_paths);
+}
+
 GPtrArray *
 builder_cache_get_all_changes (BuilderCache *self,
                                GError      **error)
@@ -546,6 +1740,8 @@ builder_cache_get_all_changes (BuilderCache *self,
   g_autoptr(GFile) finish_root = NULL;
   g_autofree char *init_commit = NULL;
   g_autofree char *finish_commit = NULL;
+  g_autoptr(GError) my_error = NULL;
+  GPtrArray *recorded;
   int i;
   g_autofree char *init_ref = get_ref (self, "init");
   g_autofree char *finish_ref = get_ref (self, "finish");
@@ -556,6 +1752,16 @@ builder_cache_get_all_changes (BuilderCache *self,
   if (!ostree_repo_resolve_rev (self->repo, finish_ref, FALSE, &finish_commit, NULL))
     return FALSE;
 
+  recorded = get_recorded_changes_between (self, init_commit, finish_commit, &my_error);
+  if (recorded != NULL)
+    return recorded;
+
+  if (my_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&my_error));
+      return NULL;
+    }
+
   if (!ostree_repo_read_commit (self->repo, init_commit, &init_root, NULL, NULL, error))
     return NULL;
 
@@ -595,12 +1801,26 @@ builder_cache_get_changes (BuilderCache *self,
   g_autoptr(GPtrArray) modified = g_ptr_array_new_with_free_func ((GDestroyNotify) ostree_diff_item_unref);
   g_autoptr(GPtrArray) removed = g_ptr_array_new_with_free_func (g_object_unref);
   g_autoptr(GPtrArray) changed_paths = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) recorded_added = NULL;
+  g_autoptr(GPtrArray) recorded_modified = NULL;
   g_autoptr(GFile) current_root = NULL;
   g_autoptr(GFile) parent_root = NULL;
   g_autoptr(GVariant) variant = NULL;
   g_autofree char *parent_commit = NULL;
   int i;
 
+  if (load_commit_changes (self, self->last_parent, NULL,
+                           &recorded_added, &recorded_modified, NULL))
+    {
+      for (i = 0; i < recorded_added->len; i++)
+        g_ptr_array_add (changed_paths, g_strdup (g_ptr_array_index (recorded_added, i)));
+
+      for (i = 0; i < recorded_modified->len; i++)
+        g_ptr_array_add (changed_paths, g_strdup (g_ptr_array_index (recorded_modified, i)));
+
+      return g_steal_pointer (&changed_paths);
+    }
+
   if (!ostree_repo_read_commit (self->repo, self->last_parent, &current_root, NULL, NULL, error))
     return NULL;
 
@@ -38,6 +38,10 @@ BuilderCache *builder_cache_new (GFile      *cache_dir,
                                  GFile      *app_dir,
                                  const char *branch);
 void          builder_cache_disable_lookups (BuilderCache *self);
+gboolean      builder_cache_set_shared (BuilderCache *self,
+                                        const char   *location,
+                                        const char   *arch,
+                                        GError      **error);
 gboolean      builder_cache_open (BuilderCache *self,
                                   GError      **error);
 GChecksum *   builder_cache_get_checksum (BuilderCache *self);
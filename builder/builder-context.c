@@ -49,9 +49,14 @@ struct BuilderContext
 
   BuilderOptions *options;
   gboolean        keep_build_dirs;
+  gboolean        cache_extracted_sources;
   int             jobs;
+  int             module_jobs;
+  char           *build_report;
   char          **cleanup;
   char          **cleanup_platform;
+  BuilderCleanupMatcher *cleanup_matcher;
+  BuilderCleanupMatcher *cleanup_platform_matcher;
   gboolean        use_ccache;
   gboolean        build_runtime;
   gboolean        separate_locales;
@@ -89,8 +94,11 @@ builder_context_finalize (GObject *object)
   g_clear_object (&self->options);
   g_free (self->arch);
   g_free (self->stop_at);
+  g_free (self->build_report);
   g_strfreev (self->cleanup);
   g_strfreev (self->cleanup_platform);
+  g_clear_pointer (&self->cleanup_matcher, builder_cleanup_matcher_free);
+  g_clear_pointer (&self->cleanup_platform_matcher, builder_cleanup_matcher_free);
 
   G_OBJECT_CLASS (builder_context_parent_class)->finalize (object);
 }
@@ -294,6 +302,46 @@ builder_context_set_jobs (BuilderContext *self,
   self->jobs = jobs;
 }
 
+int
+builder_context_get_module_jobs (BuilderContext *self)
+{
+  return MAX (self->module_jobs, 1);
+}
+
+void
+builder_context_set_module_jobs (BuilderContext *self,
+                                 int             module_jobs)
+{
+  self->module_jobs = module_jobs;
+}
+
+const char *
+builder_context_get_build_report (BuilderContext *self)
+{
+  return self->build_report;
+}
+
+void
+builder_context_set_build_report (BuilderContext *self,
+                                  const char     *path)
+{
+  g_free (self->build_report);
+  self->build_report = g_strdup (path);
+}
+
+void
+builder_context_set_cache_extracted_sources (BuilderContext *self,
+                                             gboolean        cache_extracted_sources)
+{
+  self->cache_extracted_sources = cache_extracted_sources;
+}
+
+gboolean
+builder_context_get_cache_extracted_sources (BuilderContext *self)
+{
+  return self->cache_extracted_sources;
+}
+
 void
 builder_context_set_keep_build_dirs (BuilderContext *self,
                                      gboolean        keep_build_dirs)
@@ -307,6 +355,7 @@ builder_context_set_global_cleanup (BuilderContext *self,
 {
   g_strfreev (self->cleanup);
   self->cleanup = g_strdupv ((char **) cleanup);
+  g_clear_pointer (&self->cleanup_matcher, builder_cleanup_matcher_free);
 }
 
 const char **
@@ -321,6 +370,7 @@ builder_context_set_global_cleanup_platform (BuilderContext *self,
 {
   g_strfreev (self->cleanup_platform);
   self->cleanup_platform = g_strdupv ((char **) cleanup);
+  g_clear_pointer (&self->cleanup_platform_matcher, builder_cleanup_matcher_free);
 }
 
 const char **
@@ -329,6 +379,23 @@ builder_context_get_global_cleanup_platform (BuilderContext *self)
   return (const char **) self->cleanup_platform;
 }
 
+/* The global patterns are compiled once and shared by all modules */
+BuilderCleanupMatcher *
+builder_context_get_global_cleanup_matcher (BuilderContext *self,
+                                            gboolean        platform)
+{
+  if (platform)
+    {
+      if (self->cleanup_platform_matcher == NULL)
+        self->cleanup_platform_matcher = builder_cleanup_matcher_new ((const char **) self->cleanup_platform);
+      return self->cleanup_platform_matcher;
+    }
+
+  if (self->cleanup_matcher == NULL)
+    self->cleanup_matcher = builder_cleanup_matcher_new ((const char **) self->cleanup);
+  return self->cleanup_matcher;
+}
+
 gboolean
 builder_context_get_keep_build_dirs (BuilderContext *self)
 {
@@ -24,6 +24,7 @@
 #include <gio/gio.h>
 #include <libsoup/soup.h>
 #include "builder-options.h"
+#include "builder-utils.h"
 
 G_BEGIN_DECLS
 
@@ -52,9 +53,18 @@ void            builder_context_set_stop_at (BuilderContext *self,
 int             builder_context_get_jobs (BuilderContext *self);
 void            builder_context_set_jobs (BuilderContext *self,
                                           int n_jobs);
+int             builder_context_get_module_jobs (BuilderContext *self);
+void            builder_context_set_module_jobs (BuilderContext *self,
+                                                 int             n_jobs);
+const char *    builder_context_get_build_report (BuilderContext *self);
+void            builder_context_set_build_report (BuilderContext *self,
+                                                  const char     *path);
 void            builder_context_set_keep_build_dirs (BuilderContext *self,
                                                      gboolean        keep_build_dirs);
 gboolean        builder_context_get_keep_build_dirs (BuilderContext *self);
+void            builder_context_set_cache_extracted_sources (BuilderContext *self,
+                                                             gboolean        cache_extracted_sources);
+gboolean        builder_context_get_cache_extracted_sources (BuilderContext *self);
 void            builder_context_set_sandboxed (BuilderContext *self,
                                                gboolean        sandboxed);
 gboolean        builder_context_get_sandboxed (BuilderContext *self);
@@ -64,6 +74,8 @@ const char **   builder_context_get_global_cleanup (BuilderContext *self);
 void            builder_context_set_global_cleanup_platform (BuilderContext *self,
                                                              const char    **cleanup);
 const char **   builder_context_get_global_cleanup_platform (BuilderContext *self);
+BuilderCleanupMatcher *builder_context_get_global_cleanup_matcher (BuilderContext *self,
+                                                                   gboolean        platform);
 BuilderOptions *builder_context_get_options (BuilderContext *self);
 void            builder_context_set_options (BuilderContext *self,
                                              BuilderOptions *option);
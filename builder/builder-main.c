@@ -44,6 +44,7 @@ static gboolean opt_disable_updates;
 static gboolean opt_ccache;
 static gboolean opt_require_changes;
 static gboolean opt_keep_build_dirs;
+static gboolean opt_cache_extracted_sources;
 static gboolean opt_force_clean;
 static gboolean opt_allow_missing_runtimes;
 static gboolean opt_sandboxed;
@@ -55,6 +56,9 @@ static char *opt_body;
 static char *opt_gpg_homedir;
 static char **opt_key_ids;
 static int opt_jobs;
+static int opt_module_jobs;
+static char *opt_cache_repo;
+static char *opt_build_report;
 
 static GOptionEntry entries[] = {
   { "verbose", 'v', 0, G_OPTION_ARG_NONE, &opt_verbose, "Print debug information during command processing", NULL },
@@ -63,6 +67,7 @@ static GOptionEntry entries[] = {
   { "run", 0, 0, G_OPTION_ARG_NONE, &opt_run, "Run a command in the build directory (see --run --help)", NULL },
   { "ccache", 0, 0, G_OPTION_ARG_NONE, &opt_ccache, "Use ccache", NULL },
   { "disable-cache", 0, 0, G_OPTION_ARG_NONE, &opt_disable_cache, "Disable cache lookups", NULL },
+  { "cache-repo", 0, 0, G_OPTION_ARG_STRING, &opt_cache_repo, "Shared repo to look up and store build stages in", "PATH-OR-URL" },
   { "disable-download", 0, 0, G_OPTION_ARG_NONE, &opt_disable_download, "Don't download any new sources", NULL },
   { "disable-updates", 0, 0, G_OPTION_ARG_NONE, &opt_disable_updates, "Only download missing sources, never update to latest vcs version", NULL },
   { "download-only", 0, 0, G_OPTION_ARG_NONE, &opt_download_only, "Only download sources, don't build", NULL },
@@ -72,6 +77,7 @@ static GOptionEntry entries[] = {
   { "show-deps", 0, 0, G_OPTION_ARG_NONE, &opt_show_deps, "List the dependencies of the json file (see --show-deps --help)", NULL },
   { "require-changes", 0, 0, G_OPTION_ARG_NONE, &opt_require_changes, "Don't create app dir or export if no changes", NULL },
   { "keep-build-dirs", 0, 0, G_OPTION_ARG_NONE, &opt_keep_build_dirs, "Don't remove build directories after install", NULL },
+  { "cache-extracted-sources", 0, 0, G_OPTION_ARG_NONE, &opt_cache_extracted_sources, "Keep extracted sources to reuse when rebuilding modules", NULL },
   { "repo", 0, 0, G_OPTION_ARG_STRING, &opt_repo, "Repo to export into", "DIR"},
   { "subject", 's', 0, G_OPTION_ARG_STRING, &opt_subject, "One line subject (passed to build-export)", "SUBJECT" },
   { "body", 'b', 0, G_OPTION_ARG_STRING, &opt_body, "Full description (passed to build-export)", "BODY" },
@@ -81,6 +87,8 @@ static GOptionEntry entries[] = {
   { "sandbox", 0, 0, G_OPTION_ARG_NONE, &opt_sandboxed, "Enforce sandboxing, disabling build-args", NULL },
   { "stop-at", 0, 0, G_OPTION_ARG_STRING, &opt_stop_at, "Stop building at this module (implies --build-only)", "MODULENAME"},
   { "jobs", 0, 0, G_OPTION_ARG_INT, &opt_jobs, "Number of parallel jobs to build (default=NCPU)", "JOBS"},
+  { "module-jobs", 0, 0, G_OPTION_ARG_INT, &opt_module_jobs, "Number of independent modules to build at the same time (default=1)", "JOBS"},
+  { "build-report", 0, 0, G_OPTION_ARG_FILENAME, &opt_build_report, "Write the time spent building each module to FILE as JSON", "FILE"},
   { NULL }
 };
 
@@ -322,8 +330,11 @@ main (int    argc,
   build_context = builder_context_new (base_dir, app_dir);
 
   builder_context_set_keep_build_dirs (build_context, opt_keep_build_dirs);
+  builder_context_set_cache_extracted_sources (build_context, opt_cache_extracted_sources);
   builder_context_set_sandboxed (build_context, opt_sandboxed);
   builder_context_set_jobs (build_context, opt_jobs);
+  builder_context_set_module_jobs (build_context, opt_module_jobs);
+  builder_context_set_build_report (build_context, opt_build_report);
 
   if (opt_arch)
     builder_context_set_arch (build_context, opt_arch);
@@ -413,6 +424,12 @@ main (int    argc,
   cache_branch = g_path_get_basename (manifest_path);
 
   cache = builder_cache_new (builder_context_get_cache_dir (build_context), app_dir, cache_branch);
+  if (opt_cache_repo &&
+      !builder_cache_set_shared (cache, opt_cache_repo, builder_context_get_arch (build_context), &error))
+    {
+      g_printerr ("Error opening cache: %s\n", error->message);
+      return 1;
+    }
   if (!builder_cache_open (cache, &error))
     {
       g_printerr ("Error opening cache: %s\n", error->message);
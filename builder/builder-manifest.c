@@ -25,6 +25,7 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <sys/statfs.h>
 
 #include "builder-manifest.h"
@@ -174,6 +175,8 @@ expand_modules (GList *modules, GList **expanded, GHashTable *names, GError **er
       BuilderModule *m = l->data;
       GList *submodules = NULL;
       const char *name;
+      const char **depends;
+      int i;
 
       if (builder_module_get_disabled (m))
         continue;
@@ -201,6 +204,21 @@ expand_modules (GList *modules, GList **expanded, GHashTable *names, GError **er
                        "Duplicate modules named '%s'", name);
           return FALSE;
         }
+
+      /* Modules are built in order, so any dependency must come earlier.
+         Otherwise a typo would make the module look independent. */
+      depends = builder_module_get_depends (m);
+      for (i = 0; depends != NULL && depends[i] != NULL; i++)
+        {
+          if (g_hash_table_lookup (names, depends[i]) == NULL)
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Module '%s' depends on '%s', which is not an earlier module",
+                           name, depends[i]);
+              return FALSE;
+            }
+        }
+
       g_hash_table_insert (names, (char *)name, (char *)name);
       *expanded = g_list_append (*expanded, m);
     }
@@ -1351,6 +1369,665 @@ builder_manifest_download (BuilderManifest *self,
   return TRUE;
 }
 
+typedef struct
+{
+  BuilderModule  *module;
+  BuilderContext *context;
+  GFile          *app_dir;
+  GFile          *staging_dir;
+  GPtrArray      *changed;  /* Paths installed or modified by the module, parents first */
+  GPtrArray      *removed;  /* Paths the module removed */
+  gint64          elapsed;
+  GError         *error;
+} StagedBuild;
+
+static void
+staged_build_free (StagedBuild *build)
+{
+  if (build->staging_dir)
+    (void) flatpak_rm_rf (build->staging_dir, NULL, NULL);
+  g_clear_object (&build->staging_dir);
+  g_clear_object (&build->module);
+  g_clear_pointer (&build->changed, g_ptr_array_unref);
+  g_clear_pointer (&build->removed, g_ptr_array_unref);
+  g_clear_error (&build->error);
+  g_free (build);
+}
+
+static void
+add_module_report (JsonArray     *report,
+                   BuilderModule *m,
+                   gboolean       cache_hit,
+                   gint64         elapsed,
+                   GFile         *app_dir,
+                   GPtrArray     *changes)
+{
+  JsonObject *module_report = json_object_new ();
+
+  json_object_set_string_member (module_report, "name", builder_module_get_name (m));
+  json_object_set_string_member (module_report, "cache", cache_hit ? "hit" : "miss");
+  json_object_set_double_member (module_report, "wall-time", elapsed / (double) G_USEC_PER_SEC);
+  json_object_set_int_member (module_report, "changed-paths", changes->len);
+
+  /* Cache hits are not checked out, so we can only measure what was built */
+  if (!cache_hit)
+    {
+      guint64 installed_size = 0;
+      int i;
+
+      for (i = 0; i < changes->len; i++)
+        {
+          g_autoptr(GFile) file = g_file_resolve_relative_path (app_dir, g_ptr_array_index (changes, i));
+          struct stat stbuf;
+
+          if (lstat (flatpak_file_get_path_cached (file), &stbuf) == 0 &&
+              !S_ISDIR (stbuf.st_mode))
+            installed_size += stbuf.st_size;
+        }
+
+      json_object_set_int_member (module_report, "installed-size", installed_size);
+    }
+
+  json_object_set_object_member (module_report, "phases",
+                                 json_object_ref (builder_module_get_phases (m)));
+
+  json_array_add_object_element (report, module_report);
+}
+
+static gboolean
+write_build_report (BuilderManifest *self,
+                    JsonArray       *modules,
+                    gint64           elapsed,
+                    const char      *path,
+                    GError         **error)
+{
+  g_autoptr(JsonGenerator) generator = json_generator_new ();
+  g_autoptr(JsonNode) root = json_node_new (JSON_NODE_OBJECT);
+  JsonObject *report = json_object_new ();
+
+  json_object_set_string_member (report, "id", self->id ? self->id : "app");
+  json_object_set_double_member (report, "wall-time", elapsed / (double) G_USEC_PER_SEC);
+  json_object_set_array_member (report, "modules", json_array_ref (modules));
+  json_node_take_object (root, report);
+
+  json_generator_set_pretty (generator, TRUE);
+  json_generator_set_root (generator, root);
+
+  return json_generator_to_file (generator, path, error);
+}
+
+/* Returns the last module of the wave starting at first, i.e. the
+ * following modules that declared their dependencies and depend on
+ * nothing else in the wave. These can be built at the same time, as
+ * everything they need is already in the app dir. */
+static GList *
+find_module_wave (GList      *first,
+                  const char *stop_at,
+                  int         max_modules)
+{
+  g_autoptr(GHashTable) names = g_hash_table_new (g_str_hash, g_str_equal);
+  GList *last = first;
+  GList *l;
+
+  g_hash_table_add (names, (char *) builder_module_get_name (first->data));
+
+  for (l = first->next; l != NULL && (int) g_hash_table_size (names) < max_modules; l = l->next)
+    {
+      BuilderModule *m = l->data;
+      const char *name = builder_module_get_name (m);
+      const char **depends = builder_module_get_depends (m);
+      int i;
+
+      if (depends == NULL ||
+          builder_module_get_sources (m) == NULL ||
+          (stop_at != NULL && strcmp (name, stop_at) == 0))
+        break;
+
+      for (i = 0; depends[i] != NULL; i++)
+        {
+          if (g_hash_table_contains (names, depends[i]))
+            break;
+        }
+
+      if (depends[i] != NULL)
+        break;
+
+      g_hash_table_add (names, (char *) name);
+      last = l;
+    }
+
+  return last;
+}
+
+static gboolean
+staged_file_differs (int          base_dfd,
+                     int          staged_dfd,
+                     const char  *name,
+                     struct stat *base_buf,
+                     struct stat *staged_buf,
+                     GError     **error)
+{
+  g_autofree char *base_target = NULL;
+  g_autofree char *staged_target = NULL;
+
+  if (base_buf->st_mode != staged_buf->st_mode ||
+      base_buf->st_size != staged_buf->st_size ||
+      base_buf->st_mtim.tv_sec != staged_buf->st_mtim.tv_sec ||
+      base_buf->st_mtim.tv_nsec != staged_buf->st_mtim.tv_nsec)
+    return TRUE;
+
+  if (!S_ISLNK (staged_buf->st_mode))
+    return FALSE;
+
+  base_target = glnx_readlinkat_malloc (base_dfd, name, NULL, error);
+  if (base_target == NULL)
+    return FALSE;
+
+  staged_target = glnx_readlinkat_malloc (staged_dfd, name, NULL, error);
+  if (staged_target == NULL)
+    return FALSE;
+
+  return strcmp (base_target, staged_target) != 0;
+}
+
+/* Compares the staging copy with the (unmodified) app dir it was
+ * copied from. base_dfd is -1 if the directory is new. */
+static gboolean
+diff_staged_dir (int          base_dfd,
+                 int          staged_dfd,
+                 const char  *rel_dir,
+                 StagedBuild *build,
+                 GError     **error)
+{
+  g_auto(GLnxDirFdIterator) staged_iter = {0};
+  g_auto(GLnxDirFdIterator) base_iter = {0};
+  struct dirent *dent;
+
+  if (!glnx_dirfd_iterator_init_at (staged_dfd, ".", FALSE, &staged_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct stat stbuf;
+      struct stat base_stbuf;
+      gboolean in_base = FALSE;
+      g_autofree char *path = NULL;
+      g_autoptr(GError) local_error = NULL;
+
+      if (!glnx_dirfd_iterator_next_dent (&staged_iter, &dent, NULL, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (fstatat (staged_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      if (base_dfd != -1)
+        {
+          if (fstatat (base_dfd, dent->d_name, &base_stbuf, AT_SYMLINK_NOFOLLOW) == 0)
+            in_base = TRUE;
+          else if (errno != ENOENT)
+            {
+              glnx_set_error_from_errno (error);
+              return FALSE;
+            }
+        }
+
+      path = rel_dir ? g_build_filename (rel_dir, dent->d_name, NULL) : g_strdup (dent->d_name);
+
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          glnx_fd_close int child_staged_dfd = -1;
+          glnx_fd_close int child_base_dfd = -1;
+
+          /* Directory mtimes change whenever something is installed,
+           * so only the mode matters here */
+          if (!in_base || base_stbuf.st_mode != stbuf.st_mode)
+            g_ptr_array_add (build->changed, g_strdup (path));
+
+          if (!glnx_opendirat (staged_iter.fd, dent->d_name, FALSE, &child_staged_dfd, error))
+            return FALSE;
+
+          if (in_base && S_ISDIR (base_stbuf.st_mode) &&
+              !glnx_opendirat (base_dfd, dent->d_name, FALSE, &child_base_dfd, error))
+            return FALSE;
+
+          if (!diff_staged_dir (child_base_dfd, child_staged_dfd, path, build, error))
+            return FALSE;
+        }
+      else if (!in_base)
+        {
+          g_ptr_array_add (build->changed, g_steal_pointer (&path));
+        }
+      else
+        {
+          if (staged_file_differs (base_dfd, staged_iter.fd, dent->d_name,
+                                   &base_stbuf, &stbuf, &local_error))
+            g_ptr_array_add (build->changed, g_steal_pointer (&path));
+          else if (local_error != NULL)
+            {
+              g_propagate_error (error, g_steal_pointer (&local_error));
+              return FALSE;
+            }
+        }
+    }
+
+  if (base_dfd == -1)
+    return TRUE;
+
+  if (!glnx_dirfd_iterator_init_at (base_dfd, ".", FALSE, &base_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct stat stbuf;
+
+      if (!glnx_dirfd_iterator_next_dent (&base_iter, &dent, NULL, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (fstatat (staged_dfd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == 0)
+        continue;
+
+      if (errno != ENOENT)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      g_ptr_array_add (build->removed,
+                       rel_dir ? g_build_filename (rel_dir, dent->d_name, NULL) : g_strdup (dent->d_name));
+    }
+
+  return TRUE;
+}
+
+static void
+staged_build_thread (gpointer data,
+                     gpointer user_data)
+{
+  StagedBuild *build = data;
+  g_autoptr(GMainContext) main_context = g_main_context_new ();
+  glnx_fd_close int base_dfd = -1;
+  glnx_fd_close int staged_dfd = -1;
+  BuilderTimer timer;
+
+  /* Spawning iterates the thread-default main context, so give
+   * each build its own to avoid stealing each others events. */
+  g_main_context_push_thread_default (main_context);
+
+  builder_timer_start (&timer);
+
+  if (builder_module_build_staged (build->module, build->staging_dir, build->context, &build->error) &&
+      glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (build->app_dir), FALSE, &base_dfd, &build->error) &&
+      glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (build->staging_dir), FALSE, &staged_dfd, &build->error))
+    diff_staged_dir (base_dfd, staged_dfd, NULL, build, &build->error);
+
+  build->elapsed = builder_timer_elapsed (&timer);
+
+  g_main_context_pop_thread_default (main_context);
+}
+
+/* Moves what the module installed in its staging dir into the app dir */
+static gboolean
+merge_staged_build (StagedBuild *build,
+                    GError     **error)
+{
+  glnx_fd_close int app_dfd = -1;
+  glnx_fd_close int staged_dfd = -1;
+  int i;
+
+  if (!glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (build->app_dir), FALSE, &app_dfd, error) ||
+      !glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (build->staging_dir), FALSE, &staged_dfd, error))
+    return FALSE;
+
+  for (i = 0; i < build->removed->len; i++)
+    {
+      const char *path = g_ptr_array_index (build->removed, i);
+
+      if (!glnx_shutil_rm_rf_at (app_dfd, path, NULL, error))
+        return FALSE;
+    }
+
+  for (i = 0; i < build->changed->len; i++)
+    {
+      const char *path = g_ptr_array_index (build->changed, i);
+      struct stat stbuf;
+      struct stat app_stbuf;
+      gboolean in_app;
+
+      if (fstatat (staged_dfd, path, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      in_app = fstatat (app_dfd, path, &app_stbuf, AT_SYMLINK_NOFOLLOW) == 0;
+
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          if (in_app && !S_ISDIR (app_stbuf.st_mode))
+            {
+              if (!glnx_shutil_rm_rf_at (app_dfd, path, NULL, error))
+                return FALSE;
+              in_app = FALSE;
+            }
+
+          if (!in_app && mkdirat (app_dfd, path, 0755) == -1)
+            {
+              glnx_set_error_from_errno (error);
+              return FALSE;
+            }
+
+          if (fchmodat (app_dfd, path, stbuf.st_mode & 07777, 0) == -1)
+            {
+              glnx_set_error_from_errno (error);
+              return FALSE;
+            }
+        }
+      else
+        {
+          if (in_app && S_ISDIR (app_stbuf.st_mode) &&
+              !glnx_shutil_rm_rf_at (app_dfd, path, NULL, error))
+            return FALSE;
+
+          if (renameat (staged_dfd, path, app_dfd, path) == -1)
+            {
+              if (errno != EXDEV)
+                {
+                  glnx_set_error_from_errno (error);
+                  return FALSE;
+                }
+
+              if (!glnx_file_copy_at (staged_dfd, path, &stbuf,
+                                      app_dfd, path,
+                                      GLNX_FILE_COPY_OVERWRITE,
+                                      NULL, error))
+                return FALSE;
+            }
+        }
+    }
+
+  return TRUE;
+}
+
+/* What the earlier modules in a wave did to a path */
+#define STAGED_FILE    (1 << 0)  /* Installed a non-directory */
+#define STAGED_DIR     (1 << 1)  /* Created a directory or changed its mode */
+#define STAGED_REMOVED (1 << 2)  /* Removed it, and everything below */
+#define STAGED_PARENT  (1 << 3)  /* Changed something below it */
+
+static void
+claim_staged_path (GHashTable *claims,
+                   const char *path,
+                   guint       kind)
+{
+  g_autofree char *parent = NULL;
+  guint old_kind = GPOINTER_TO_UINT (g_hash_table_lookup (claims, path));
+
+  g_hash_table_insert (claims, g_strdup (path), GUINT_TO_POINTER (old_kind | kind));
+
+  parent = g_path_get_dirname (path);
+  while (strcmp (parent, ".") != 0)
+    {
+      char *grandparent;
+
+      old_kind = GPOINTER_TO_UINT (g_hash_table_lookup (claims, parent));
+      g_hash_table_insert (claims, g_strdup (parent), GUINT_TO_POINTER (old_kind | STAGED_PARENT));
+
+      grandparent = g_path_get_dirname (parent);
+      g_free (parent);
+      parent = grandparent;
+    }
+}
+
+/* Whether the change of kind to path would overwrite, or be overwritten
+ * by, a change of an earlier module. Two modules creating the same
+ * directory, or removing the same path, is fine. */
+static gboolean
+staged_path_conflicts (GHashTable *claims,
+                       const char *path,
+                       guint       kind)
+{
+  g_autofree char *parent = NULL;
+  guint conflicts;
+
+  if (kind == STAGED_FILE)
+    conflicts = STAGED_FILE | STAGED_DIR | STAGED_REMOVED | STAGED_PARENT;
+  else if (kind == STAGED_DIR)
+    conflicts = STAGED_FILE | STAGED_REMOVED;
+  else
+    conflicts = STAGED_FILE | STAGED_DIR | STAGED_PARENT;
+
+  if (GPOINTER_TO_UINT (g_hash_table_lookup (claims, path)) & conflicts)
+    return TRUE;
+
+  parent = g_path_get_dirname (path);
+  while (strcmp (parent, ".") != 0)
+    {
+      char *grandparent;
+
+      if (GPOINTER_TO_UINT (g_hash_table_lookup (claims, parent)) & (STAGED_FILE | STAGED_REMOVED))
+        return TRUE;
+
+      grandparent = g_path_get_dirname (parent);
+      g_free (parent);
+      parent = grandparent;
+    }
+
+  return FALSE;
+}
+
+/* All modules in a wave are diffed against the same app dir, so if two
+ * of them touch the same path the later merge would silently undo the
+ * earlier one. Returns how many builds, from the start of the wave, can
+ * be merged without that happening. */
+static gboolean
+count_mergeable_builds (GPtrArray *builds,
+                        guint     *n_mergeable_out,
+                        GError   **error)
+{
+  g_autoptr(GHashTable) claims = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  guint i;
+
+  for (i = 0; i < builds->len; i++)
+    {
+      StagedBuild *build = g_ptr_array_index (builds, i);
+      g_autofree guint *kinds = g_new (guint, build->changed->len);
+      glnx_fd_close int staged_dfd = -1;
+      const char *conflict = NULL;
+      int j;
+
+      if (!glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (build->staging_dir), FALSE, &staged_dfd, error))
+        return FALSE;
+
+      for (j = 0; j < build->changed->len; j++)
+        {
+          const char *path = g_ptr_array_index (build->changed, j);
+          struct stat stbuf;
+
+          if (fstatat (staged_dfd, path, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+            {
+              glnx_set_error_from_errno (error);
+              return FALSE;
+            }
+
+          kinds[j] = S_ISDIR (stbuf.st_mode) ? STAGED_DIR : STAGED_FILE;
+          if (conflict == NULL && staged_path_conflicts (claims, path, kinds[j]))
+            conflict = path;
+        }
+
+      for (j = 0; conflict == NULL && j < build->removed->len; j++)
+        {
+          const char *path = g_ptr_array_index (build->removed, j);
+
+          if (staged_path_conflicts (claims, path, STAGED_REMOVED))
+            conflict = path;
+        }
+
+      if (conflict != NULL)
+        {
+          g_print ("Module %s changes %s, like an earlier module built in parallel, building it again separately\n",
+                   builder_module_get_name (build->module), conflict);
+          break;
+        }
+
+      for (j = 0; j < build->changed->len; j++)
+        claim_staged_path (claims, g_ptr_array_index (build->changed, j), kinds[j]);
+
+      for (j = 0; j < build->removed->len; j++)
+        claim_staged_path (claims, g_ptr_array_index (build->removed, j), STAGED_REMOVED);
+    }
+
+  *n_mergeable_out = i;
+  return TRUE;
+}
+
+/* Builds the modules from first to last concurrently, each in its own
+ * copy of the app dir, and then merges and commits them in manifest
+ * order. The first module has already been checksummed and looked up.
+ * If a module's changes overlap with an earlier one's, it and the rest
+ * of the wave are not merged, and *last_merged_out is set to the last
+ * module that was. */
+static gboolean
+build_module_wave (GList          *first,
+                   GList          *last,
+                   BuilderCache   *cache,
+                   BuilderContext *context,
+                   JsonArray      *report,
+                   GList         **last_merged_out,
+                   GError        **error)
+{
+  GFile *app_dir = builder_context_get_app_dir (context);
+  g_autoptr(GFile) staging_parent = g_file_get_child (builder_context_get_state_dir (context), "staging");
+  g_autoptr(GPtrArray) builds = g_ptr_array_new_with_free_func ((GDestroyNotify) staged_build_free);
+  GThreadPool *pool;
+  GList *l;
+  guint n_mergeable;
+  int i;
+
+  if (!flatpak_mkdir_p (staging_parent, NULL, error))
+    return FALSE;
+
+  for (l = first; l != last->next; l = l->next)
+    {
+      BuilderModule *m = l->data;
+      StagedBuild *build = g_new0 (StagedBuild, 1);
+      g_autofree char *staging_path = NULL;
+      const char *cp_argv[] = { "cp", "-a", "--reflink=auto", NULL, NULL, NULL };
+
+      build->module = g_object_ref (m);
+      build->context = context;
+      build->app_dir = app_dir;
+      build->changed = g_ptr_array_new_with_free_func (g_free);
+      build->removed = g_ptr_array_new_with_free_func (g_free);
+      g_ptr_array_add (builds, build);
+
+      build->staging_dir = g_file_get_child (staging_parent, builder_module_get_name (m));
+      if (!flatpak_rm_rf (build->staging_dir, NULL, error))
+        return FALSE;
+
+      staging_path = g_file_get_path (build->staging_dir);
+      cp_argv[3] = flatpak_file_get_path_cached (app_dir);
+      cp_argv[4] = staging_path;
+      if (!flatpak_spawnv (NULL, NULL, error, cp_argv))
+        return FALSE;
+    }
+
+  g_print ("Building %d independent modules in parallel\n", builds->len);
+
+  pool = g_thread_pool_new (staged_build_thread, NULL,
+                            builder_context_get_module_jobs (context),
+                            FALSE, error);
+  if (pool == NULL)
+    return FALSE;
+
+  for (i = 0; i < builds->len; i++)
+    g_thread_pool_push (pool, g_ptr_array_index (builds, i), NULL);
+
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  for (i = 0; i < builds->len; i++)
+    {
+      StagedBuild *build = g_ptr_array_index (builds, i);
+
+      if (build->error != NULL)
+        {
+          g_propagate_error (error, g_steal_pointer (&build->error));
+          return FALSE;
+        }
+    }
+
+  if (!count_mergeable_builds (builds, &n_mergeable, error))
+    return FALSE;
+
+  for (i = n_mergeable; i < builds->len; i++)
+    {
+      StagedBuild *build = g_ptr_array_index (builds, i);
+
+      builder_module_discard_staged (build->module, context);
+    }
+
+  *last_merged_out = first;
+  for (i = 0; i < n_mergeable; i++)
+    {
+      StagedBuild *build = g_ptr_array_index (builds, i);
+      BuilderModule *m = build->module;
+      const char *name = builder_module_get_name (m);
+      g_autofree char *body = g_strdup_printf ("Built %s\n", name);
+      g_autoptr(GPtrArray) changes = NULL;
+      BuilderTimer module_timer;
+      BuilderTimer commit_timer;
+
+      builder_timer_start (&module_timer);
+
+      if (i > 0)
+        {
+          g_autofree char *stage = g_strdup_printf ("build-%s", name);
+
+          builder_module_checksum (m, cache, context);
+          /* Always a miss, but sets up the stage for the commit */
+          builder_cache_lookup (cache, stage);
+        }
+
+      if (!merge_staged_build (build, error))
+        {
+          g_prefix_error (error, "module %s: ", name);
+          return FALSE;
+        }
+
+      if (!builder_module_finish_staged (m, cache, context, error))
+        return FALSE;
+
+      builder_timer_start (&commit_timer);
+      if (!builder_cache_commit (cache, body, error))
+        return FALSE;
+      builder_timer_report (&commit_timer, builder_module_get_phases (m), "commit");
+
+      changes = builder_cache_get_changes (cache, error);
+      if (changes == NULL)
+        return FALSE;
+
+      builder_module_set_changes (m, changes);
+
+      add_module_report (report, m, FALSE,
+                         build->elapsed + builder_timer_elapsed (&module_timer),
+                         app_dir, changes);
+
+      builder_module_update (m, context, error);
+
+      *last_merged_out = g_list_nth (first, i);
+    }
+
+  return TRUE;
+}
+
 gboolean
 builder_manifest_build (BuilderManifest *self,
                         BuilderCache    *cache,
@@ -1358,8 +2035,13 @@ builder_manifest_build (BuilderManifest *self,
                         GError         **error)
 {
   const char *stop_at = builder_context_get_stop_at (context);
+  const char *report_path = builder_context_get_build_report (context);
+  g_autoptr(JsonArray) report = json_array_new ();
+  BuilderTimer build_timer;
   GList *l;
 
+  builder_timer_start (&build_timer);
+
   builder_context_set_options (context, self->build_options);
   builder_context_set_global_cleanup (context, (const char **) self->cleanup);
   builder_context_set_global_cleanup_platform (context, (const char **) self->cleanup_platform);
@@ -1372,13 +2054,15 @@ builder_manifest_build (BuilderManifest *self,
       BuilderModule *m = l->data;
       g_autoptr(GPtrArray) changes = NULL;
       const char *name = builder_module_get_name (m);
+      BuilderTimer module_timer;
+      gboolean cache_hit;
 
       g_autofree char *stage = g_strdup_printf ("build-%s", name);
 
       if (stop_at != NULL && strcmp (name, stop_at) == 0)
         {
           g_print ("Stopping at module %s\n", stop_at);
-          return TRUE;
+          break;
         }
 
       if (!builder_module_get_sources (m))
@@ -1387,16 +2071,36 @@ builder_manifest_build (BuilderManifest *self,
           continue;
         }
 
+      builder_timer_start (&module_timer);
+
       builder_module_checksum (m, cache, context);
 
-      if (!builder_cache_lookup (cache, stage))
+      cache_hit = builder_cache_lookup (cache, stage);
+      if (!cache_hit)
         {
           g_autofree char *body =
             g_strdup_printf ("Built %s\n", name);
+          GList *last = l;
+          BuilderTimer commit_timer;
+
+          if (builder_context_get_module_jobs (context) > 1)
+            last = find_module_wave (l, stop_at, builder_context_get_module_jobs (context));
+
+          if (last != l)
+            {
+              if (!build_module_wave (l, last, cache, context, report, &last, error))
+                return FALSE;
+              l = last;
+              continue;
+            }
+
           if (!builder_module_build (m, cache, context, error))
             return FALSE;
+
+          builder_timer_start (&commit_timer);
           if (!builder_cache_commit (cache, body, error))
             return FALSE;
+          builder_timer_report (&commit_timer, builder_module_get_phases (m), "commit");
         }
       else
         {
@@ -1409,9 +2113,16 @@ builder_manifest_build (BuilderManifest *self,
 
       builder_module_set_changes (m, changes);
 
+      add_module_report (report, m, cache_hit, builder_timer_elapsed (&module_timer),
+                         builder_context_get_app_dir (context), changes);
+
       builder_module_update (m, context, error);
     }
 
+  if (report_path != NULL &&
+      !write_build_report (self, report, builder_timer_elapsed (&build_timer), report_path, error))
+    return FALSE;
+
   return TRUE;
 }
 
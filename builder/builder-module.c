@@ -33,6 +33,8 @@
 #include "flatpak-utils.h"
 #include "builder-utils.h"
 #include "builder-module.h"
+#include "builder-source-shell.h"
+#include "builder-source-git.h"
 
 struct BuilderModule
 {
@@ -55,10 +57,16 @@ struct BuilderModule
   gboolean        builddir;
   BuilderOptions *build_options;
   GPtrArray      *changes;
+  JsonObject     *phases;
   char          **cleanup;
   char          **cleanup_platform;
+  char          **depends;
   GList          *sources;
   GList          *modules;
+
+  /* Set between builder_module_build_staged() and builder_module_finish_staged() */
+  GFile          *staged_source_dir;
+  GFile          *staged_build_link;
 };
 
 typedef struct
@@ -92,6 +100,7 @@ enum {
   PROP_CLEANUP_PLATFORM,
   PROP_POST_INSTALL,
   PROP_MODULES,
+  PROP_DEPENDS,
   LAST_PROP
 };
 
@@ -113,10 +122,14 @@ builder_module_finalize (GObject *object)
   g_list_free_full (self->sources, g_object_unref);
   g_strfreev (self->cleanup);
   g_strfreev (self->cleanup_platform);
+  g_strfreev (self->depends);
   g_list_free_full (self->modules, g_object_unref);
+  g_clear_object (&self->staged_source_dir);
+  g_clear_object (&self->staged_build_link);
 
   if (self->changes)
     g_ptr_array_unref (self->changes);
+  json_object_unref (self->phases);
 
   G_OBJECT_CLASS (builder_module_parent_class)->finalize (object);
 }
@@ -187,6 +200,10 @@ builder_module_get_property (GObject    *object,
       g_value_set_boxed (value, self->post_install);
       break;
 
+    case PROP_DEPENDS:
+      g_value_set_boxed (value, self->depends);
+      break;
+
     case PROP_BUILD_OPTIONS:
       g_value_set_object (value, self->build_options);
       break;
@@ -294,6 +311,12 @@ builder_module_set_property (GObject      *object,
       g_strfreev (tmp);
       break;
 
+    case PROP_DEPENDS:
+      tmp = self->depends;
+      self->depends = g_strdupv (g_value_get_boxed (value));
+      g_strfreev (tmp);
+      break;
+
     case PROP_BUILD_OPTIONS:
       g_set_object (&self->build_options,  g_value_get_object (value));
       break;
@@ -467,11 +490,19 @@ builder_module_class_init (BuilderModuleClass *klass)
                                                          "",
                                                          "",
                                                          G_PARAM_READWRITE));
+  g_object_class_install_property (object_class,
+                                   PROP_DEPENDS,
+                                   g_param_spec_boxed ("depends",
+                                                       "",
+                                                       "",
+                                                       G_TYPE_STRV,
+                                                       G_PARAM_READWRITE));
 }
 
 static void
 builder_module_init (BuilderModule *self)
 {
+  self->phases = json_object_new ();
 }
 
 static JsonNode *
@@ -668,12 +699,27 @@ builder_module_get_sources (BuilderModule *self)
   return self->sources;
 }
 
+/* NULL means the module didn't declare its dependencies, and
+ * has to be assumed to depend on all the modules before it. */
+const char **
+builder_module_get_depends (BuilderModule *self)
+{
+  return (const char **) self->depends;
+}
+
 GList *
 builder_module_get_modules (BuilderModule *self)
 {
   return self->modules;
 }
 
+/* The timing of the build phases, see builder_timer_report() */
+JsonObject *
+builder_module_get_phases (BuilderModule *self)
+{
+  return self->phases;
+}
+
 gboolean
 builder_module_show_deps (BuilderModule *self,
                           GError         **error)
@@ -715,27 +761,132 @@ builder_module_download_sources (BuilderModule  *self,
   return TRUE;
 }
 
+/* Returns the key for the extracted source cache, or NULL if the
+ * result of the extraction depends on more than the sources. */
+static char *
+builder_module_get_sources_checksum (BuilderModule  *self,
+                                     BuilderContext *context)
+{
+  g_autoptr(BuilderCache) cache = builder_cache_new (NULL, NULL, NULL);
+  GList *l;
+
+  builder_cache_checksum_str (cache, BUILDER_MODULE_CHECKSUM_VERSION);
+
+  for (l = self->sources; l != NULL; l = l->next)
+    {
+      BuilderSource *source = l->data;
+
+      /* Shell commands run in the build environment */
+      if (BUILDER_IS_SOURCE_SHELL (source))
+        return NULL;
+
+      /* Shared clones point into the mirror, which may change */
+      if (BUILDER_IS_SOURCE_GIT (source))
+        {
+          gboolean shared_clone;
+
+          g_object_get (source, "shared-clone", &shared_clone, NULL);
+          if (shared_clone)
+            return NULL;
+        }
+
+      builder_source_checksum (source, cache, context);
+    }
+
+  return g_strdup (g_checksum_get_string (builder_cache_get_checksum (cache)));
+}
+
+static gboolean
+copy_extracted_sources (GFile   *src,
+                        GFile   *dest,
+                        GError **error)
+{
+  g_autofree char *src_contents = g_build_filename (flatpak_file_get_path_cached (src), ".", NULL);
+  const char *argv[] = { "cp", "-a", "--reflink=auto", src_contents, flatpak_file_get_path_cached (dest), NULL };
+
+  return flatpak_spawnv (NULL, NULL, error, argv);
+}
+
+static gboolean
+builder_module_extract_sources_to (BuilderModule  *self,
+                                   GFile          *dest,
+                                   BuilderContext *context,
+                                   GError        **error)
+{
+  GList *l;
+
+  for (l = self->sources; l != NULL; l = l->next)
+    {
+      BuilderSource *source = l->data;
+
+      if (!builder_source_extract (source, dest, self->build_options, context, error))
+        {
+          g_prefix_error (error, "module %s: ", self->name);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
 gboolean
 builder_module_extract_sources (BuilderModule  *self,
                                 GFile          *dest,
                                 BuilderContext *context,
                                 GError        **error)
 {
-  GList *l;
+  g_autofree char *checksum = NULL;
+  g_autoptr(GFile) cache_dir = NULL;
+  g_autoptr(GFile) module_cache_dir = NULL;
+  g_autoptr(GFile) cached = NULL;
+  g_autoptr(GFile) cached_tmp = NULL;
+  g_autofree char *cached_tmp_name = NULL;
 
   if (!g_file_query_exists (dest, NULL) &&
       !g_file_make_directory_with_parents (dest, NULL, error))
     return FALSE;
 
-  for (l = self->sources; l != NULL; l = l->next)
-    {
-      BuilderSource *source = l->data;
+  if (builder_context_get_cache_extracted_sources (context))
+    checksum = builder_module_get_sources_checksum (self, context);
 
-      if (!builder_source_extract (source, dest, self->build_options, context, error))
+  if (checksum == NULL)
+    return builder_module_extract_sources_to (self, dest, context, error);
+
+  /* We keep only the latest extraction of each module, keyed by the
+   * checksum of its sources, so a rebuild with the same sources
+   * (e.g. after changing build options) can just copy it. */
+  cache_dir = g_file_get_child (builder_context_get_state_dir (context), "extracted-sources");
+  module_cache_dir = g_file_get_child (cache_dir, self->name);
+  cached = g_file_get_child (module_cache_dir, checksum);
+
+  if (!g_file_query_exists (cached, NULL))
+    {
+      if (!flatpak_rm_rf (module_cache_dir, NULL, error) ||
+          !flatpak_mkdir_p (module_cache_dir, NULL, error))
         {
           g_prefix_error (error, "module %s: ", self->name);
           return FALSE;
         }
+
+      cached_tmp_name = g_strconcat (checksum, ".tmp", NULL);
+      cached_tmp = g_file_get_child (module_cache_dir, cached_tmp_name);
+
+      if (!g_file_make_directory (cached_tmp, NULL, error) ||
+          !builder_module_extract_sources_to (self, cached_tmp, context, error))
+        return FALSE;
+
+      if (!g_file_move (cached_tmp, cached, G_FILE_COPY_NONE, NULL, NULL, NULL, error))
+        return FALSE;
+    }
+  else
+    {
+      g_print ("Using cached extracted sources for %s\n", self->name);
+    }
+
+  if (!copy_extracted_sources (cached, dest, error))
+    {
+      g_prefix_error (error, "module %s: ", self->name);
+      return FALSE;
     }
 
   return TRUE;
@@ -1017,165 +1168,154 @@ builder_module_handle_debuginfo (BuilderModule  *self,
   return TRUE;
 }
 
+/* Called for each file in the app dir, possibly from multiple threads */
 static gboolean
-fixup_python_timestamp (int dfd,
-                        const char *rel_path,
-                        const char *full_path,
-                        GCancellable  *cancellable,
+fixup_python_timestamp (int            dfd,
+                        const char    *rel_dir,
+                        struct dirent *dent,
+                        gpointer       user_data,
                         GError       **error)
 {
-  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
-
-  glnx_dirfd_iterator_init_at (dfd, rel_path, FALSE, &dfd_iter, NULL);
-
-  while (TRUE)
+  const char *dir_name;
+  glnx_fd_close int fd = -1;
+  guint8 buffer[8];
+  ssize_t res;
+  guint32 pyc_mtime;
+  g_autofree char *py_path = NULL;
+  struct stat stbuf;
+  gboolean remove_pyc = FALSE;
+
+  if (dent->d_type != DT_REG ||
+      *rel_dir == 0 ||
+      !(g_str_has_suffix (dent->d_name, ".pyc") ||
+        g_str_has_suffix (dent->d_name, ".pyo")))
+    return TRUE;
+
+  dir_name = strrchr (rel_dir, '/');
+  dir_name = dir_name ? dir_name + 1 : rel_dir;
+
+  fd = openat (dfd, dent->d_name, O_RDWR | O_CLOEXEC | O_NOFOLLOW);
+  if (fd == -1)
     {
-      struct dirent *dent;
-
-      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, NULL, NULL) || dent == NULL)
-        break;
-
-      if (dent->d_type == DT_DIR)
-        {
-          g_autofree char *child_full_path = g_build_filename (full_path, dent->d_name, NULL);
-          if (!fixup_python_timestamp (dfd_iter.fd, dent->d_name, child_full_path,
-                                       cancellable, error))
-            return FALSE;
-        }
-      else if (dent->d_type == DT_REG &&
-               dfd != AT_FDCWD &&
-               (g_str_has_suffix (dent->d_name, ".pyc") ||
-                g_str_has_suffix (dent->d_name, ".pyo")))
-        {
-          glnx_fd_close int fd = -1;
-          guint8 buffer[8];
-          ssize_t res;
-          guint32 pyc_mtime;
-          g_autofree char *py_path = NULL;
-          struct stat stbuf;
-          gboolean remove_pyc = FALSE;
-
-          fd = openat (dfd_iter.fd, dent->d_name, O_RDWR | O_CLOEXEC | O_NOFOLLOW);
-          if (fd == -1)
-            {
-              g_warning ("Can't open %s", dent->d_name);
-              continue;
-            }
+      g_warning ("Can't open %s", dent->d_name);
+      return TRUE;
+    }
 
-          res = read (fd, buffer, 8);
-          if (res != 8)
-            {
-              g_warning ("Short read for %s", dent->d_name);
-              continue;
-            }
+  res = read (fd, buffer, 8);
+  if (res != 8)
+    {
+      g_warning ("Short read for %s", dent->d_name);
+      return TRUE;
+    }
 
-          if (buffer[2] != 0x0d || buffer[3] != 0x0a)
-            {
-              g_debug ("Not matching python magic: %s", dent->d_name);
-              continue;
-            }
+  if (buffer[2] != 0x0d || buffer[3] != 0x0a)
+    {
+      g_debug ("Not matching python magic: %s", dent->d_name);
+      return TRUE;
+    }
 
-          pyc_mtime =
-            (buffer[4] << 8*0) |
-            (buffer[5] << 8*1) |
-            (buffer[6] << 8*2) |
-            (buffer[7] << 8*3);
+  pyc_mtime =
+    (buffer[4] << 8*0) |
+    (buffer[5] << 8*1) |
+    (buffer[6] << 8*2) |
+    (buffer[7] << 8*3);
 
-          if (strcmp (rel_path, "__pycache__") == 0)
-            {
-              /* Python3 */
-              g_autofree char *base = g_strdup (dent->d_name);
-              char *dot;
+  if (strcmp (dir_name, "__pycache__") == 0)
+    {
+      /* Python3 */
+      g_autofree char *base = g_strdup (dent->d_name);
+      char *dot;
 
-              dot = strrchr (base, '.');
-              if (dot == NULL)
-                continue;
-              *dot = 0;
+      dot = strrchr (base, '.');
+      if (dot == NULL)
+        return TRUE;
+      *dot = 0;
 
-              dot = strrchr (base, '.');
-              if (dot == NULL)
-                continue;
-              *dot = 0;
+      dot = strrchr (base, '.');
+      if (dot == NULL)
+        return TRUE;
+      *dot = 0;
 
-              py_path = g_strconcat ("../", base, ".py", NULL);
-            }
-          else
-            {
-              /* Python2 */
-              py_path = g_strndup (dent->d_name, strlen (dent->d_name) - 1);
-            }
+      py_path = g_strconcat ("../", base, ".py", NULL);
+    }
+  else
+    {
+      /* Python2 */
+      py_path = g_strndup (dent->d_name, strlen (dent->d_name) - 1);
+    }
 
-          /* Here we found a .pyc (or .pyo) file an a possible .py file that apply for it.
-           * There are several possible cases wrt their mtimes:
-           *
-           * py not existing: pyc is stale, remove it
-           * pyc mtime == 0: (.pyc is from an old commited module)
-           *     py mtime == 0: Do nothing, already correct
-           *     py mtime != 0: The py changed in this module, remove pyc
-           * pyc mtime != 0: (.pyc changed this module, or was never rewritten in base layer)
-           *     py == 0: Shouldn't happen in flatpak-builder, but could be an un-rewritten ctime lower layer, assume it matches and update timestamp
-           *     py mtime != pyc mtime: new pyc doesn't match last py written in this module, remove it
-           *     py mtime == pyc mtime: These match, but the py will be set to mtime 0 by ostree, so update timestamp in pyc.
-           */
-
-          if (fstatat (dfd_iter.fd, py_path, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
-            {
-              remove_pyc = TRUE;
-            }
-          else if (pyc_mtime == OSTREE_TIMESTAMP)
-            {
-              if (stbuf.st_mtime == OSTREE_TIMESTAMP)
-                continue; /* Previously handled pyc */
+  /* Here we found a .pyc (or .pyo) file an a possible .py file that apply for it.
+   * There are several possible cases wrt their mtimes:
+   *
+   * py not existing: pyc is stale, remove it
+   * pyc mtime == 0: (.pyc is from an old commited module)
+   *     py mtime == 0: Do nothing, already correct
+   *     py mtime != 0: The py changed in this module, remove pyc
+   * pyc mtime != 0: (.pyc changed this module, or was never rewritten in base layer)
+   *     py == 0: Shouldn't happen in flatpak-builder, but could be an un-rewritten ctime lower layer, assume it matches and update timestamp
+   *     py mtime != pyc mtime: new pyc doesn't match last py written in this module, remove it
+   *     py mtime == pyc mtime: These match, but the py will be set to mtime 0 by ostree, so update timestamp in pyc.
+   */
+
+  if (fstatat (dfd, py_path, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+      remove_pyc = TRUE;
+    }
+  else if (pyc_mtime == OSTREE_TIMESTAMP)
+    {
+      if (stbuf.st_mtime == OSTREE_TIMESTAMP)
+        return TRUE; /* Previously handled pyc */
 
-              remove_pyc = TRUE;
-            }
-          else /* pyc_mtime != 0 */
-            {
-              if (pyc_mtime != stbuf.st_mtime && stbuf.st_mtime != OSTREE_TIMESTAMP)
-                remove_pyc = TRUE;
-              /* else change mtime */
-            }
+      remove_pyc = TRUE;
+    }
+  else /* pyc_mtime != 0 */
+    {
+      if (pyc_mtime != stbuf.st_mtime && stbuf.st_mtime != OSTREE_TIMESTAMP)
+        remove_pyc = TRUE;
+      /* else change mtime */
+    }
 
-          if (remove_pyc)
-            {
-              g_autofree char *child_full_path = g_build_filename (full_path, dent->d_name, NULL);
-              g_print ("Removing stale python bytecode file %s\n", child_full_path);
-              if (unlinkat (dfd_iter.fd, dent->d_name, 0) != 0)
-                g_warning ("Unable to delete %s", child_full_path);
-              continue;
-            }
+  if (remove_pyc)
+    {
+      g_autofree char *child_full_path = g_build_filename ("/", rel_dir, dent->d_name, NULL);
+      g_print ("Removing stale python bytecode file %s\n", child_full_path);
+      if (unlinkat (dfd, dent->d_name, 0) != 0)
+        g_warning ("Unable to delete %s", child_full_path);
+      return TRUE;
+    }
 
-          /* Change to mtime 0 which is what ostree uses for checkouts */
-          buffer[4] = OSTREE_TIMESTAMP;
-          buffer[5] = buffer[6] = buffer[7] = 0;
+  /* Change to mtime 0 which is what ostree uses for checkouts */
+  buffer[4] = OSTREE_TIMESTAMP;
+  buffer[5] = buffer[6] = buffer[7] = 0;
 
-          res = pwrite (fd, buffer, 8, 0);
-          if (res != 8)
-            {
-              glnx_set_error_from_errno (error);
-              return FALSE;
-            }
+  res = pwrite (fd, buffer, 8, 0);
+  if (res != 8)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
 
-          {
-            g_autofree char *child_full_path = g_build_filename (full_path, dent->d_name, NULL);
-            g_print ("Fixed up header mtime for %s\n", child_full_path);
-          }
+  {
+    g_autofree char *child_full_path = g_build_filename ("/", rel_dir, dent->d_name, NULL);
+    g_print ("Fixed up header mtime for %s\n", child_full_path);
+  }
 
-          /* The mtime will be zeroed on cache commit. We don't want to do that now, because multiple
-             files could reference one .py file and we need the mtimes to match for them all */
-        }
-    }
+  /* The mtime will be zeroed on cache commit. We don't want to do that now, because multiple
+     files could reference one .py file and we need the mtimes to match for them all */
 
   return TRUE;
 }
 
-gboolean
-builder_module_build (BuilderModule  *self,
-                      BuilderCache   *cache,
-                      BuilderContext *context,
-                      GError        **error)
+/* Builds and installs the module into app_dir, leaving the build
+ * directory around for the debuginfo extraction in finish_build(). */
+static gboolean
+builder_module_build_in (BuilderModule  *self,
+                         GFile          *app_dir,
+                         BuilderContext *context,
+                         GFile         **source_dir_out,
+                         GFile         **build_link_out,
+                         GError        **error)
 {
-  GFile *app_dir = builder_context_get_app_dir (context);
   g_autofree char *make_j = NULL;
   g_autofree char *make_l = NULL;
   const char *make_cmd = NULL;
@@ -1199,6 +1339,7 @@ builder_module_build (BuilderModule  *self,
   g_autofree char *source_dir_path = NULL;
   g_autofree char *buildname = NULL;
   g_autoptr(GError) my_error = NULL;
+  BuilderTimer timer;
   int count;
 
   build_parent_dir = builder_context_get_build_dir (context);
@@ -1261,9 +1402,13 @@ builder_module_build (BuilderModule  *self,
   g_print ("Building module %s in %s\n", self->name, source_dir_path);
   g_print ("========================================================================\n");
 
+  builder_timer_start (&timer);
+
   if (!builder_module_extract_sources (self, source_dir, context, error))
     return FALSE;
 
+  builder_timer_report (&timer, self->phases, "extract");
+
   if (self->subdir != NULL && self->subdir[0] != 0)
     {
       source_subdir = g_file_resolve_relative_path (source_dir, self->subdir);
@@ -1363,6 +1508,8 @@ builder_module_build (BuilderModule  *self,
           return FALSE;
         }
 
+      builder_timer_start (&timer);
+
       env_with_noconfigure = g_environ_setenv (g_strdupv (env), "NOCONFIGURE", "1", TRUE);
       if (!build (app_dir, self->name, context, source_dir, source_subdir_relative, build_args, env_with_noconfigure, error,
                   autogen_cmd, NULL))
@@ -1377,6 +1524,8 @@ builder_module_build (BuilderModule  *self,
           return FALSE;
         }
 
+      builder_timer_report (&timer, self->phases, "autogen");
+
       has_configure = TRUE;
     }
 
@@ -1452,9 +1601,13 @@ builder_module_build (BuilderModule  *self,
         configure_prefix_arg = g_strdup_printf ("--prefix=%s",
                                                 builder_options_get_prefix (self->build_options, context));
 
+      builder_timer_start (&timer);
+
       if (!build (app_dir, self->name, context, source_dir, build_dir_relative, build_args, env, error,
                   configure_cmd, configure_prefix_arg, strv_arg, config_opts, configure_final_arg, NULL))
         return FALSE;
+
+      builder_timer_report (&timer, self->phases, "configure");
     }
   else
     {
@@ -1502,16 +1655,25 @@ builder_module_build (BuilderModule  *self,
   else
     make_cmd = "make";
 
+  builder_timer_start (&timer);
+
   if (!build (app_dir, self->name, context, source_dir, build_dir_relative, build_args, env, error,
               make_cmd, make_j ? make_j : skip_arg, make_l ? make_l : skip_arg, strv_arg, self->make_args, NULL))
     return FALSE;
 
+  builder_timer_report (&timer, self->phases, "build");
+  builder_timer_start (&timer);
+
   if (!build (app_dir, self->name, context, source_dir, build_dir_relative, build_args, env, error,
               make_cmd, "install", strv_arg, self->make_install_args, NULL))
     return FALSE;
 
+  builder_timer_report (&timer, self->phases, "install");
+
   /* Post installation scripts */
 
+  builder_timer_start (&timer);
+
   if (builder_context_get_separate_locales (context))
     {
       g_autoptr(GFile) root_dir = NULL;
@@ -1540,16 +1702,37 @@ builder_module_build (BuilderModule  *self,
 
   if (!self->no_python_timestamp_fix)
     {
-      if (!fixup_python_timestamp (AT_FDCWD,
-                                   flatpak_file_get_path_cached (app_dir), "/",
-                                   NULL,
-                                   error))
+      if (!builder_walk_dir_parallel (app_dir, builder_context_get_jobs (context),
+                                      fixup_python_timestamp, NULL, error))
         return FALSE;
     }
 
+  builder_timer_report (&timer, self->phases, "post-install");
+
+  *source_dir_out = g_steal_pointer (&source_dir);
+  *build_link_out = g_steal_pointer (&build_link);
+
+  return TRUE;
+}
+
+static gboolean
+builder_module_finish_build (BuilderModule  *self,
+                             GFile          *source_dir,
+                             GFile          *build_link,
+                             BuilderCache   *cache,
+                             BuilderContext *context,
+                             GError        **error)
+{
+  GFile *app_dir = builder_context_get_app_dir (context);
+  BuilderTimer timer;
+
+  builder_timer_start (&timer);
+
   if (!builder_module_handle_debuginfo (self, app_dir, cache, context, error))
     return FALSE;
 
+  builder_timer_report (&timer, self->phases, "debuginfo");
+
   /* Clean up build dir */
 
   if (!builder_context_get_keep_build_dirs (context))
@@ -1570,6 +1753,71 @@ builder_module_build (BuilderModule  *self,
   return TRUE;
 }
 
+gboolean
+builder_module_build (BuilderModule  *self,
+                      BuilderCache   *cache,
+                      BuilderContext *context,
+                      GError        **error)
+{
+  g_autoptr(GFile) source_dir = NULL;
+  g_autoptr(GFile) build_link = NULL;
+
+  if (!builder_module_build_in (self, builder_context_get_app_dir (context), context,
+                                &source_dir, &build_link, error))
+    return FALSE;
+
+  return builder_module_finish_build (self, source_dir, build_link, cache, context, error);
+}
+
+/* Builds the module into a private copy of the app dir, so that it can
+ * run at the same time as other modules. This may be called from a
+ * worker thread, so it must not touch the cache. The caller is
+ * responsible for moving the installed files into the real app dir
+ * and then calling builder_module_finish_staged(). */
+gboolean
+builder_module_build_staged (BuilderModule  *self,
+                             GFile          *staging_dir,
+                             BuilderContext *context,
+                             GError        **error)
+{
+  g_clear_object (&self->staged_source_dir);
+  g_clear_object (&self->staged_build_link);
+
+  return builder_module_build_in (self, staging_dir, context,
+                                  &self->staged_source_dir, &self->staged_build_link,
+                                  error);
+}
+
+gboolean
+builder_module_finish_staged (BuilderModule  *self,
+                              BuilderCache   *cache,
+                              BuilderContext *context,
+                              GError        **error)
+{
+  g_autoptr(GFile) source_dir = g_steal_pointer (&self->staged_source_dir);
+  g_autoptr(GFile) build_link = g_steal_pointer (&self->staged_build_link);
+
+  g_return_val_if_fail (source_dir != NULL, FALSE);
+
+  return builder_module_finish_build (self, source_dir, build_link, cache, context, error);
+}
+
+/* Drops the result of builder_module_build_staged() when it won't be
+ * merged, e.g. because the module will be built again. */
+void
+builder_module_discard_staged (BuilderModule  *self,
+                               BuilderContext *context)
+{
+  g_autoptr(GFile) source_dir = g_steal_pointer (&self->staged_source_dir);
+  g_autoptr(GFile) build_link = g_steal_pointer (&self->staged_build_link);
+
+  if (source_dir == NULL || builder_context_get_keep_build_dirs (context))
+    return;
+
+  (void) g_file_delete (build_link, NULL, NULL);
+  (void) flatpak_rm_rf (source_dir, NULL, NULL);
+}
+
 gboolean
 builder_module_update (BuilderModule  *self,
                        BuilderContext *context,
@@ -1659,39 +1907,6 @@ builder_module_set_changes (BuilderModule *self,
     }
 }
 
-static void
-collect_cleanup_for_path (const char **patterns,
-                          const char  *path,
-                          const char  *add_prefix,
-                          GHashTable  *to_remove_ht)
-{
-  int i;
-
-  if (patterns == NULL)
-    return;
-
-  for (i = 0; patterns[i] != NULL; i++)
-    flatpak_collect_matches_for_path_pattern (path, patterns[i], add_prefix, to_remove_ht);
-}
-
-static gboolean
-matches_cleanup_for_path (const char **patterns,
-                          const char  *path)
-{
-  int i;
-
-  if (patterns == NULL)
-    return FALSE;
-
-  for (i = 0; patterns[i] != NULL; i++)
-    {
-      if (flatpak_matches_path_pattern (path, patterns[i]))
-        return TRUE;
-    }
-
-  return FALSE;
-}
-
 void
 builder_module_cleanup_collect (BuilderModule  *self,
                                 gboolean        platform,
@@ -1700,22 +1915,15 @@ builder_module_cleanup_collect (BuilderModule  *self,
 {
   GPtrArray *changed_files;
   int i;
-  const char **global_patterns;
-  const char **local_patterns;
+  BuilderCleanupMatcher *global_matcher;
+  g_autoptr(BuilderCleanupMatcher) local_matcher = NULL;
 
   if (!self->changes)
     return;
 
-  if (platform)
-    {
-      global_patterns = builder_context_get_global_cleanup_platform (context);
-      local_patterns = (const char **) self->cleanup_platform;
-    }
-  else
-    {
-      global_patterns = builder_context_get_global_cleanup (context);
-      local_patterns = (const char **) self->cleanup;
-    }
+  global_matcher = builder_context_get_global_cleanup_matcher (context, platform);
+  local_matcher = builder_cleanup_matcher_new (platform ? (const char **) self->cleanup_platform
+                                                        : (const char **) self->cleanup);
 
   changed_files = self->changes;
   for (i = 0; i < changed_files->len; i++)
@@ -1733,8 +1941,8 @@ builder_module_cleanup_collect (BuilderModule  *self,
 
       unprefixed_path = path + strlen (prefix);
 
-      collect_cleanup_for_path (global_patterns, unprefixed_path, prefix, to_remove_ht);
-      collect_cleanup_for_path (local_patterns, unprefixed_path, prefix, to_remove_ht);
+      builder_cleanup_matcher_collect (global_matcher, unprefixed_path, prefix, to_remove_ht);
+      builder_cleanup_matcher_collect (local_matcher, unprefixed_path, prefix, to_remove_ht);
 
       if (g_str_has_prefix (unprefixed_path, "lib/debug/") &&
           g_str_has_suffix (unprefixed_path, ".debug"))
@@ -1749,8 +1957,8 @@ builder_module_cleanup_collect (BuilderModule  *self,
 
           while (TRUE)
             {
-              if (matches_cleanup_for_path (global_patterns, debug_path) ||
-                  matches_cleanup_for_path (local_patterns, debug_path))
+              if (builder_cleanup_matcher_matches (global_matcher, debug_path) ||
+                  builder_cleanup_matcher_matches (local_matcher, debug_path))
                 g_hash_table_insert (to_remove_ht, g_strconcat (prefix, real_path, NULL), GINT_TO_POINTER (1));
 
               real_parent = g_path_get_dirname (real_path);
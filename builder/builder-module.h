@@ -43,6 +43,8 @@ const char * builder_module_get_name (BuilderModule *self);
 gboolean     builder_module_get_disabled (BuilderModule *self);
 GList *      builder_module_get_sources (BuilderModule *self);
 GList *      builder_module_get_modules (BuilderModule *self);
+const char **builder_module_get_depends (BuilderModule *self);
+JsonObject * builder_module_get_phases (BuilderModule *self);
 void         builder_module_set_json_path (BuilderModule *self,
                                            const char *json_path);
 GPtrArray *  builder_module_get_changes (BuilderModule *self);
@@ -63,6 +65,16 @@ gboolean builder_module_build (BuilderModule  *self,
                                BuilderCache   *cache,
                                BuilderContext *context,
                                GError        **error);
+gboolean builder_module_build_staged (BuilderModule  *self,
+                                      GFile          *staging_dir,
+                                      BuilderContext *context,
+                                      GError        **error);
+gboolean builder_module_finish_staged (BuilderModule  *self,
+                                       BuilderCache   *cache,
+                                       BuilderContext *context,
+                                       GError        **error);
+void     builder_module_discard_staged (BuilderModule  *self,
+                                        BuilderContext *context);
 gboolean builder_module_update (BuilderModule  *self,
                                 BuilderContext *context,
                                 GError        **error);
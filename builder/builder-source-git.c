@@ -25,8 +25,11 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <sys/statfs.h>
 
+#include <gio/gunixinputstream.h>
+
 #include "builder-utils.h"
 
 #include "builder-source-git.h"
@@ -40,6 +43,8 @@ struct BuilderSourceGit
   char         *url;
   char         *path;
   char         *branch;
+  gboolean      export_tree;
+  gboolean      shared_clone;
 };
 
 typedef struct
@@ -54,6 +59,8 @@ enum {
   PROP_URL,
   PROP_PATH,
   PROP_BRANCH,
+  PROP_EXPORT_TREE,
+  PROP_SHARED_CLONE,
   LAST_PROP
 };
 
@@ -98,6 +105,14 @@ builder_source_git_get_property (GObject    *object,
       g_value_set_string (value, self->branch);
       break;
 
+    case PROP_EXPORT_TREE:
+      g_value_set_boolean (value, self->export_tree);
+      break;
+
+    case PROP_SHARED_CLONE:
+      g_value_set_boolean (value, self->shared_clone);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -128,6 +143,14 @@ builder_source_git_set_property (GObject      *object,
       self->branch = g_value_dup_string (value);
       break;
 
+    case PROP_EXPORT_TREE:
+      self->export_tree = g_value_get_boolean (value);
+      break;
+
+    case PROP_SHARED_CLONE:
+      self->shared_clone = g_value_get_boolean (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -268,14 +291,36 @@ make_absolute (const char *orig_parent, const char *orig_relpath, GError **error
   return g_strconcat (parent, "/", relpath, NULL);
 }
 
-static gboolean
-git_mirror_submodules (const char     *repo_location,
-                       gboolean        update,
-                       GFile          *mirror_dir,
-                       const char     *revision,
-                       BuilderContext *context,
-                       GError        **error)
+typedef struct
+{
+  char *name;
+  char *path;
+  char *url;
+  char *commit;
+} GitSubmodule;
+
+static void
+git_submodule_free (GitSubmodule *submodule)
 {
+  g_free (submodule->name);
+  g_free (submodule->path);
+  g_free (submodule->url);
+  g_free (submodule->commit);
+  g_free (submodule);
+}
+
+/* Returns the gitlink submodules of revision in repo_dir, as listed
+ * in its .gitmodules, with the urls made absolute relative to
+ * repo_location. If skip_disabled is set, submodules with the update
+ * method set to "none" are left out. */
+static GPtrArray *
+git_list_submodules (const char  *repo_location,
+                     GFile       *repo_dir,
+                     const char  *revision,
+                     gboolean     skip_disabled,
+                     GError     **error)
+{
+  g_autoptr(GPtrArray) res = g_ptr_array_new_with_free_func ((GDestroyNotify) git_submodule_free);
   g_autoptr(GKeyFile) key_file = g_key_file_new ();
   g_autofree gchar *rev_parse_output = NULL;
   g_autofree gchar *submodule_data = NULL;
@@ -283,14 +328,14 @@ git_mirror_submodules (const char     *repo_location,
   g_autofree gchar *gitmodules = g_strconcat (revision, ":.gitmodules", NULL);
   gsize num_submodules;
 
-  if (!git (mirror_dir, &rev_parse_output, NULL, "rev-parse", "--verify", "--quiet", gitmodules, NULL))
-    return TRUE;
+  if (!git (repo_dir, &rev_parse_output, NULL, "rev-parse", "--verify", "--quiet", gitmodules, NULL))
+    return g_steal_pointer (&res);
 
-  if (git (mirror_dir, &submodule_data, NULL, "show", gitmodules, NULL))
+  if (git (repo_dir, &submodule_data, NULL, "show", gitmodules, NULL))
     {
       if (!g_key_file_load_from_data (key_file, submodule_data, -1,
                                       G_KEY_FILE_NONE, error))
-        return FALSE;
+        return NULL;
 
       submodules = g_key_file_get_groups (key_file, &num_submodules);
 
@@ -298,35 +343,48 @@ git_mirror_submodules (const char     *repo_location,
       for (i = 0; i < num_submodules; i++)
         {
           g_autofree gchar *submodule = NULL;
+          g_autofree gchar *update_method = NULL;
           g_autofree gchar *path = NULL;
           g_autofree gchar *relative_url = NULL;
           g_autofree gchar *absolute_url = NULL;
           g_autofree gchar *ls_tree = NULL;
           g_auto(GStrv) lines = NULL;
           g_auto(GStrv) words = NULL;
+          GitSubmodule *entry;
+          gsize len;
 
           submodule = submodules[i];
+          len = strlen (submodule);
 
           if (!g_str_has_prefix (submodule, "submodule \""))
             continue;
 
+          /* Skip any submodules that are disabled (have the update method set to "none")
+             Only check if the command succeeds. If it fails, the update method is not set. */
+          if (skip_disabled)
+            {
+              update_method = g_key_file_get_string (key_file, submodule, "update", NULL);
+              if (g_strcmp0 (update_method, "none") == 0)
+                continue;
+            }
+
           path = g_key_file_get_string (key_file, submodule, "path", error);
           if (path == NULL)
-            return FALSE;
+            return NULL;
 
           relative_url = g_key_file_get_string (key_file, submodule, "url", error);
           absolute_url = make_absolute (repo_location, relative_url, error);
           if (absolute_url == NULL)
-            return FALSE;
+            return NULL;
 
-          if (!git (mirror_dir, &ls_tree, error, "ls-tree", revision, path, NULL))
-            return FALSE;
+          if (!git (repo_dir, &ls_tree, error, "ls-tree", revision, path, NULL))
+            return NULL;
 
           lines = g_strsplit (g_strstrip (ls_tree), "\n", 0);
           if (g_strv_length (lines) != 1)
             {
               g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Not a gitlink tree: %s", path);
-              return FALSE;
+              return NULL;
             }
 
           words = g_strsplit_set (lines[0], " \t", 4);
@@ -334,11 +392,41 @@ git_mirror_submodules (const char     *repo_location,
           if (g_strcmp0 (words[0], "160000") != 0)
             continue;
 
-          if (!git_mirror_repo (absolute_url, update, words[2], context, error))
-            return FALSE;
+          entry = g_new0 (GitSubmodule, 1);
+          entry->name = g_strndup (submodule + 11, len - 12);
+          entry->path = g_steal_pointer (&path);
+          entry->url = g_steal_pointer (&absolute_url);
+          entry->commit = g_strdup (words[2]);
+          g_ptr_array_add (res, entry);
         }
     }
 
+  return g_steal_pointer (&res);
+}
+
+static gboolean
+git_mirror_submodules (const char     *repo_location,
+                       gboolean        update,
+                       GFile          *mirror_dir,
+                       const char     *revision,
+                       BuilderContext *context,
+                       GError        **error)
+{
+  g_autoptr(GPtrArray) submodules = NULL;
+  int i;
+
+  submodules = git_list_submodules (repo_location, mirror_dir, revision, FALSE, error);
+  if (submodules == NULL)
+    return FALSE;
+
+  for (i = 0; i < submodules->len; i++)
+    {
+      GitSubmodule *submodule = g_ptr_array_index (submodules, i);
+
+      if (!git_mirror_repo (submodule->url, update, submodule->commit, context, error))
+        return FALSE;
+    }
+
   return TRUE;
 }
 
@@ -413,100 +501,140 @@ static gboolean
 git_extract_submodule (const char     *repo_location,
                        GFile          *checkout_dir,
                        const char     *revision,
+                       gboolean        shared_clone,
                        BuilderContext *context,
                        GError        **error)
 {
-  g_autoptr(GKeyFile) key_file = g_key_file_new ();
-  g_autofree gchar *rev_parse_output = NULL;
-  g_autofree gchar *submodule_data = NULL;
-  g_autofree gchar **submodules = NULL;
-  g_autofree gchar *gitmodules = g_strconcat (revision, ":.gitmodules", NULL);
-  gsize num_submodules;
+  g_autoptr(GPtrArray) submodules = NULL;
+  int i;
 
-  if (!git (checkout_dir, &rev_parse_output, NULL, "rev-parse", "--verify", "--quiet", gitmodules, NULL))
-    return TRUE;
+  submodules = git_list_submodules (repo_location, checkout_dir, revision, TRUE, error);
+  if (submodules == NULL)
+    return FALSE;
 
-  if (git (checkout_dir, &submodule_data, NULL, "show", gitmodules, NULL))
+  for (i = 0; i < submodules->len; i++)
     {
-      if (!g_key_file_load_from_data (key_file, submodule_data, -1,
-                                      G_KEY_FILE_NONE, error))
+      GitSubmodule *submodule = g_ptr_array_index (submodules, i);
+      g_autoptr(GFile) mirror_dir = NULL;
+      g_autoptr(GFile) child_dir = NULL;
+      g_autofree gchar *mirror_dir_as_url = NULL;
+      g_autofree gchar *option = NULL;
+
+      mirror_dir = git_get_mirror_dir (submodule->url, context);
+      mirror_dir_as_url = g_file_get_uri (mirror_dir);
+      option = g_strdup_printf ("submodule.%s.url", submodule->name);
+
+      if (!git (checkout_dir, NULL, error,
+                "config", option, mirror_dir_as_url, NULL))
         return FALSE;
 
-      submodules = g_key_file_get_groups (key_file, &num_submodules);
-
-      int i;
-      for (i = 0; i < num_submodules; i++)
+      if (shared_clone)
         {
-          g_autofree gchar *submodule = NULL;
-          g_autofree gchar *name = NULL;
-          g_autofree gchar *update_method = NULL;
-          g_autofree gchar *path = NULL;
-          g_autofree gchar *relative_url = NULL;
-          g_autofree gchar *absolute_url = NULL;
-          g_autofree gchar *ls_tree = NULL;
-          g_auto(GStrv) lines = NULL;
-          g_auto(GStrv) words = NULL;
-          g_autoptr(GFile) mirror_dir = NULL;
-          g_autoptr(GFile) child_dir = NULL;
-          g_autofree gchar *mirror_dir_as_url = NULL;
-          g_autofree gchar *option = NULL;
-          gsize len;
+          /* Borrow the objects from the mirror instead of copying them */
+          if (!git (checkout_dir, NULL, error,
+                    "submodule", "update", "--init",
+                    "--reference", flatpak_file_get_path_cached (mirror_dir),
+                    submodule->path, NULL))
+            return FALSE;
+        }
+      else if (!git (checkout_dir, NULL, error,
+                     "submodule", "update", "--init", submodule->path, NULL))
+        return FALSE;
 
-          submodule = submodules[i];
-          len = strlen (submodule);
+      child_dir = g_file_resolve_relative_path (checkout_dir, submodule->path);
 
-          if (!g_str_has_prefix (submodule, "submodule \""))
-            continue;
+      if (!git_extract_submodule (submodule->url, child_dir, submodule->commit, shared_clone, context, error))
+        return FALSE;
+    }
 
-          name = g_strndup (submodule + 11, len - 12);
+  return TRUE;
+}
 
-          /* Skip any submodules that are disabled (have the update method set to "none")
-             Only check if the command succeeds. If it fails, the update method is not set. */
-          update_method = g_key_file_get_string (key_file, submodule, "update", NULL);
-          if (g_strcmp0 (update_method, "none") == 0)
-            continue;
+/* Writes the files of revision to dest, without any git metadata.
+ * This is the equivalent of git archive | tar -x. */
+static gboolean
+git_export_tree (GFile       *mirror_dir,
+                 const char  *revision,
+                 GFile       *dest,
+                 GError     **error)
+{
+  g_autoptr(GSubprocessLauncher) archive_launcher = NULL;
+  g_autoptr(GSubprocessLauncher) tar_launcher = NULL;
+  g_autoptr(GSubprocess) archive = NULL;
+  g_autoptr(GSubprocess) tar = NULL;
+  GInputStream *archive_out;
+  int tar_in;
+
+  g_debug ("Exporting %s from %s", revision, flatpak_file_get_path_cached (mirror_dir));
+
+  archive_launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_STDOUT_PIPE);
+  g_subprocess_launcher_set_cwd (archive_launcher, flatpak_file_get_path_cached (mirror_dir));
+  archive = g_subprocess_launcher_spawn (archive_launcher, error,
+                                         "git", "archive", "--format=tar", revision, NULL);
+  if (archive == NULL)
+    return FALSE;
 
-          path = g_key_file_get_string (key_file, submodule, "path", error);
-          if (path == NULL)
-            return FALSE;
+  archive_out = g_subprocess_get_stdout_pipe (archive);
+  tar_in = dup (g_unix_input_stream_get_fd (G_UNIX_INPUT_STREAM (archive_out)));
+  if (tar_in == -1)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
 
-          relative_url = g_key_file_get_string (key_file, submodule, "url", error);
-          absolute_url = make_absolute (repo_location, relative_url, error);
-          if (absolute_url == NULL)
-            return FALSE;
+  tar_launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_NONE);
+  g_subprocess_launcher_take_stdin_fd (tar_launcher, tar_in);
+  tar = g_subprocess_launcher_spawn (tar_launcher, error,
+                                     "tar", "-xf", "-", "-C", flatpak_file_get_path_cached (dest), NULL);
 
-          if (!git (checkout_dir, &ls_tree, error, "ls-tree", revision, path, NULL))
-            return FALSE;
+  /* Only tar should hold the read end, so git gets EPIPE if tar dies */
+  g_input_stream_close (archive_out, NULL, NULL);
 
-          lines = g_strsplit (g_strstrip (ls_tree), "\n", 0);
-          if (g_strv_length (lines) != 1)
-            {
-              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Not a gitlink tree: %s", path);
-              return FALSE;
-            }
+  if (tar == NULL)
+    {
+      g_subprocess_force_exit (archive);
+      return FALSE;
+    }
 
-          words = g_strsplit_set (lines[0], " \t", 4);
+  if (!g_subprocess_wait_check (tar, NULL, error))
+    return FALSE;
 
-          if (g_strcmp0 (words[0], "160000") != 0)
-            continue;
+  return g_subprocess_wait_check (archive, NULL, error);
+}
 
-          mirror_dir = git_get_mirror_dir (absolute_url, context);
-          mirror_dir_as_url = g_file_get_uri (mirror_dir);
-          option = g_strdup_printf ("submodule.%s.url", name);
+static gboolean
+git_export_submodules (const char     *repo_location,
+                       GFile          *mirror_dir,
+                       const char     *revision,
+                       GFile          *dest,
+                       BuilderContext *context,
+                       GError        **error)
+{
+  g_autoptr(GPtrArray) submodules = NULL;
+  int i;
 
-          if (!git (checkout_dir, NULL, error,
-                    "config", option, mirror_dir_as_url, NULL))
-            return FALSE;
+  submodules = git_list_submodules (repo_location, mirror_dir, revision, TRUE, error);
+  if (submodules == NULL)
+    return FALSE;
 
-          if (!git (checkout_dir, NULL, error,
-                    "submodule", "update", "--init", path, NULL))
-            return FALSE;
+  for (i = 0; i < submodules->len; i++)
+    {
+      GitSubmodule *submodule = g_ptr_array_index (submodules, i);
+      g_autoptr(GFile) submodule_mirror_dir = NULL;
+      g_autoptr(GFile) child_dir = NULL;
 
-          child_dir = g_file_resolve_relative_path (checkout_dir, path);
+      submodule_mirror_dir = git_get_mirror_dir (submodule->url, context);
+      child_dir = g_file_resolve_relative_path (dest, submodule->path);
 
-          if (!git_extract_submodule (absolute_url, child_dir, words[2], context, error))
-            return FALSE;
-        }
+      if (!flatpak_mkdir_p (child_dir, NULL, error))
+        return FALSE;
+
+      if (!git_export_tree (submodule_mirror_dir, submodule->commit, child_dir, error))
+        return FALSE;
+
+      if (!git_export_submodules (submodule->url, submodule_mirror_dir, submodule->commit,
+                                  child_dir, context, error))
+        return FALSE;
     }
 
   return TRUE;
@@ -532,18 +660,50 @@ builder_source_git_extract (BuilderSource  *source,
 
   mirror_dir = git_get_mirror_dir (location, context);
 
+  if (self->export_tree)
+    {
+      g_autofree char *commit = NULL;
+
+      commit = git_get_current_commit (mirror_dir, get_branch (self), context, error);
+      if (commit == NULL)
+        return FALSE;
+
+      if (!git_export_tree (mirror_dir, commit, dest, error))
+        return FALSE;
+
+      return git_export_submodules (location, mirror_dir, commit, dest, context, error);
+    }
+
   mirror_dir_path = g_file_get_path (mirror_dir);
   dest_path = g_file_get_path (dest);
 
-  if (!git (NULL, NULL, error,
-            "clone", mirror_dir_path, dest_path, NULL))
-    return FALSE;
+  if (self->shared_clone)
+    {
+      /* Use the objects in the mirror via alternates rather than copying
+         them, and only check out the branch we want. The checkout then
+         depends on the mirror, see the docs. */
+      if (!git (NULL, NULL, error,
+                "clone", "--shared", "--no-checkout", mirror_dir_path, dest_path, NULL))
+        return FALSE;
 
-  if (!git (dest, NULL, error,
-            "checkout", get_branch (self), NULL))
-    return FALSE;
+      /* Forced, as the empty index of a --no-checkout clone looks like
+         local changes if the branch is the one HEAD already points to */
+      if (!git (dest, NULL, error,
+                "checkout", "-f", get_branch (self), NULL))
+        return FALSE;
+    }
+  else
+    {
+      if (!git (NULL, NULL, error,
+                "clone", mirror_dir_path, dest_path, NULL))
+        return FALSE;
 
-  if (!git_extract_submodule (location, dest, get_branch (self), context, error))
+      if (!git (dest, NULL, error,
+                "checkout", get_branch (self), NULL))
+        return FALSE;
+    }
+
+  if (!git_extract_submodule (location, dest, get_branch (self), self->shared_clone, context, error))
     return FALSE;
 
   if (!git (dest, NULL, error,
@@ -585,6 +745,10 @@ builder_source_git_checksum (BuilderSource  *source,
     {
       g_warning ("No url or path");
     }
+
+  /* Only when set, so existing checksums stay the same */
+  if (self->export_tree)
+    builder_cache_checksum_boolean (cache, self->export_tree);
 }
 
 static gboolean
@@ -650,6 +814,20 @@ builder_source_git_class_init (BuilderSourceGitClass *klass)
                                                         "",
                                                         NULL,
                                                         G_PARAM_READWRITE));
+  g_object_class_install_property (object_class,
+                                   PROP_EXPORT_TREE,
+                                   g_param_spec_boolean ("export-tree",
+                                                         "",
+                                                         "",
+                                                         FALSE,
+                                                         G_PARAM_READWRITE));
+  g_object_class_install_property (object_class,
+                                   PROP_SHARED_CLONE,
+                                   g_param_spec_boolean ("shared-clone",
+                                                         "",
+                                                         "",
+                                                         FALSE,
+                                                         G_PARAM_READWRITE));
 }
 
 static void
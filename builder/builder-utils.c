@@ -129,6 +129,235 @@ flatpak_matches_path_pattern (const char *path,
   return flatpak_path_match_prefix (pattern, path) != NULL;
 }
 
+/* A set of cleanup patterns, pre-sorted so that a path only has to be
+ * tested against the few patterns that can possibly match it:
+ *
+ *  - literal basename patterns ("COPYING") are a hash lookup
+ *  - basename suffix patterns ("*.la") are bucketed by their extension
+ *  - absolute patterns ("/lib/pkgconfig") are bucketed by their first
+ *    path element, if that is a literal
+ *
+ * Anything else is matched the slow way. The result is always the same
+ * as calling flatpak_collect_matches_for_path_pattern() for each pattern.
+ */
+struct BuilderCleanupMatcher
+{
+  char      **patterns;
+  GHashTable *basenames;
+  GHashTable *suffixes;
+  GHashTable *absolute;
+  GPtrArray  *other;
+};
+
+static gboolean
+has_glob_chars (const char *str,
+                gsize       len)
+{
+  gsize i;
+
+  for (i = 0; i < len; i++)
+    {
+      if (str[i] == '*' || str[i] == '?')
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static void
+add_to_bucket (GHashTable *table,
+               const char *key,
+               gsize       key_len,
+               const char *value)
+{
+  g_autofree char *k = g_strndup (key, key_len);
+  GPtrArray *bucket;
+
+  bucket = g_hash_table_lookup (table, k);
+  if (bucket == NULL)
+    {
+      bucket = g_ptr_array_new ();
+      g_hash_table_insert (table, g_steal_pointer (&k), bucket);
+    }
+
+  g_ptr_array_add (bucket, (char *) value);
+}
+
+static GPtrArray *
+lookup_first_element (GHashTable *table,
+                      const char *path)
+{
+  g_autofree char *element = NULL;
+  const char *end;
+
+  if (g_hash_table_size (table) == 0)
+    return NULL;
+
+  while (*path == '/')
+    path++;
+
+  end = strchr (path, '/');
+  if (end == NULL)
+    return g_hash_table_lookup (table, path);
+
+  element = g_strndup (path, end - path);
+  return g_hash_table_lookup (table, element);
+}
+
+static GPtrArray *
+lookup_suffixes (GHashTable *table,
+                 const char *basename)
+{
+  const char *ext;
+
+  if (g_hash_table_size (table) == 0)
+    return NULL;
+
+  ext = strrchr (basename, '.');
+  if (ext == NULL)
+    return NULL;
+
+  return g_hash_table_lookup (table, ext + 1);
+}
+
+BuilderCleanupMatcher *
+builder_cleanup_matcher_new (const char **patterns)
+{
+  BuilderCleanupMatcher *self = g_new0 (BuilderCleanupMatcher, 1);
+  int i;
+
+  self->patterns = g_strdupv ((char **) patterns);
+  self->basenames = g_hash_table_new (g_str_hash, g_str_equal);
+  self->suffixes = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, (GDestroyNotify) g_ptr_array_unref);
+  self->absolute = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, (GDestroyNotify) g_ptr_array_unref);
+  self->other = g_ptr_array_new ();
+
+  for (i = 0; self->patterns != NULL && self->patterns[i] != NULL; i++)
+    {
+      const char *pattern = self->patterns[i];
+
+      if (pattern[0] == '/')
+        {
+          const char *element = pattern;
+          const char *end;
+
+          while (*element == '/')
+            element++;
+
+          end = strchr (element, '/');
+          if (end == NULL)
+            end = element + strlen (element);
+
+          if (end != element && !has_glob_chars (element, end - element))
+            add_to_bucket (self->absolute, element, end - element, pattern);
+          else
+            g_ptr_array_add (self->other, (char *) pattern);
+        }
+      else if (strchr (pattern, '/') != NULL)
+        {
+          /* Basename patterns can never match across a slash */
+          continue;
+        }
+      else if (!has_glob_chars (pattern, strlen (pattern)))
+        {
+          g_hash_table_add (self->basenames, (char *) pattern);
+        }
+      else if (pattern[0] == '*' && pattern[1] != 0 &&
+               !has_glob_chars (pattern + 1, strlen (pattern + 1)) &&
+               strchr (pattern + 1, '.') != NULL)
+        {
+          const char *ext = strrchr (pattern, '.') + 1;
+
+          add_to_bucket (self->suffixes, ext, strlen (ext), pattern + 1);
+        }
+      else
+        {
+          g_ptr_array_add (self->other, (char *) pattern);
+        }
+    }
+
+  return self;
+}
+
+void
+builder_cleanup_matcher_free (BuilderCleanupMatcher *self)
+{
+  g_hash_table_unref (self->basenames);
+  g_hash_table_unref (self->suffixes);
+  g_hash_table_unref (self->absolute);
+  g_ptr_array_unref (self->other);
+  g_strfreev (self->patterns);
+  g_free (self);
+}
+
+static gboolean
+matches_basename (BuilderCleanupMatcher *self,
+                  const char            *basename)
+{
+  GPtrArray *suffixes;
+  int i;
+
+  if (g_hash_table_contains (self->basenames, basename))
+    return TRUE;
+
+  suffixes = lookup_suffixes (self->suffixes, basename);
+  for (i = 0; suffixes != NULL && i < suffixes->len; i++)
+    {
+      if (g_str_has_suffix (basename, g_ptr_array_index (suffixes, i)))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+gboolean
+builder_cleanup_matcher_matches (BuilderCleanupMatcher *self,
+                                 const char            *path)
+{
+  GPtrArray *absolute;
+  int i;
+
+  if (matches_basename (self, inplace_basename (path)))
+    return TRUE;
+
+  absolute = lookup_first_element (self->absolute, path);
+  for (i = 0; absolute != NULL && i < absolute->len; i++)
+    {
+      if (flatpak_matches_path_pattern (path, g_ptr_array_index (absolute, i)))
+        return TRUE;
+    }
+
+  for (i = 0; i < self->other->len; i++)
+    {
+      if (flatpak_matches_path_pattern (path, g_ptr_array_index (self->other, i)))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+void
+builder_cleanup_matcher_collect (BuilderCleanupMatcher *self,
+                                 const char            *path,
+                                 const char            *add_prefix,
+                                 GHashTable            *to_remove_ht)
+{
+  GPtrArray *absolute;
+  int i;
+
+  if (matches_basename (self, inplace_basename (path)))
+    g_hash_table_insert (to_remove_ht, g_strconcat (add_prefix ? add_prefix : "", path, NULL), GINT_TO_POINTER (1));
+
+  absolute = lookup_first_element (self->absolute, path);
+  for (i = 0; absolute != NULL && i < absolute->len; i++)
+    flatpak_collect_matches_for_path_pattern (path, g_ptr_array_index (absolute, i), add_prefix, to_remove_ht);
+
+  for (i = 0; i < self->other->len; i++)
+    flatpak_collect_matches_for_path_pattern (path, g_ptr_array_index (self->other, i), add_prefix, to_remove_ht);
+}
+
 gboolean
 strip (GError **error,
        ...)
@@ -350,6 +579,137 @@ builder_migrate_locale_dirs (GFile   *root_dir,
   return TRUE;
 }
 
+typedef struct
+{
+  GThreadPool    *pool;
+  int             root_dfd;
+  BuilderWalkFunc func;
+  gpointer        user_data;
+  GMutex          lock;
+  GCond           cond;
+  int             pending;
+  GError         *error;
+} WalkData;
+
+static gboolean
+walk_one_dir (WalkData   *data,
+              const char *rel_dir,
+              GError    **error)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0, };
+  g_autoptr(GError) my_error = NULL;
+
+  if (!glnx_dirfd_iterator_init_at (data->root_dfd, *rel_dir != 0 ? rel_dir : ".",
+                                    FALSE, &iter, &my_error))
+    {
+      if (g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        return TRUE;
+
+      g_propagate_error (error, g_steal_pointer (&my_error));
+      return FALSE;
+    }
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&iter, &dent, NULL, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (dent->d_type == DT_DIR)
+        {
+          g_mutex_lock (&data->lock);
+          data->pending++;
+          g_mutex_unlock (&data->lock);
+
+          g_thread_pool_push (data->pool, g_build_filename (rel_dir, dent->d_name, NULL), NULL);
+        }
+      else if (!data->func (iter.fd, rel_dir, dent, data->user_data, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+walk_dir_thread (gpointer task_data,
+                 gpointer user_data)
+{
+  g_autofree char *rel_dir = task_data;
+  WalkData *data = user_data;
+  GError *error = NULL;
+  gboolean failed;
+
+  g_mutex_lock (&data->lock);
+  failed = data->error != NULL;
+  g_mutex_unlock (&data->lock);
+
+  if (!failed)
+    walk_one_dir (data, rel_dir, &error);
+
+  g_mutex_lock (&data->lock);
+  if (error != NULL && data->error == NULL)
+    data->error = g_steal_pointer (&error);
+  g_clear_error (&error);
+
+  data->pending--;
+  if (data->pending == 0)
+    g_cond_signal (&data->cond);
+  g_mutex_unlock (&data->lock);
+}
+
+/* Calls func for every non-directory below root. Each directory is
+ * queued as a separate job, so large trees are spread over n_threads
+ * workers. func is called concurrently for different directories, but
+ * all entries of one directory are handled by the same thread. Symlinks
+ * are not followed. */
+gboolean
+builder_walk_dir_parallel (GFile           *root,
+                           int              n_threads,
+                           BuilderWalkFunc  func,
+                           gpointer         user_data,
+                           GError         **error)
+{
+  WalkData data = { 0, };
+  glnx_fd_close int root_dfd = -1;
+
+  if (!glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (root), TRUE, &root_dfd, error))
+    return FALSE;
+
+  data.root_dfd = root_dfd;
+  data.func = func;
+  data.user_data = user_data;
+  data.pool = g_thread_pool_new (walk_dir_thread, &data, MAX (n_threads, 1), FALSE, error);
+  if (data.pool == NULL)
+    return FALSE;
+
+  g_mutex_init (&data.lock);
+  g_cond_init (&data.cond);
+
+  data.pending = 1;
+  g_thread_pool_push (data.pool, g_strdup (""), NULL);
+
+  g_mutex_lock (&data.lock);
+  while (data.pending > 0)
+    g_cond_wait (&data.cond, &data.lock);
+  g_mutex_unlock (&data.lock);
+
+  g_thread_pool_free (data.pool, FALSE, TRUE);
+  g_mutex_clear (&data.lock);
+  g_cond_clear (&data.cond);
+
+  if (data.error != NULL)
+    {
+      g_propagate_error (error, data.error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 
 /*
  * This code is based on debugedit.c from rpm, which has this copyright:
@@ -1467,7 +1827,7 @@ builder_host_spawnv (GFile                *dir,
   if (connection == NULL)
     return FALSE;
 
-  loop = g_main_loop_new (NULL, FALSE);
+  loop = g_main_loop_new (g_main_context_get_thread_default (), FALSE);
   data.connection = connection;
   data.loop = loop;
   data.refs = 1;
@@ -1598,3 +1958,52 @@ builder_maybe_host_spawnv (GFile                *dir,
 
   return flatpak_spawnv (dir, output, error, argv);
 }
+
+void
+builder_timer_start (BuilderTimer *timer)
+{
+  timer->start_time = g_get_monotonic_time ();
+  getrusage (RUSAGE_CHILDREN, &timer->start_usage);
+}
+
+/* In microseconds */
+gint64
+builder_timer_elapsed (BuilderTimer *timer)
+{
+  return g_get_monotonic_time () - timer->start_time;
+}
+
+static double
+timeval_to_seconds (const struct timeval *tv)
+{
+  return tv->tv_sec + tv->tv_usec / (double) G_USEC_PER_SEC;
+}
+
+/* Records the time since the timer was started as the given phase.
+ * The cpu time and memory use come from the child processes that
+ * exited in the meantime, so they only cover commands we spawned
+ * ourselves, and are shared between modules built at the same time.
+ * Note that the kernel only tracks the peak rss of all children, so
+ * this is the largest process so far rather than of this phase. */
+void
+builder_timer_report (BuilderTimer *timer,
+                      JsonObject   *phases,
+                      const char   *phase)
+{
+  JsonObject *report = json_object_new ();
+  struct rusage usage;
+  double cpu_time;
+
+  getrusage (RUSAGE_CHILDREN, &usage);
+
+  cpu_time =
+    timeval_to_seconds (&usage.ru_utime) - timeval_to_seconds (&timer->start_usage.ru_utime) +
+    timeval_to_seconds (&usage.ru_stime) - timeval_to_seconds (&timer->start_usage.ru_stime);
+
+  json_object_set_double_member (report, "wall-time",
+                                 builder_timer_elapsed (timer) / (double) G_USEC_PER_SEC);
+  json_object_set_double_member (report, "cpu-time", cpu_time);
+  json_object_set_int_member (report, "max-rss", usage.ru_maxrss);
+
+  json_object_set_object_member (phases, phase, report);
+}
@@ -21,8 +21,11 @@
 #ifndef __BUILDER_UTILS_H__
 #define __BUILDER_UTILS_H__
 
+#include <sys/resource.h>
+#include <dirent.h>
 #include <gio/gio.h>
 #include <libsoup/soup.h>
+#include <json-glib/json-glib.h>
 
 G_BEGIN_DECLS
 
@@ -50,9 +53,35 @@ void     flatpak_collect_matches_for_path_pattern (const char *path,
                                                    const char *pattern,
                                                    const char *add_prefix,
                                                    GHashTable *to_remove_ht);
+
+typedef struct BuilderCleanupMatcher BuilderCleanupMatcher;
+
+BuilderCleanupMatcher *builder_cleanup_matcher_new (const char **patterns);
+void                   builder_cleanup_matcher_free (BuilderCleanupMatcher *self);
+gboolean               builder_cleanup_matcher_matches (BuilderCleanupMatcher *self,
+                                                        const char            *path);
+void                   builder_cleanup_matcher_collect (BuilderCleanupMatcher *self,
+                                                        const char            *path,
+                                                        const char            *add_prefix,
+                                                        GHashTable            *to_remove_ht);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (BuilderCleanupMatcher, builder_cleanup_matcher_free)
+
 gboolean builder_migrate_locale_dirs (GFile   *root_dir,
                                       GError **error);
 
+typedef gboolean (*BuilderWalkFunc) (int            dfd,
+                                     const char    *rel_dir,
+                                     struct dirent *dent,
+                                     gpointer       user_data,
+                                     GError       **error);
+
+gboolean builder_walk_dir_parallel (GFile           *root,
+                                    int              n_threads,
+                                    BuilderWalkFunc  func,
+                                    gpointer         user_data,
+                                    GError         **error);
+
 gboolean builder_host_spawnv (GFile                *dir,
                               char                **output,
                               GError              **error,
@@ -62,6 +91,18 @@ gboolean builder_maybe_host_spawnv (GFile                *dir,
                                     GError              **error,
                                     const gchar * const  *argv);
 
+typedef struct
+{
+  gint64        start_time;
+  struct rusage start_usage;
+} BuilderTimer;
+
+void    builder_timer_start (BuilderTimer *timer);
+gint64  builder_timer_elapsed (BuilderTimer *timer);
+void    builder_timer_report (BuilderTimer *timer,
+                              JsonObject   *phases,
+                              const char   *phase);
+
 
 G_END_DECLS
 
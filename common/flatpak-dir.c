@@ -24,7 +24,9 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <utime.h>
 #include <glnx-console.h>
 
@@ -95,6 +97,10 @@ struct FlatpakDir
   GHashTable          *summary_cache;
 
   SoupSession         *soup_session;
+
+  int                  triggers_batch;
+  gboolean             pending_triggers;
+  GHashTable          *pending_trigger_exports; /* NULL while pending means all */
 };
 
 typedef struct
@@ -247,6 +253,8 @@ flatpak_deploy_get_overrides (FlatpakDeploy *deploy)
   return overrides;
 }
 
+/* The returned keyfile may be shared with other deploys of the same
+   commit via the metadata cache, so it must not be modified */
 GKeyFile *
 flatpak_deploy_get_metadata (FlatpakDeploy *deploy)
 {
@@ -688,6 +696,7 @@ flatpak_dir_finalize (GObject *object)
 
   g_clear_object (&self->soup_session);
   g_clear_pointer (&self->summary_cache, g_hash_table_unref);
+  g_clear_pointer (&self->pending_trigger_exports, g_hash_table_unref);
 
   G_OBJECT_CLASS (flatpak_dir_parent_class)->finalize (object);
 }
@@ -876,6 +885,179 @@ flatpak_dir_load_override (FlatpakDir *self,
   return metadata_contents;
 }
 
+/* Process-wide cache of parsed metadata and override files, so that
+ * the same files are not re-read and re-parsed several times per
+ * command. Entries are keyed by path and only used as long as the
+ * file identity (device, inode, size, mtime and ctime) is unchanged.
+ * Stale entries are dropped when they are looked up, and the least
+ * recently used ones once there are more than KEYFILE_CACHE_MAX_SIZE,
+ * so long-running processes don't keep every file they ever read.
+ * The cached keyfiles are shared and must not be modified.
+ */
+#define KEYFILE_CACHE_MAX_SIZE 64
+
+typedef struct
+{
+  GList           link;
+  char           *path;
+  dev_t           dev;
+  ino_t           ino;
+  off_t           size;
+  struct timespec mtime;
+  struct timespec ctime;
+  GKeyFile       *keyfile;
+  FlatpakContext *context;
+} CachedKeyFile;
+
+G_LOCK_DEFINE_STATIC (keyfile_cache);
+static GHashTable *keyfile_cache = NULL;
+/* Most recently used first */
+static GQueue keyfile_cache_lru = G_QUEUE_INIT;
+
+static void
+cached_keyfile_free (CachedKeyFile *cached)
+{
+  g_free (cached->path);
+  g_key_file_unref (cached->keyfile);
+  g_clear_pointer (&cached->context, flatpak_context_free);
+  g_free (cached);
+}
+
+/* Must be called with the keyfile_cache lock held */
+static void
+keyfile_cache_remove (CachedKeyFile *cached)
+{
+  g_queue_unlink (&keyfile_cache_lru, &cached->link);
+  g_hash_table_steal (keyfile_cache, cached->path);
+  cached_keyfile_free (cached);
+}
+
+/* Must be called with the keyfile_cache lock held */
+static void
+keyfile_cache_insert (CachedKeyFile *cached)
+{
+  CachedKeyFile *old;
+
+  if (keyfile_cache == NULL)
+    keyfile_cache = g_hash_table_new (g_str_hash, g_str_equal);
+
+  old = g_hash_table_lookup (keyfile_cache, cached->path);
+  if (old != NULL)
+    keyfile_cache_remove (old);
+
+  while (keyfile_cache_lru.length >= KEYFILE_CACHE_MAX_SIZE)
+    keyfile_cache_remove (keyfile_cache_lru.tail->data);
+
+  cached->link.data = cached;
+  g_queue_push_head_link (&keyfile_cache_lru, &cached->link);
+  g_hash_table_insert (keyfile_cache, cached->path, cached);
+}
+
+static gboolean
+cached_keyfile_matches (CachedKeyFile *cached,
+                        struct stat   *stbuf)
+{
+  return
+    cached->dev == stbuf->st_dev &&
+    cached->ino == stbuf->st_ino &&
+    cached->size == stbuf->st_size &&
+    cached->mtime.tv_sec == stbuf->st_mtim.tv_sec &&
+    cached->mtime.tv_nsec == stbuf->st_mtim.tv_nsec &&
+    cached->ctime.tv_sec == stbuf->st_ctim.tv_sec &&
+    cached->ctime.tv_nsec == stbuf->st_ctim.tv_nsec;
+}
+
+static FlatpakContext *
+context_copy (FlatpakContext *context)
+{
+  FlatpakContext *copy = flatpak_context_new ();
+
+  flatpak_context_merge (copy, context);
+  return copy;
+}
+
+/* Returns a (shared) parsed keyfile for file, and if context_out is
+ * set, a new copy of the context parsed from it. */
+static GKeyFile *
+load_cached_keyfile (GFile           *file,
+                     FlatpakContext **context_out,
+                     GCancellable    *cancellable,
+                     GError         **error)
+{
+  const char *path = flatpak_file_get_path_cached (file);
+  g_autofree char *contents = NULL;
+  g_autoptr(GKeyFile) keyfile = NULL;
+  g_autoptr(FlatpakContext) context = NULL;
+  CachedKeyFile *cached;
+  struct stat stbuf;
+  gsize size;
+
+  if (stat (path, &stbuf) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return NULL;
+    }
+
+  G_LOCK (keyfile_cache);
+
+  cached = keyfile_cache ? g_hash_table_lookup (keyfile_cache, path) : NULL;
+  if (cached != NULL && !cached_keyfile_matches (cached, &stbuf))
+    {
+      keyfile_cache_remove (cached);
+      cached = NULL;
+    }
+
+  if (cached != NULL && (context_out == NULL || cached->context != NULL))
+    {
+      g_queue_unlink (&keyfile_cache_lru, &cached->link);
+      g_queue_push_head_link (&keyfile_cache_lru, &cached->link);
+
+      keyfile = g_key_file_ref (cached->keyfile);
+      if (context_out)
+        *context_out = context_copy (cached->context);
+      G_UNLOCK (keyfile_cache);
+      return g_steal_pointer (&keyfile);
+    }
+
+  G_UNLOCK (keyfile_cache);
+
+  /* If the file changes after the stat we may cache newer contents
+     under the old identity, which only means we parse it again next time */
+  if (!g_file_load_contents (file, cancellable, &contents, &size, NULL, error))
+    return NULL;
+
+  keyfile = g_key_file_new ();
+  if (!g_key_file_load_from_data (keyfile, contents, size, 0, error))
+    return NULL;
+
+  if (context_out)
+    {
+      context = flatpak_context_new ();
+      if (!flatpak_context_load_metadata (context, keyfile, error))
+        return NULL;
+    }
+
+  cached = g_new0 (CachedKeyFile, 1);
+  cached->path = g_strdup (path);
+  cached->dev = stbuf.st_dev;
+  cached->ino = stbuf.st_ino;
+  cached->size = stbuf.st_size;
+  cached->mtime = stbuf.st_mtim;
+  cached->ctime = stbuf.st_ctim;
+  cached->keyfile = g_key_file_ref (keyfile);
+  if (context)
+    cached->context = context_copy (context);
+
+  G_LOCK (keyfile_cache);
+  keyfile_cache_insert (cached);
+  G_UNLOCK (keyfile_cache);
+
+  if (context_out)
+    *context_out = g_steal_pointer (&context);
+
+  return g_steal_pointer (&keyfile);
+}
+
 GKeyFile *
 flatpak_load_override_keyfile (const char *app_id, gboolean user, GError **error)
 {
@@ -885,6 +1067,7 @@ flatpak_load_override_keyfile (const char *app_id, gboolean user, GError **error
   g_autoptr(GKeyFile) metakey = g_key_file_new ();
   g_autoptr(FlatpakDir) dir = NULL;
 
+  /* Not cached, as callers modify and save the returned keyfile */
   dir = user ? flatpak_dir_get_user () : flatpak_dir_get_system_default ();
 
   metadata_contents = flatpak_dir_load_override (dir, app_id, &metadata_size, error);
@@ -903,27 +1086,33 @@ flatpak_load_override_keyfile (const char *app_id, gboolean user, GError **error
 FlatpakContext *
 flatpak_load_override_file (const char *app_id, gboolean user, GError **error)
 {
-  g_autoptr(FlatpakContext) overrides = flatpak_context_new ();
-
+  g_autoptr(FlatpakDir) dir = NULL;
+  g_autoptr(GFile) override_dir = NULL;
+  g_autoptr(GFile) file = NULL;
   g_autoptr(GKeyFile) metakey = NULL;
   g_autoptr(GError) my_error = NULL;
+  FlatpakContext *overrides = NULL;
+
+  dir = user ? flatpak_dir_get_user () : flatpak_dir_get_system_default ();
+  override_dir = g_file_get_child (dir->basedir, "overrides");
+  file = g_file_get_child (override_dir, app_id);
 
-  metakey = flatpak_load_override_keyfile (app_id, user, &my_error);
+  metakey = load_cached_keyfile (file, &overrides, NULL, &my_error);
   if (metakey == NULL)
     {
-      if (!g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+      /* As with flatpak_dir_load_override(), an override file that
+         can't be read (missing, unreadable, ...) means no overrides,
+         only a file that doesn't parse is an error */
+      if (my_error->domain != G_IO_ERROR)
         {
           g_propagate_error (error, g_steal_pointer (&my_error));
           return NULL;
         }
-    }
-  else
-    {
-      if (!flatpak_context_load_metadata (overrides, metakey, error))
-        return NULL;
+
+      return flatpak_context_new ();
     }
 
-  return g_steal_pointer (&overrides);
+  return overrides;
 }
 
 gboolean
@@ -968,9 +1157,7 @@ flatpak_dir_load_deployed (FlatpakDir   *self,
   g_autoptr(GKeyFile) metakey = NULL;
   g_autoptr(GFile) metadata = NULL;
   g_auto(GStrv) ref_parts = NULL;
-  g_autofree char *metadata_contents = NULL;
   FlatpakDeploy *deploy;
-  gsize metadata_size;
 
   deploy_dir = flatpak_dir_get_if_deployed (self, ref, checksum, cancellable);
   if (deploy_dir == NULL)
@@ -981,11 +1168,8 @@ flatpak_dir_load_deployed (FlatpakDir   *self,
     }
 
   metadata = g_file_get_child (deploy_dir, "metadata");
-  if (!g_file_load_contents (metadata, cancellable, &metadata_contents, &metadata_size, NULL, error))
-    return NULL;
-
-  metakey = g_key_file_new ();
-  if (!g_key_file_load_from_data (metakey, metadata_contents, metadata_size, 0, error))
+  metakey = load_cached_keyfile (metadata, NULL, cancellable, error);
+  if (metakey == NULL)
     return NULL;
 
   deploy = flatpak_deploy_new (deploy_dir, metakey);
@@ -1774,21 +1958,171 @@ ensure_soup_session (FlatpakDir *self)
     }
 }
 
-typedef struct {
+/* Max number of extra data sources downloaded at the same time */
+#define MAX_PARALLEL_EXTRA_DATA_DOWNLOADS 4
+
+typedef struct ExtraDataProgress ExtraDataProgress;
+
+typedef struct ExtraDataDownload {
+  ExtraDataProgress *extra_progress;
+  SoupSession *soup_session;
+  GCancellable *cancellable;
+  int tmp_dfd;
+  const char *uri;
+  const char *name;
+  char *sha256;
+  char *partial_name;
+  guint64 download_size;
+  guint64 downloaded_bytes;
+  int fd;
+  GBytes *bytes;
+  GError *error;
+  /* An earlier source with the same checksum, whose download is shared */
+  struct ExtraDataDownload *same_as;
+} ExtraDataDownload;
+
+struct ExtraDataProgress {
   OstreeAsyncProgress *progress;
-  guint64 previous_dl;
-} ExtraDataProgress;
+  GMutex lock;
+  ExtraDataDownload *downloads;
+  gsize n_downloads;
+  gsize outstanding;
+};
 
 static void
 extra_data_progress_report (guint64 downloaded_bytes,
                             gpointer user_data)
 {
-  ExtraDataProgress *extra_progress = user_data;
+  ExtraDataDownload *download = user_data;
+  ExtraDataProgress *extra_progress = download->extra_progress;
+  guint64 total = 0;
+  gsize i;
+
+  if (extra_progress->progress == NULL)
+    return;
+
+  g_mutex_lock (&extra_progress->lock);
+  download->downloaded_bytes = downloaded_bytes;
+  for (i = 0; i < extra_progress->n_downloads; i++)
+    total += extra_progress->downloads[i].downloaded_bytes;
+  ostree_async_progress_set_uint64 (extra_progress->progress, "transferred-extra-data-bytes", total);
+  g_mutex_unlock (&extra_progress->lock);
+}
+
+/* Runs in a thread pool. The data goes straight to disk while being
+   hashed, and the result is mapped rather than read into memory. The fd
+   is kept open until we're done, as it holds the lock that stops anyone
+   else from truncating the file under the mapping. */
+static void
+extra_data_download_thread (gpointer data,
+                            gpointer user_data)
+{
+  ExtraDataDownload *download = data;
+  ExtraDataProgress *extra_progress = download->extra_progress;
+  g_autoptr(GMappedFile) mfile = NULL;
+
+  download->fd = flatpak_download_http_uri_resumable (download->soup_session, download->uri,
+                                            download->tmp_dfd, download->partial_name,
+                                            download->sha256,
+                                            extra_data_progress_report, download,
+                                            download->cancellable, &download->error);
+  if (download->fd == -1)
+    {
+      /* No point in finishing the others, the pull fails anyway */
+      g_cancellable_cancel (download->cancellable);
+      g_prefix_error (&download->error, _("While downloading %s: "), download->uri);
+      return;
+    }
+
+  mfile = g_mapped_file_new_from_fd (download->fd, FALSE, &download->error);
+  if (mfile == NULL)
+    {
+      g_cancellable_cancel (download->cancellable);
+      return;
+    }
+
+  download->bytes = g_mapped_file_get_bytes (mfile);
+
+  if (g_bytes_get_size (download->bytes) != download->download_size)
+    {
+      flatpak_fail (&download->error, _("Wrong size for extra data %s"), download->uri);
+      g_cancellable_cancel (download->cancellable);
+      return;
+    }
 
+  g_mutex_lock (&extra_progress->lock);
+  extra_progress->outstanding--;
   if (extra_progress->progress)
-    ostree_async_progress_set_uint64 (extra_progress->progress, "transferred-extra-data-bytes",
-                                      extra_progress->previous_dl + downloaded_bytes);
+    ostree_async_progress_set_uint (extra_progress->progress, "outstanding-extra-data",
+                                    extra_progress->outstanding);
+  g_mutex_unlock (&extra_progress->lock);
+}
+
+static void
+extra_data_download_clear (ExtraDataDownload *download)
+{
+  g_free (download->sha256);
+  g_free (download->partial_name);
+  if (download->bytes)
+    g_bytes_unref (download->bytes);
+  if (download->fd != -1)
+    close (download->fd);
+  g_clear_error (&download->error);
+}
+
+static void
+extra_data_cancel_downloads (GCancellable *cancellable,
+                             gpointer      user_data)
+{
+  g_cancellable_cancel (G_CANCELLABLE (user_data));
+}
+
+/* Serializes metadata into the file fd and returns it as a mapped
+ * variant. The extra data in it is backed by mapped files too, so this
+ * avoids assembling the whole thing in a single heap buffer, which is
+ * what g_variant_get_data() would do. */
+static GVariant *
+extra_data_store_metadata (GVariant     *metadata,
+                           int           fd,
+                           GError      **error)
+{
+  gsize size = g_variant_get_size (metadata);
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  void *data;
+
+  if (fchmod (fd, 0644) != 0 || ftruncate (fd, size) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return NULL;
+    }
+
+  data = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED)
+    {
+      glnx_set_error_from_errno (error);
+      return NULL;
+    }
+
+  g_variant_store (metadata, data);
+
+  if (msync (data, size, MS_SYNC) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      munmap (data, size);
+      return NULL;
+    }
+  munmap (data, size);
 
+  mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (mfile == NULL)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes (mfile);
+
+  /* We just serialized it ourselves, so it is in normal form, and
+     g_variant_get_normal_form() won't make another copy */
+  return g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE ("a{sv}"), bytes, TRUE));
 }
 
 static gboolean
@@ -1807,11 +2141,22 @@ flatpak_dir_pull_extra_data (FlatpakDir          *self,
   g_auto(GVariantDict) new_metadata_dict = FLATPAK_VARIANT_DICT_INITIALIZER;
   g_autoptr(GVariantBuilder) extra_data_builder = NULL;
   g_autoptr(GVariant) new_detached_metadata = NULL;
+  g_autoptr(GVariant) stored_detached_metadata = NULL;
   g_autoptr(GVariant) extra_data = NULL;
-  int i;
+  g_autoptr(GCancellable) download_cancellable = g_cancellable_new ();
+  g_autofree char *metadata_tmp_name = NULL;
+  glnx_fd_close int metadata_fd = -1;
+  gulong cancelled_id = 0;
+  GError *download_error = NULL;
+  gboolean ret = FALSE;
+  int i, j;
   gsize n_extra_data;
+  gsize n_unique;
   guint64 total_download_size;
   ExtraDataProgress extra_data_progress = { NULL };
+  g_autofree ExtraDataDownload *downloads = NULL;
+  GThreadPool *pool;
+  glnx_fd_close int tmp_dfd = -1;
 
   extra_data_sources = flatpak_repo_get_extra_data_sources (repo, rev, cancellable, NULL);
   if (extra_data_sources == NULL)
@@ -1824,130 +2169,228 @@ flatpak_dir_pull_extra_data (FlatpakDir          *self,
   if ((flatpak_flags & FLATPAK_PULL_FLAGS_DOWNLOAD_EXTRA_DATA) == 0)
     return flatpak_fail (error, "extra data not supported for non-gpg-verified local system installs");
 
-  extra_data_builder = g_variant_builder_new (G_VARIANT_TYPE ("a(ayay)"));
+  if (!glnx_opendirat (ostree_repo_get_dfd (repo), "tmp", TRUE, &tmp_dfd, error))
+    return FALSE;
+
+  ensure_soup_session (self);
 
+  downloads = g_new0 (ExtraDataDownload, n_extra_data);
+  for (i = 0; i < n_extra_data; i++)
+    downloads[i].fd = -1;
+  extra_data_progress.progress = progress;
+  extra_data_progress.downloads = downloads;
+  extra_data_progress.n_downloads = n_extra_data;
+  g_mutex_init (&extra_data_progress.lock);
+
+  n_unique = 0;
   total_download_size = 0;
   for (i = 0; i < n_extra_data; i++)
     {
-      guint64 download_size;
+      ExtraDataDownload *download = &downloads[i];
+      const guchar *sha256_bytes;
+
+      download->extra_progress = &extra_data_progress;
+      download->soup_session = self->soup_session;
+      download->cancellable = download_cancellable;
+      download->tmp_dfd = tmp_dfd;
 
       flatpak_repo_parse_extra_data_sources (extra_data_sources, i,
+                                             &download->name,
+                                             &download->download_size,
                                              NULL,
-                                             &download_size,
-                                             NULL,
-                                             NULL,
-                                             NULL);
+                                             &sha256_bytes,
+                                             &download->uri);
+
+      if (sha256_bytes == NULL)
+        {
+          flatpak_fail (error, _("Invalid sha256 for extra data uri %s"), download->uri);
+          goto out;
+        }
+
+      download->sha256 = ostree_checksum_from_bytes (sha256_bytes);
+
+      if (*download->name == 0)
+        {
+          flatpak_fail (error, _("Empty name for extra data uri %s"), download->uri);
+          goto out;
+        }
+
+      /* Don't allow file uris here as that could read local files based on remote data */
+      if (!g_str_has_prefix (download->uri, "http:") &&
+          !g_str_has_prefix (download->uri, "https:"))
+        {
+          flatpak_fail (error, _("Unsupported extra data uri %s"), download->uri);
+          goto out;
+        }
+
+      /* Sources with the same content are only downloaded once. They
+         would share the partial file below, which only one download
+         at a time can use. */
+      for (j = 0; j < i; j++)
+        {
+          if (downloads[j].same_as == NULL &&
+              strcmp (downloads[j].sha256, download->sha256) == 0)
+            {
+              download->same_as = &downloads[j];
+              break;
+            }
+        }
+
+      if (download->same_as != NULL)
+        {
+          if (download->same_as->download_size != download->download_size)
+            {
+              flatpak_fail (error, _("Wrong size for extra data %s"), download->uri);
+              goto out;
+            }
+          continue;
+        }
+
+      /* Download to disk, named after the checksum, so that an
+         interrupted download can be resumed on the next try */
+      download->partial_name = g_strconcat ("extra-data-", download->sha256, ".partial", NULL);
 
-      total_download_size += download_size;
+      total_download_size += download->download_size;
+      n_unique++;
     }
 
+  extra_data_progress.outstanding = n_unique;
+
   if (progress)
     {
-      ostree_async_progress_set_uint (progress, "outstanding-extra-data", n_extra_data);
-      ostree_async_progress_set_uint (progress, "total-extra-data", n_extra_data);
+      ostree_async_progress_set_uint (progress, "outstanding-extra-data", n_unique);
+      ostree_async_progress_set_uint (progress, "total-extra-data", n_unique);
       ostree_async_progress_set_uint64 (progress, "total-extra-data-bytes", total_download_size);
       ostree_async_progress_set_uint64 (progress, "transferred-extra-data-bytes", 0);
     }
 
-  extra_data_progress.progress = progress;
+  /* The downloads share a cancellable, so that the first one to fail
+     stops the others. It is also cancelled along with the caller's. */
+  if (cancellable)
+    cancelled_id = g_cancellable_connect (cancellable, G_CALLBACK (extra_data_cancel_downloads),
+                                          download_cancellable, NULL);
 
+  pool = g_thread_pool_new (extra_data_download_thread, NULL,
+                            MIN (n_unique, MAX_PARALLEL_EXTRA_DATA_DOWNLOADS),
+                            FALSE, NULL);
   for (i = 0; i < n_extra_data; i++)
     {
-      const char *extra_data_uri = NULL;
-      g_autofree char *extra_data_sha256 = NULL;
-      const char *extra_data_name = NULL;
-      guint64 download_size;
-      guint64 installed_size;
-      g_autofree char *sha256 = NULL;
-      const guchar *sha256_bytes;
-      g_autoptr(GBytes) bytes = NULL;
-
-      flatpak_repo_parse_extra_data_sources (extra_data_sources, i,
-                                             &extra_data_name,
-                                             &download_size,
-                                             &installed_size,
-                                             &sha256_bytes,
-                                             &extra_data_uri);
-
-      if (sha256_bytes == NULL)
-        return flatpak_fail (error, _("Invalid sha256 for extra data uri %s"), extra_data_uri);
-
-      extra_data_sha256 = ostree_checksum_from_bytes (sha256_bytes);
+      if (downloads[i].same_as == NULL)
+        g_thread_pool_push (pool, &downloads[i], NULL);
+    }
+  g_thread_pool_free (pool, FALSE, TRUE);
 
-      if (*extra_data_name == 0)
-        return flatpak_fail (error, _("Empty name for extra data uri %s"), extra_data_uri);
+  if (cancellable)
+    g_cancellable_disconnect (cancellable, cancelled_id);
 
-      /* Don't allow file uris here as that could read local files based on remote data */
-      if (!g_str_has_prefix (extra_data_uri, "http:") &&
-          !g_str_has_prefix (extra_data_uri, "https:"))
-        return flatpak_fail (error, _("Unsupported extra data uri %s"), extra_data_uri);
+  /* Report the error that caused the others to be cancelled */
+  for (i = 0; i < n_extra_data; i++)
+    {
+      GError *download_error_i = downloads[i].error;
 
-      /* TODO: Download to disk to support resumed downloads on error */
+      if (download_error_i != NULL &&
+          (download_error == NULL ||
+           (g_error_matches (download_error, G_IO_ERROR, G_IO_ERROR_CANCELLED) &&
+            !g_error_matches (download_error_i, G_IO_ERROR, G_IO_ERROR_CANCELLED))))
+        download_error = download_error_i;
+    }
 
-      ensure_soup_session (self);
-      bytes = flatpak_load_http_uri (self->soup_session, extra_data_uri,
-                                     extra_data_progress_report, &extra_data_progress,
-                                     cancellable, error);
-      if (bytes == NULL)
-        {
-          g_prefix_error (error, _("While downloading %s: "), extra_data_uri);
-          return FALSE;
-        }
+  if (download_error != NULL)
+    {
+      g_propagate_error (error, g_error_copy (download_error));
+      goto out;
+    }
 
-      if (g_bytes_get_size (bytes) != download_size)
-        return flatpak_fail (error, _("Wrong size for extra data %s"), extra_data_uri);
+  extra_data_builder = g_variant_builder_new (G_VARIANT_TYPE ("a(ayay)"));
 
-      extra_data_progress.previous_dl += download_size;
-      if (progress)
-        ostree_async_progress_set_uint (progress, "outstanding-extra-data", n_extra_data - i - 1);
+  for (i = 0; i < n_extra_data; i++)
+    {
+      ExtraDataDownload *download = &downloads[i];
 
-      sha256 = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, bytes);
-      if (strcmp (sha256, extra_data_sha256) != 0)
-        return flatpak_fail (error, _("Invalid checksum for extra data %s"), extra_data_uri);
+      if (download->same_as != NULL)
+        download->bytes = g_bytes_ref (download->same_as->bytes);
 
       g_variant_builder_add (extra_data_builder,
                              "(^ay@ay)",
-                             extra_data_name,
-                             g_variant_new_from_bytes (G_VARIANT_TYPE ("ay"), bytes, TRUE));
+                             download->name,
+                             g_variant_new_from_bytes (G_VARIANT_TYPE ("ay"), download->bytes, TRUE));
     }
 
   extra_data = g_variant_ref_sink (g_variant_builder_end (extra_data_builder));
 
   if (!ostree_repo_read_commit_detached_metadata (repo, rev, &detached_metadata,
                                                   cancellable, error))
-    return FALSE;
+    goto out;
+
+  /* The stored copy is marked as trusted, so everything that goes
+     into it must already be in normal form */
+  if (detached_metadata != NULL)
+    {
+      GVariant *normalized = g_variant_get_normal_form (detached_metadata);
+      g_variant_unref (detached_metadata);
+      detached_metadata = normalized;
+    }
 
   g_variant_dict_init (&new_metadata_dict, detached_metadata);
   g_variant_dict_insert_value (&new_metadata_dict, "xa.extra-data", extra_data);
-  new_detached_metadata = g_variant_dict_end (&new_metadata_dict);
+  new_detached_metadata = g_variant_ref_sink (g_variant_dict_end (&new_metadata_dict));
+
+  /* An anonymous (or at least uniquely named) file, so that concurrent
+     pulls of the same commit don't write to each other's file */
+  if (!glnx_open_tmpfile_linkable_at (tmp_dfd, ".", O_RDWR,
+                                      &metadata_fd, &metadata_tmp_name, error))
+    goto out;
+
+  stored_detached_metadata = extra_data_store_metadata (new_detached_metadata, metadata_fd, error);
+  if (stored_detached_metadata == NULL)
+    {
+      g_prefix_error (error, "Unable to write detached metadata: ");
+      goto out;
+    }
 
   /* There is a commitmeta size limit when pulling, so we have to side-load it
      when installing in the system repo */
   if (flatpak_flags & FLATPAK_PULL_FLAGS_SIDELOAD_EXTRA_DATA)
     {
       int dfd =  ostree_repo_get_dfd (repo);
-      g_autoptr(GVariant) normalized = g_variant_get_normal_form (new_detached_metadata);
-      gsize normalized_size = g_variant_get_size (normalized);
-      const guint8 *data = g_variant_get_data (normalized);
       g_autofree char *filename = NULL;
 
+      /* Already written out in full, so just link it into place */
       filename = g_strconcat (rev, ".commitmeta", NULL);
-      if (!glnx_file_replace_contents_at (dfd, filename,
-                                          data, normalized_size,
-                                          0, cancellable, error))
+      if (!glnx_link_tmpfile_at (tmp_dfd, GLNX_LINK_TMPFILE_REPLACE,
+                                 metadata_fd, metadata_tmp_name,
+                                 dfd, filename, error))
         {
           g_prefix_error (error, "Unable to write sideloaded detached metadata: ");
-          return FALSE;
+          goto out;
         }
+      g_clear_pointer (&metadata_tmp_name, g_free);
     }
   else
     {
-      if (!ostree_repo_write_commit_detached_metadata (repo, rev, new_detached_metadata,
+      if (!ostree_repo_write_commit_detached_metadata (repo, rev, stored_detached_metadata,
                                                        cancellable, error))
-        return FALSE;
+        goto out;
     }
 
-  return TRUE;
+  /* Only now that the data is safely stored, remove the downloads.
+     On errors they are kept so that the next try can resume */
+  for (i = 0; i < n_extra_data; i++)
+    {
+      if (downloads[i].partial_name != NULL)
+        (void) unlinkat (tmp_dfd, downloads[i].partial_name, 0);
+    }
+
+  ret = TRUE;
+
+ out:
+  if (metadata_tmp_name != NULL)
+    (void) unlinkat (tmp_dfd, metadata_tmp_name, 0);
+  for (i = 0; i < n_extra_data; i++)
+    extra_data_download_clear (&downloads[i]);
+  g_mutex_clear (&extra_data_progress.lock);
+
+  return ret;
 }
 
 static gboolean
@@ -2780,22 +3223,196 @@ out:
 }
 
 
-gboolean
-flatpak_dir_run_triggers (FlatpakDir   *self,
-                          GCancellable *cancellable,
-                          GError      **error)
+static char *
+readlinkat_malloc (int         dfd,
+                   const char *name)
 {
-  gboolean ret = FALSE;
+  char buf[PATH_MAX + 1];
+  ssize_t len;
 
-  g_autoptr(GFileEnumerator) dir_enum = NULL;
-  g_autoptr(GFileInfo) child_info = NULL;
-  g_autoptr(GFile) triggersdir = NULL;
-  GError *temp_error = NULL;
-  const char *triggerspath;
+  len = readlinkat (dfd, name, buf, sizeof (buf) - 1);
+  if (len < 0)
+    return NULL;
 
-  triggerspath = g_getenv ("FLATPAK_TRIGGERSDIR");
-  if (triggerspath == NULL)
-    triggerspath = FLATPAK_TRIGGERDIR;
+  buf[len] = 0;
+  return g_strdup (buf);
+}
+
+/* The export subdirectories that the builtin triggers read. Triggers
+ * not listed here are always run. */
+static const struct {
+  const char *trigger;
+  const char *watched_dir;
+} trigger_inputs[] = {
+  { "desktop-database.trigger", "share/applications/" },
+  { "gtk-icon-cache.trigger", "share/icons/" },
+  { "mime-database.trigger", "share/mime/" },
+};
+
+static const char *
+trigger_get_watched_dir (const char *name)
+{
+  int i;
+
+  for (i = 0; i < G_N_ELEMENTS (trigger_inputs); i++)
+    {
+      if (strcmp (trigger_inputs[i].trigger, name) == 0)
+        return trigger_inputs[i].watched_dir;
+    }
+
+  return NULL;
+}
+
+static gboolean
+trigger_needs_run (const char *name,
+                   GHashTable *changed_exports)
+{
+  GHashTableIter iter;
+  gpointer key;
+  const char *watched_dir;
+
+  if (changed_exports == NULL)
+    return TRUE;
+
+  watched_dir = trigger_get_watched_dir (name);
+  if (watched_dir == NULL)
+    return TRUE;
+
+  g_hash_table_iter_init (&iter, changed_exports);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      if (g_str_has_prefix ((const char *) key, watched_dir))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Computes a stamp for the export symlinks below watched_dir, covering
+ * their names, targets and the identity of the files they point to.
+ * Regular files, such as the caches written by the triggers themselves,
+ * are ignored. */
+static gboolean
+stamp_export_dir (int           parent_fd,
+                  const char   *name,
+                  GChecksum    *checksum,
+                  GCancellable *cancellable,
+                  GError      **error)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0 };
+  struct dirent *dent;
+
+  if (!glnx_dirfd_iterator_init_at (parent_fd, name, FALSE, &iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&iter, &dent, cancellable, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (dent->d_type == DT_DIR)
+        {
+          g_checksum_update (checksum, (guchar *) dent->d_name, strlen (dent->d_name) + 1);
+          if (!stamp_export_dir (iter.fd, dent->d_name, checksum, cancellable, error))
+            return FALSE;
+          g_checksum_update (checksum, (guchar *) "/", 2);
+        }
+      else if (dent->d_type == DT_LNK)
+        {
+          g_autofree char *target = readlinkat_malloc (iter.fd, dent->d_name);
+          g_autofree char *identity = NULL;
+          struct stat stbuf;
+
+          if (fstatat (iter.fd, dent->d_name, &stbuf, 0) != 0)
+            continue;
+
+          identity = g_strdup_printf ("%s\n%s\n%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":%" G_GINT64_FORMAT ":%ld.%ld\n",
+                                      dent->d_name, target ? target : "",
+                                      (guint64) stbuf.st_dev, (guint64) stbuf.st_ino,
+                                      (gint64) stbuf.st_size,
+                                      (long) stbuf.st_mtim.tv_sec, (long) stbuf.st_mtim.tv_nsec);
+          g_checksum_update (checksum, (guchar *) identity, -1);
+        }
+    }
+
+  return TRUE;
+}
+
+static char *
+flatpak_dir_get_trigger_stamp (FlatpakDir   *self,
+                               const char   *watched_dir,
+                               GCancellable *cancellable)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autoptr(GFile) exports = flatpak_dir_get_exports_dir (self);
+  g_autoptr(GFile) dir = g_file_resolve_relative_path (exports, watched_dir);
+
+  if (g_file_query_exists (dir, cancellable) &&
+      !stamp_export_dir (AT_FDCWD, flatpak_file_get_path_cached (dir), checksum,
+                         cancellable, NULL))
+    return NULL;
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+static GFile *
+flatpak_dir_get_trigger_stamp_file (FlatpakDir *self,
+                                    const char *trigger)
+{
+  g_autoptr(GFile) stamps_dir = g_file_get_child (self->basedir, ".trigger-stamps");
+
+  return g_file_get_child (stamps_dir, trigger);
+}
+
+typedef struct
+{
+  char        *name;
+  GSubprocess *subprocess;
+  char        *stamp;
+} RunningTrigger;
+
+static void
+running_trigger_free (RunningTrigger *trigger)
+{
+  g_free (trigger->name);
+  g_clear_object (&trigger->subprocess);
+  g_free (trigger->stamp);
+  g_free (trigger);
+}
+
+/* If changed_exports is not NULL, it is the set of paths (relative to
+   the exports dir) that changed, and only triggers reading those run.
+   Otherwise triggers are skipped if the stamp of their watched export
+   dir is unchanged since they last ran. The triggers that do need to run
+   are independent, so they are all started at once and then waited for. */
+gboolean
+flatpak_dir_run_triggers (FlatpakDir   *self,
+                          GHashTable   *changed_exports,
+                          GCancellable *cancellable,
+                          GError      **error)
+{
+  gboolean ret = FALSE;
+
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  g_autoptr(GFileInfo) child_info = NULL;
+  g_autoptr(GFile) triggersdir = NULL;
+  g_autoptr(GSubprocessLauncher) launcher = NULL;
+  g_autoptr(GPtrArray) running = NULL;
+  GError *temp_error = NULL;
+  const char *triggerspath;
+  /* We need to canonicalize the basedir, because if has a symlink
+     somewhere the bind mount will be on the target of that, not
+     at that exact path. */
+  g_autofree char *basedir_orig = g_file_get_path (self->basedir);
+  g_autofree char *basedir = canonicalize_file_name (basedir_orig);
+  int i;
+
+  triggerspath = g_getenv ("FLATPAK_TRIGGERSDIR");
+  if (triggerspath == NULL)
+    triggerspath = FLATPAK_TRIGGERDIR;
 
   g_debug ("running triggers from %s", triggerspath);
 
@@ -2806,68 +3423,128 @@ flatpak_dir_run_triggers (FlatpakDir   *self,
   if (!dir_enum)
     goto out;
 
+  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_NONE);
+  g_subprocess_launcher_set_cwd (launcher, "/");
+  running = g_ptr_array_new_with_free_func ((GDestroyNotify) running_trigger_free);
+
   while ((child_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)) != NULL)
     {
       g_autoptr(GFile) child = NULL;
+      g_autoptr(GPtrArray) argv_array = NULL;
+      g_autofree char *stamp = NULL;
+      const char *watched_dir;
       const char *name;
+      GSubprocess *subprocess;
       GError *trigger_error = NULL;
+      RunningTrigger *trigger;
 
       name = g_file_info_get_name (child_info);
 
       child = g_file_get_child (triggersdir, name);
 
-      if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_REGULAR &&
-          g_str_has_suffix (name, ".trigger"))
+      if (g_file_info_get_file_type (child_info) != G_FILE_TYPE_REGULAR ||
+          !g_str_has_suffix (name, ".trigger"))
         {
-          g_autoptr(GPtrArray) argv_array = NULL;
-          /* We need to canonicalize the basedir, because if has a symlink
-             somewhere the bind mount will be on the target of that, not
-             at that exact path. */
-          g_autofree char *basedir_orig = g_file_get_path (self->basedir);
-          g_autofree char *basedir = canonicalize_file_name (basedir_orig);
+          g_clear_object (&child_info);
+          continue;
+        }
+
+      if (!trigger_needs_run (name, changed_exports))
+        {
+          g_debug ("skipping trigger %s, no relevant exports changed", name);
+          g_clear_object (&child_info);
+          continue;
+        }
 
-          g_debug ("running trigger %s", name);
+      watched_dir = trigger_get_watched_dir (name);
+      if (changed_exports == NULL && watched_dir != NULL)
+        {
+          g_autoptr(GFile) stamp_file = flatpak_dir_get_trigger_stamp_file (self, name);
+          g_autofree char *old_stamp = NULL;
 
-          argv_array = g_ptr_array_new_with_free_func (g_free);
+          stamp = flatpak_dir_get_trigger_stamp (self, watched_dir, cancellable);
+          if (stamp != NULL &&
+              g_file_load_contents (stamp_file, cancellable, &old_stamp, NULL, NULL, NULL) &&
+              strcmp (g_strstrip (old_stamp), stamp) == 0)
+            {
+              g_debug ("skipping trigger %s, %s is unchanged", name, watched_dir);
+              g_clear_object (&child_info);
+              continue;
+            }
+        }
+
+      g_debug ("running trigger %s", name);
+
+      argv_array = g_ptr_array_new_with_free_func (g_free);
 #ifdef DISABLE_SANDBOXED_TRIGGERS
-          g_ptr_array_add (argv_array, g_file_get_path (child));
-          g_ptr_array_add (argv_array, g_strdup (basedir));
+      g_ptr_array_add (argv_array, g_file_get_path (child));
+      g_ptr_array_add (argv_array, g_strdup (basedir));
 #else
-          g_ptr_array_add (argv_array, g_strdup (flatpak_get_bwrap ()));
-          g_ptr_array_add (argv_array, g_strdup ("--unshare-ipc"));
-          g_ptr_array_add (argv_array, g_strdup ("--unshare-net"));
-          g_ptr_array_add (argv_array, g_strdup ("--unshare-pid"));
-          g_ptr_array_add (argv_array, g_strdup ("--ro-bind"));
-          g_ptr_array_add (argv_array, g_strdup ("/"));
-          g_ptr_array_add (argv_array, g_strdup ("/"));
-          g_ptr_array_add (argv_array, g_strdup ("--proc"));
-          g_ptr_array_add (argv_array, g_strdup ("/proc"));
-          g_ptr_array_add (argv_array, g_strdup ("--dev"));
-          g_ptr_array_add (argv_array, g_strdup ("/dev"));
-          g_ptr_array_add (argv_array, g_strdup ("--bind"));
-          g_ptr_array_add (argv_array, g_strdup (basedir));
-          g_ptr_array_add (argv_array, g_strdup (basedir));
+      g_ptr_array_add (argv_array, g_strdup (flatpak_get_bwrap ()));
+      g_ptr_array_add (argv_array, g_strdup ("--unshare-ipc"));
+      g_ptr_array_add (argv_array, g_strdup ("--unshare-net"));
+      g_ptr_array_add (argv_array, g_strdup ("--unshare-pid"));
+      g_ptr_array_add (argv_array, g_strdup ("--ro-bind"));
+      g_ptr_array_add (argv_array, g_strdup ("/"));
+      g_ptr_array_add (argv_array, g_strdup ("/"));
+      g_ptr_array_add (argv_array, g_strdup ("--proc"));
+      g_ptr_array_add (argv_array, g_strdup ("/proc"));
+      g_ptr_array_add (argv_array, g_strdup ("--dev"));
+      g_ptr_array_add (argv_array, g_strdup ("/dev"));
+      g_ptr_array_add (argv_array, g_strdup ("--bind"));
+      g_ptr_array_add (argv_array, g_strdup (basedir));
+      g_ptr_array_add (argv_array, g_strdup (basedir));
 #endif
-          g_ptr_array_add (argv_array, g_file_get_path (child));
-          g_ptr_array_add (argv_array, g_strdup (basedir));
-          g_ptr_array_add (argv_array, NULL);
-
-          if (!g_spawn_sync ("/",
-                             (char **) argv_array->pdata,
-                             NULL,
-                             G_SPAWN_SEARCH_PATH,
-                             NULL, NULL,
-                             NULL, NULL,
-                             NULL, &trigger_error))
-            {
-              g_warning ("Error running trigger %s: %s", name, trigger_error->message);
-              g_clear_error (&trigger_error);
-            }
+      g_ptr_array_add (argv_array, g_file_get_path (child));
+      g_ptr_array_add (argv_array, g_strdup (basedir));
+      g_ptr_array_add (argv_array, NULL);
+
+      subprocess = g_subprocess_launcher_spawnv (launcher,
+                                                 (const char * const *) argv_array->pdata,
+                                                 &trigger_error);
+      if (subprocess == NULL)
+        {
+          g_warning ("Error running trigger %s: %s", name, trigger_error->message);
+          g_clear_error (&trigger_error);
+          g_clear_object (&child_info);
+          continue;
         }
 
+      trigger = g_new0 (RunningTrigger, 1);
+      trigger->name = g_strdup (name);
+      trigger->subprocess = subprocess;
+      trigger->stamp = g_steal_pointer (&stamp);
+      g_ptr_array_add (running, trigger);
+
       g_clear_object (&child_info);
     }
 
+  for (i = 0; i < running->len; i++)
+    {
+      RunningTrigger *trigger = g_ptr_array_index (running, i);
+      GError *trigger_error = NULL;
+
+      if (!g_subprocess_wait_check (trigger->subprocess, NULL, &trigger_error))
+        {
+          g_warning ("Error running trigger %s: %s", trigger->name, trigger_error->message);
+          g_clear_error (&trigger_error);
+          continue;
+        }
+
+      /* Only record the stamp once the trigger succeeded */
+      if (trigger->stamp != NULL)
+        {
+          g_autoptr(GFile) stamp_file = flatpak_dir_get_trigger_stamp_file (self, trigger->name);
+          g_autoptr(GFile) stamps_dir = g_file_get_parent (stamp_file);
+
+          if (!flatpak_mkdir_p (stamps_dir, cancellable, NULL) ||
+              !g_file_replace_contents (stamp_file, trigger->stamp, strlen (trigger->stamp),
+                                        NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+                                        NULL, cancellable, NULL))
+            g_debug ("Failed to save stamp for trigger %s", trigger->name);
+        }
+    }
+
   if (temp_error != NULL)
     {
       g_propagate_error (error, temp_error);
@@ -2879,6 +3556,70 @@ out:
   return ret;
 }
 
+/* Runs the triggers now, or if a batch is in progress records the
+   changed exports so that the triggers run once when it ends. */
+static gboolean
+flatpak_dir_queue_triggers (FlatpakDir   *self,
+                            GHashTable   *changed_exports,
+                            GCancellable *cancellable,
+                            GError      **error)
+{
+  GHashTableIter iter;
+  gpointer key;
+
+  if (self->triggers_batch == 0)
+    return flatpak_dir_run_triggers (self, changed_exports, cancellable, error);
+
+  if (!self->pending_triggers)
+    {
+      self->pending_triggers = TRUE;
+      if (changed_exports != NULL)
+        self->pending_trigger_exports = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    }
+
+  if (changed_exports == NULL)
+    g_clear_pointer (&self->pending_trigger_exports, g_hash_table_unref);
+  else if (self->pending_trigger_exports != NULL)
+    {
+      g_hash_table_iter_init (&iter, changed_exports);
+      while (g_hash_table_iter_next (&iter, &key, NULL))
+        g_hash_table_add (self->pending_trigger_exports, g_strdup (key));
+    }
+
+  return TRUE;
+}
+
+/* Between these calls, trigger runs from updating exports are deferred
+ * and merged, so that a multi-ref operation runs each trigger at most
+ * once. Calls can be nested. Note that deploys done by the system
+ * helper run their triggers in the helper and are not batched. */
+void
+flatpak_dir_begin_triggers_batch (FlatpakDir *self)
+{
+  self->triggers_batch++;
+}
+
+gboolean
+flatpak_dir_end_triggers_batch (FlatpakDir   *self,
+                                GCancellable *cancellable,
+                                GError      **error)
+{
+  g_autoptr(GHashTable) changed_exports = NULL;
+
+  g_return_val_if_fail (self->triggers_batch > 0, FALSE);
+
+  if (--self->triggers_batch > 0 || !self->pending_triggers)
+    return TRUE;
+
+  changed_exports = g_steal_pointer (&self->pending_trigger_exports);
+  self->pending_triggers = FALSE;
+
+  if (changed_exports != NULL && g_hash_table_size (changed_exports) == 0)
+    return TRUE;
+
+  return flatpak_dir_run_triggers (self, changed_exports, cancellable, error);
+}
+
 static gboolean
 read_fd (int          fd,
          struct stat *stat_buf,
@@ -3350,6 +4091,263 @@ out:
   return ret;
 }
 
+/* Per-app manifests of exported files, so that updates only touch
+ * what changed instead of scanning the whole exports directory */
+static GFile *
+flatpak_dir_get_exports_manifest (FlatpakDir *self,
+                                  const char *app)
+{
+  g_autoptr(GFile) manifests_dir = g_file_get_child (self->basedir, ".exports-manifests");
+
+  return g_file_get_child (manifests_dir, app);
+}
+
+static char *
+checksum_file_at (int           dfd,
+                  const char   *name,
+                  GCancellable *cancellable,
+                  GError      **error)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  glnx_fd_close int fd = -1;
+  guchar buf[16 * 1024];
+  gssize n;
+
+  fd = openat (dfd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  if (fd < 0)
+    {
+      glnx_set_error_from_errno (error);
+      return NULL;
+    }
+
+  while ((n = read (fd, buf, sizeof (buf))) != 0)
+    {
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          glnx_set_error_from_errno (error);
+          return NULL;
+        }
+
+      g_checksum_update (checksum, buf, n);
+    }
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+/* Collects relpath -> content checksum for all regular files, which
+   are what export_dir() creates symlinks for */
+static gboolean
+collect_exports (int           parent_fd,
+                 const char   *name,
+                 const char   *relpath,
+                 GHashTable   *exports,
+                 GCancellable *cancellable,
+                 GError      **error)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0 };
+  struct dirent *dent;
+
+  if (!glnx_dirfd_iterator_init_at (parent_fd, name, FALSE, &iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct stat stbuf;
+      g_autofree char *child_relpath = NULL;
+
+      if (!glnx_dirfd_iterator_next_dent (&iter, &dent, cancellable, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (fstatat (iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+        {
+          if (errno == ENOENT)
+            continue;
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      child_relpath = g_strconcat (relpath, dent->d_name, NULL);
+
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          g_autofree char *child_dir_relpath = g_strconcat (child_relpath, "/", NULL);
+
+          if (!collect_exports (iter.fd, dent->d_name, child_dir_relpath, exports,
+                                cancellable, error))
+            return FALSE;
+        }
+      else if (S_ISREG (stbuf.st_mode))
+        {
+          char *checksum = checksum_file_at (iter.fd, dent->d_name, cancellable, error);
+          if (checksum == NULL)
+            return FALSE;
+
+          g_hash_table_insert (exports, g_steal_pointer (&child_relpath), checksum);
+        }
+    }
+
+  return TRUE;
+}
+
+static GHashTable *
+load_exports_manifest (GFile        *manifest,
+                       GCancellable *cancellable)
+{
+  g_autofree char *contents = NULL;
+  g_autoptr(GHashTable) exports = NULL;
+  g_auto(GStrv) lines = NULL;
+  int i;
+
+  if (!g_file_load_contents (manifest, cancellable, &contents, NULL, NULL, NULL))
+    return NULL;
+
+  exports = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      char *sep = strchr (lines[i], ' ');
+
+      if (sep == NULL)
+        continue;
+
+      *sep = 0;
+      g_hash_table_insert (exports, g_strdup (sep + 1), g_strdup (lines[i]));
+    }
+
+  return g_steal_pointer (&exports);
+}
+
+static gboolean
+save_exports_manifest (GFile        *manifest,
+                       GHashTable   *exports,
+                       GCancellable *cancellable,
+                       GError      **error)
+{
+  g_autoptr(GFile) manifests_dir = g_file_get_parent (manifest);
+  g_autoptr(GString) contents = g_string_new ("");
+  GHashTableIter iter;
+  gpointer key, value;
+
+  if (g_hash_table_size (exports) == 0)
+    {
+      /* Might not exist */
+      (void) g_file_delete (manifest, cancellable, NULL);
+      return TRUE;
+    }
+
+  if (!flatpak_mkdir_p (manifests_dir, cancellable, error))
+    return FALSE;
+
+  g_hash_table_iter_init (&iter, exports);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_string_append_printf (contents, "%s %s\n", (char *) value, (char *) key);
+
+  return g_file_replace_contents (manifest, contents->str, contents->len,
+                                  NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+                                  NULL, cancellable, error);
+}
+
+static char *
+export_symlink_target (const char *symlink_prefix,
+                       const char *relpath)
+{
+  g_autoptr(GString) target = g_string_new ("");
+  const char *p;
+
+  /* One ".." per directory level, as export_dir() does */
+  for (p = relpath; (p = strchr (p, '/')) != NULL; p++)
+    g_string_append (target, "../");
+
+  g_string_append (target, symlink_prefix);
+  g_string_append_c (target, '/');
+  g_string_append (target, relpath);
+
+  return g_string_free (g_steal_pointer (&target), FALSE);
+}
+
+/* Creates the export symlinks in new_exports that are missing, and
+   removes those only in old_exports that still point into this app.
+   Paths that were added, removed or changed content are added to changed. */
+static gboolean
+apply_exports_diff (int           exports_dfd,
+                    const char   *symlink_prefix,
+                    GHashTable   *old_exports,
+                    GHashTable   *new_exports,
+                    GHashTable   *changed,
+                    GCancellable *cancellable,
+                    GError      **error)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&iter, new_exports);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      const char *relpath = key;
+      const char *old_checksum = old_exports ? g_hash_table_lookup (old_exports, relpath) : NULL;
+      g_autofree char *target = export_symlink_target (symlink_prefix, relpath);
+      g_autofree char *existing = readlinkat_malloc (exports_dfd, relpath);
+      g_autofree char *parent = g_path_get_dirname (relpath);
+
+      if (g_strcmp0 (old_checksum, value) != 0)
+        g_hash_table_add (changed, g_strdup (relpath));
+
+      if (g_strcmp0 (existing, target) == 0)
+        continue;
+
+      if (strcmp (parent, ".") != 0 &&
+          !glnx_shutil_mkdir_p_at (exports_dfd, parent, 0755, cancellable, error))
+        return FALSE;
+
+      if (unlinkat (exports_dfd, relpath, 0) != 0 && errno != ENOENT)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      if (symlinkat (target, exports_dfd, relpath) != 0)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+    }
+
+  if (old_exports == NULL)
+    return TRUE;
+
+  g_hash_table_iter_init (&iter, old_exports);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      const char *relpath = key;
+      g_autofree char *target = NULL;
+      g_autofree char *existing = NULL;
+
+      if (g_hash_table_contains (new_exports, relpath))
+        continue;
+
+      g_hash_table_add (changed, g_strdup (relpath));
+
+      /* Don't remove the file if some other app now exports it */
+      target = export_symlink_target (symlink_prefix, relpath);
+      existing = readlinkat_malloc (exports_dfd, relpath);
+      if (g_strcmp0 (existing, target) != 0)
+        continue;
+
+      if (unlinkat (exports_dfd, relpath, 0) != 0 && errno != ENOENT)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
 gboolean
 flatpak_dir_update_exports (FlatpakDir   *self,
                             const char   *changed_app,
@@ -3359,17 +4357,44 @@ flatpak_dir_update_exports (FlatpakDir   *self,
   gboolean ret = FALSE;
 
   g_autoptr(GFile) exports = NULL;
+  g_autoptr(GFile) manifest = NULL;
+  g_autoptr(GHashTable) old_exports = NULL;
+  g_autoptr(GHashTable) new_exports = NULL;
+  g_autoptr(GHashTable) changed = NULL;
   g_autofree char *current_ref = NULL;
   g_autofree char *active_id = NULL;
   g_autofree char *symlink_prefix = NULL;
+  glnx_fd_close int exports_dfd = -1;
 
   exports = flatpak_dir_get_exports_dir (self);
 
   if (!flatpak_mkdir_p (exports, cancellable, error))
     goto out;
 
-  if (changed_app &&
-      (current_ref = flatpak_dir_current_ref (self, changed_app, cancellable)) &&
+  if (changed_app == NULL)
+    {
+      /* Nothing to diff against, do a full cleanup */
+      if (!flatpak_remove_dangling_symlinks (exports, cancellable, error))
+        goto out;
+
+      if (!flatpak_dir_queue_triggers (self, NULL, cancellable, error))
+        goto out;
+
+      ret = TRUE;
+      goto out;
+    }
+
+  if (!glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (exports), TRUE,
+                       &exports_dfd, error))
+    goto out;
+
+  manifest = flatpak_dir_get_exports_manifest (self, changed_app);
+  old_exports = load_exports_manifest (manifest, cancellable);
+  new_exports = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  changed = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  symlink_prefix = g_build_filename ("..", "app", changed_app, "current", "active", "export", NULL);
+
+  if ((current_ref = flatpak_dir_current_ref (self, changed_app, cancellable)) &&
       (active_id = flatpak_dir_read_active (self, current_ref, cancellable)))
     {
       g_autoptr(GFile) deploy_base = NULL;
@@ -3380,21 +4405,31 @@ flatpak_dir_update_exports (FlatpakDir   *self,
       active = g_file_get_child (deploy_base, active_id);
       export = g_file_get_child (active, "export");
 
-      if (g_file_query_exists (export, cancellable))
-        {
-          symlink_prefix = g_build_filename ("..", "app", changed_app, "current", "active", "export", NULL);
-          if (!flatpak_export_dir (export, exports,
-                                   symlink_prefix,
-                                   cancellable,
-                                   error))
-            goto out;
-        }
+      if (g_file_query_exists (export, cancellable) &&
+          !collect_exports (AT_FDCWD, flatpak_file_get_path_cached (export), "",
+                            new_exports, cancellable, error))
+        goto out;
+    }
+
+  if (!apply_exports_diff (exports_dfd, symlink_prefix, old_exports, new_exports,
+                           changed, cancellable, error))
+    goto out;
+
+  /* Without a previous manifest we don't know what the app used to
+     export, so fall back to a full scan and run all the triggers */
+  if (old_exports == NULL)
+    {
+      if (!flatpak_remove_dangling_symlinks (exports, cancellable, error))
+        goto out;
+      g_clear_pointer (&changed, g_hash_table_unref);
     }
 
-  if (!flatpak_remove_dangling_symlinks (exports, cancellable, error))
+  if (!save_exports_manifest (manifest, new_exports, cancellable, error))
     goto out;
 
-  if (!flatpak_dir_run_triggers (self, cancellable, error))
+  if (changed != NULL && g_hash_table_size (changed) == 0)
+    g_debug ("No exports changed for %s, not running triggers", changed_app);
+  else if (!flatpak_dir_queue_triggers (self, changed, cancellable, error))
     goto out;
 
   ret = TRUE;
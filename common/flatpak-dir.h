@@ -430,6 +430,14 @@ gboolean    flatpak_dir_update_exports (FlatpakDir   *self,
                                         const char   *app,
                                         GCancellable *cancellable,
                                         GError      **error);
+gboolean    flatpak_dir_run_triggers (FlatpakDir   *self,
+                                      GHashTable   *changed_exports,
+                                      GCancellable *cancellable,
+                                      GError      **error);
+void        flatpak_dir_begin_triggers_batch (FlatpakDir *self);
+gboolean    flatpak_dir_end_triggers_batch (FlatpakDir   *self,
+                                            GCancellable *cancellable,
+                                            GError      **error);
 gboolean    flatpak_dir_prune (FlatpakDir   *self,
                                GCancellable *cancellable,
                                GError      **error);
@@ -20,6 +20,8 @@
 
 #include "config.h"
 
+#include <sys/stat.h>
+
 #include <glib/gi18n.h>
 #include <gio/gunixoutputstream.h>
 #include <gio/gunixinputstream.h>
@@ -27,11 +29,24 @@
 #include "libglnx.h"
 
 #include <libsoup/soup.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 #include "flatpak-oci-registry.h"
 #include "flatpak-utils.h"
 
 #define MAX_JSON_SIZE (1024 * 1024)
 
+/* Blobs downloaded from remote registries are kept in a content
+ * addressed cache, shared between all installations, so that the
+ * same image is only downloaded once. The size can be changed with
+ * $FLATPAK_OCI_BLOB_CACHE_SIZE, and 0 disables the cache. */
+#define DEFAULT_BLOB_CACHE_SIZE (2 * 1024 * 1024 * 1024ULL)
+#define BLOB_CACHE_TMP_PREFIX ".tmp-blob-"
+/* Temp files of interrupted downloads older than this are removed */
+#define BLOB_CACHE_STALE_TMP_SECS (24 * 60 * 60)
+
 GLNX_DEFINE_CLEANUP_FUNCTION (void *, flatpak_local_free_write_archive, archive_write_free)
 #define free_write_archive __attribute__((cleanup (flatpak_local_free_write_archive)))
 
@@ -52,6 +67,8 @@ struct FlatpakOciRegistry
   /* Remote repos */
   SoupSession *soup_session;
   SoupURI *base_uri;
+  int cache_dfd;
+  guint64 cache_max_size;
 };
 
 typedef struct
@@ -79,6 +96,9 @@ flatpak_oci_registry_finalize (GObject *object)
   if (self->dfd != -1)
     close (self->dfd);
 
+  if (self->cache_dfd != -1)
+    close (self->cache_dfd);
+
   g_clear_object (&self->soup_session);
   g_clear_pointer (&self->base_uri, soup_uri_free);
   g_free (self->uri);
@@ -179,6 +199,7 @@ flatpak_oci_registry_init (FlatpakOciRegistry *self)
 {
   self->dfd = -1;
   self->tmp_dfd = -1;
+  self->cache_dfd = -1;
 }
 
 FlatpakOciRegistry *
@@ -330,6 +351,246 @@ verify_oci_version (GBytes *oci_layout_bytes, GCancellable *cancellable, GError
   return TRUE;
 }
 
+static void
+open_blob_cache (FlatpakOciRegistry *self)
+{
+  const char *cache_size = g_getenv ("FLATPAK_OCI_BLOB_CACHE_SIZE");
+  const char *cache_dir = g_getenv ("FLATPAK_OCI_BLOB_CACHE_DIR");
+  g_autofree char *default_cache_dir = NULL;
+  g_autofree char *blobs_dir = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  self->cache_max_size = DEFAULT_BLOB_CACHE_SIZE;
+  if (cache_size != NULL)
+    self->cache_max_size = g_ascii_strtoull (cache_size, NULL, 10);
+
+  if (self->cache_max_size == 0)
+    return;
+
+  if (cache_dir == NULL)
+    cache_dir = default_cache_dir = g_build_filename (g_get_user_cache_dir (), "flatpak", "oci-blobs", NULL);
+
+  /* The cache is just an optimization, so don't fail if we can't use it */
+  blobs_dir = g_build_filename (cache_dir, "sha256", NULL);
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, blobs_dir, 0755, NULL, &local_error) ||
+      !glnx_opendirat (AT_FDCWD, cache_dir, TRUE, &self->cache_dfd, &local_error))
+    {
+      g_debug ("Not using OCI blob cache %s: %s", cache_dir, local_error->message);
+      self->cache_dfd = -1;
+    }
+}
+
+static gboolean
+blob_cache_verify (int         fd,
+                   const char *digest)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  guint8 buffer[64 * 1024];
+  ssize_t res;
+
+  while (TRUE)
+    {
+      do
+        res = read (fd, buffer, sizeof (buffer));
+      while (G_UNLIKELY (res == -1 && errno == EINTR));
+      if (res == -1)
+        return FALSE;
+      if (res == 0)
+        break;
+
+      g_checksum_update (checksum, buffer, res);
+    }
+
+  if (lseek (fd, 0, SEEK_SET) != 0)
+    return FALSE;
+
+  return strcmp (g_checksum_get_string (checksum), digest + strlen ("sha256:")) == 0;
+}
+
+/* Returns a fd for the cached blob, or -1 if it is not cached. The
+ * digest must have been checked with validate_digest(). The cache can
+ * be shared with other users, and files can be corrupted on disk, so
+ * the content is always verified against the digest. Entries that
+ * don't match are removed, so the blob is downloaded again. */
+static int
+blob_cache_open (FlatpakOciRegistry *self,
+                 const char         *digest)
+{
+  g_autofree char *subpath = NULL;
+  glnx_fd_close int fd = -1;
+
+  if (self->cache_dfd == -1)
+    return -1;
+
+  subpath = g_strdup_printf ("sha256/%s", digest + strlen ("sha256:"));
+
+  do
+    fd = openat (self->cache_dfd, subpath, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  while (G_UNLIKELY (fd == -1 && errno == EINTR));
+  if (fd == -1)
+    return -1;
+
+  if (!blob_cache_verify (fd, digest))
+    {
+      g_warning ("Removing corrupted OCI blob %s from cache", digest);
+      (void)unlinkat (self->cache_dfd, subpath, 0);
+      return -1;
+    }
+
+  /* The mtime is used as the last use time for the LRU eviction */
+  (void)futimens (fd, NULL);
+
+  g_debug ("Using cached OCI blob %s", digest);
+
+  return glnx_steal_fd (&fd);
+}
+
+typedef struct {
+  char *name;
+  guint64 size;
+  gint64 mtime;
+} CachedBlob;
+
+static void
+cached_blob_clear (CachedBlob *blob)
+{
+  g_free (blob->name);
+}
+
+static int
+cached_blob_cmp_mtime (gconstpointer a,
+                       gconstpointer b)
+{
+  const CachedBlob *blob_a = a;
+  const CachedBlob *blob_b = b;
+
+  if (blob_a->mtime < blob_b->mtime)
+    return -1;
+  if (blob_a->mtime > blob_b->mtime)
+    return 1;
+  return 0;
+}
+
+/* Removes the least recently used blobs until the cache fits in the max
+ * size. Other processes may be pruning at the same time, so any of the
+ * files can disappear under us. */
+static void
+blob_cache_prune (FlatpakOciRegistry *self)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  g_autoptr(GArray) blobs = NULL;
+  guint64 total_size = 0;
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+  struct dirent *dent;
+  guint i;
+
+  if (!glnx_dirfd_iterator_init_at (self->cache_dfd, ".", FALSE, &dfd_iter, NULL))
+    return;
+
+  while (glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, NULL, NULL) && dent != NULL)
+    {
+      struct stat stbuf;
+
+      if (!g_str_has_prefix (dent->d_name, BLOB_CACHE_TMP_PREFIX) ||
+          fstatat (dfd_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+        continue;
+
+      if (now - stbuf.st_mtime > BLOB_CACHE_STALE_TMP_SECS)
+        (void)unlinkat (dfd_iter.fd, dent->d_name, 0);
+    }
+
+  glnx_dirfd_iterator_clear (&dfd_iter);
+  if (!glnx_dirfd_iterator_init_at (self->cache_dfd, "sha256", FALSE, &dfd_iter, NULL))
+    return;
+
+  blobs = g_array_new (FALSE, FALSE, sizeof (CachedBlob));
+  g_array_set_clear_func (blobs, (GDestroyNotify) cached_blob_clear);
+
+  while (glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, NULL, NULL) && dent != NULL)
+    {
+      struct stat stbuf;
+      CachedBlob blob;
+
+      if (fstatat (dfd_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0 ||
+          !S_ISREG (stbuf.st_mode))
+        continue;
+
+      blob.name = g_strdup (dent->d_name);
+      blob.size = stbuf.st_size;
+      blob.mtime = stbuf.st_mtime;
+      g_array_append_val (blobs, blob);
+
+      total_size += stbuf.st_size;
+    }
+
+  if (total_size <= self->cache_max_size)
+    return;
+
+  g_array_sort (blobs, cached_blob_cmp_mtime);
+
+  for (i = 0; i < blobs->len && total_size > self->cache_max_size; i++)
+    {
+      CachedBlob *blob = &g_array_index (blobs, CachedBlob, i);
+
+      g_debug ("Evicting OCI blob sha256:%s from cache", blob->name);
+      (void)unlinkat (dfd_iter.fd, blob->name, 0);
+      total_size -= blob->size;
+    }
+}
+
+/* Moves a fully written and verified temp file in the cache dir into
+ * place. The rename makes this atomic, so readers never see a partial
+ * blob. */
+static void
+blob_cache_add (FlatpakOciRegistry *self,
+                const char         *tmpfile_name,
+                const char         *digest)
+{
+  g_autofree char *subpath = g_strdup_printf ("sha256/%s", digest + strlen ("sha256:"));
+  glnx_fd_close int fd = -1;
+
+  fd = openat (self->cache_dfd, tmpfile_name, O_RDONLY | O_CLOEXEC);
+  if (fd == -1 || fdatasync (fd) != 0 ||
+      renameat (self->cache_dfd, tmpfile_name, self->cache_dfd, subpath) != 0)
+    {
+      g_debug ("Failed to add %s to OCI blob cache: %s", digest, g_strerror (errno));
+      (void)unlinkat (self->cache_dfd, tmpfile_name, 0);
+      return;
+    }
+
+  blob_cache_prune (self);
+}
+
+static void
+blob_cache_add_bytes (FlatpakOciRegistry *self,
+                      GBytes             *bytes,
+                      const char         *digest)
+{
+  g_autofree char *tmpfile_name = g_strdup (BLOB_CACHE_TMP_PREFIX "XXXXXX");
+  g_autoptr(GOutputStream) out_stream = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  if (!flatpak_open_in_tmpdir_at (self->cache_dfd, 0644, tmpfile_name,
+                                  &out_stream, NULL, &local_error))
+    {
+      g_debug ("Failed to add %s to OCI blob cache: %s", digest, local_error->message);
+      return;
+    }
+
+  if (!g_output_stream_write_all (out_stream,
+                                  g_bytes_get_data (bytes, NULL),
+                                  g_bytes_get_size (bytes),
+                                  NULL, NULL, &local_error) ||
+      !g_output_stream_close (out_stream, NULL, &local_error))
+    {
+      g_debug ("Failed to add %s to OCI blob cache: %s", digest, local_error->message);
+      (void)unlinkat (self->cache_dfd, tmpfile_name, 0);
+      return;
+    }
+
+  blob_cache_add (self, tmpfile_name, digest);
+}
+
 static gboolean
 flatpak_oci_registry_ensure_local (FlatpakOciRegistry *self,
                                   gboolean for_write,
@@ -444,6 +705,8 @@ flatpak_oci_registry_ensure_remote (FlatpakOciRegistry *self,
 
   self->base_uri = g_steal_pointer (&baseuri);
 
+  open_blob_cache (self);
+
   return TRUE;
 }
 
@@ -528,79 +791,79 @@ flatpak_oci_registry_set_ref (FlatpakOciRegistry  *self,
   return TRUE;
 }
 
-static gboolean
-write_update_checksum (GOutputStream  *out,
-                       gconstpointer   data,
-                       gsize           len,
-                       gsize          *out_bytes_written,
-                       GChecksum      *checksum,
-                       GCancellable   *cancellable,
-                       GError        **error)
+/* Used when someone else is already downloading the blob into the
+ * resumable partial file */
+static int
+remote_download_blob_to_tmpfile (FlatpakOciRegistry    *self,
+                                 const char            *uri,
+                                 const char            *digest,
+                                 FlatpakLoadUriProgress progress_cb,
+                                 gpointer               user_data,
+                                 GCancellable          *cancellable,
+                                 GError               **error)
 {
-  if (out)
-    {
-      if (!g_output_stream_write_all (out, data, len, out_bytes_written,
-                                      cancellable, error))
-        return FALSE;
-    }
-  else if (out_bytes_written)
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autofree char *tmpfile_name = g_strdup ("oci-layer-XXXXXX");
+  g_autoptr(GOutputStream) out_stream = NULL;
+  glnx_fd_close int fd = -1;
+
+  if (!flatpak_open_in_tmpdir_at (self->tmp_dfd, 0600, tmpfile_name,
+                                  &out_stream, cancellable, error))
+    return -1;
+
+  fd = local_open_file (self->tmp_dfd, tmpfile_name, cancellable, error);
+  (void)unlinkat (self->tmp_dfd, tmpfile_name, 0);
+
+  if (fd == -1)
+    return -1;
+
+  if (!flatpak_download_http_uri (self->soup_session, uri, out_stream,
+                                  checksum, progress_cb, user_data,
+                                  cancellable, error))
+    return -1;
+
+  if (!g_output_stream_close (out_stream, cancellable, error))
+    return -1;
+
+  /* The checksum was computed while downloading, so there is no
+     need to read the blob back in just to verify it */
+  if (strcmp (g_checksum_get_string (checksum), digest + strlen ("sha256:")) != 0)
     {
-      *out_bytes_written = len;
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Checksum digest did not match (%s != %s)", digest,
+                   g_checksum_get_string (checksum));
+      return -1;
     }
 
-  if (checksum)
-    g_checksum_update (checksum, data, len);
+  lseek (fd, 0, SEEK_SET);
 
-  return TRUE;
+  return glnx_steal_fd (&fd);
 }
 
+/* Digests come from remote manifests and are used to build paths in
+ * the registry, the blob cache and the tmp dir, so anything but a
+ * plain sha256 checksum is rejected before they are used. */
 static gboolean
-splice_update_checksum (GOutputStream  *out,
-                        GInputStream   *in,
-                        GChecksum      *checksum,
-                        GCancellable   *cancellable,
-                        GError        **error)
+validate_digest (const char *digest,
+                 GError    **error)
 {
-  g_return_val_if_fail (out != NULL || checksum != NULL, FALSE);
-
-  if (checksum != NULL)
+  if (!g_str_has_prefix (digest, "sha256:"))
     {
-      gsize bytes_read, bytes_written;
-      char buf[4096];
-      do
-        {
-          if (!g_input_stream_read_all (in, buf, sizeof(buf), &bytes_read, cancellable, error))
-            return FALSE;
-          if (!write_update_checksum (out, buf, bytes_read, &bytes_written, checksum,
-                                      cancellable, error))
-            return FALSE;
-        }
-      while (bytes_read > 0);
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Unsupported digest type %s", digest);
+      return FALSE;
     }
-  else if (out != NULL)
+
+  if (!ostree_validate_checksum_string (digest + strlen ("sha256:"), NULL))
     {
-      if (g_output_stream_splice (out, in, 0, cancellable, error) < 0)
-        return FALSE;
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Invalid digest %s", digest);
+      return FALSE;
     }
 
   return TRUE;
 }
 
-
-static char *
-checksum_fd (int fd, GCancellable *cancellable, GError **error)
-{
-  g_autoptr(GChecksum) checksum = NULL;
-  g_autoptr(GInputStream) in = g_unix_input_stream_new (fd, FALSE);
-
-  checksum = g_checksum_new (G_CHECKSUM_SHA256);
-
-  if (!splice_update_checksum (NULL, in, checksum, cancellable, error))
-    return NULL;
-
-  return g_strdup (g_checksum_get_string (checksum));
-}
-
 int
 flatpak_oci_registry_download_blob (FlatpakOciRegistry    *self,
                                     const char            *digest,
@@ -614,12 +877,8 @@ flatpak_oci_registry_download_blob (FlatpakOciRegistry    *self,
 
   g_assert (self->valid);
 
-  if (!g_str_has_prefix (digest, "sha256:"))
-    {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
-                   "Unsupported digest type %s", digest);
-      return -1;
-    }
+  if (!validate_digest (digest, error))
+    return -1;
 
   subpath = g_strdup_printf ("blobs/sha256/%s", digest + strlen ("sha256:"));
 
@@ -634,11 +893,15 @@ flatpak_oci_registry_download_blob (FlatpakOciRegistry    *self,
     {
       g_autoptr(SoupURI) uri = NULL;
       g_autofree char *uri_s = NULL;
-      g_autofree char *checksum = NULL;
-      g_autofree char *tmpfile_name = g_strdup_printf ("oci-layer-XXXXXX");
-      g_autoptr(GOutputStream) out_stream = NULL;
+      g_autofree char *partial_name = NULL;
+      g_autoptr(GError) local_error = NULL;
+      gboolean use_cache = self->cache_dfd != -1;
+      int dfd = use_cache ? self->cache_dfd : self->tmp_dfd;
 
-      /* remote case, download and verify */
+      /* remote case, use the cached copy if we have one */
+      fd = blob_cache_open (self, digest);
+      if (fd != -1)
+        return glnx_steal_fd (&fd);
 
       uri = soup_uri_new_with_base (self->base_uri, subpath);
       if (uri == NULL)
@@ -650,36 +913,37 @@ flatpak_oci_registry_download_blob (FlatpakOciRegistry    *self,
 
       uri_s = soup_uri_to_string (uri, FALSE);
 
-      if (!flatpak_open_in_tmpdir_at (self->tmp_dfd, 0600, tmpfile_name,
-                                      &out_stream, cancellable, error))
-        return -1;
-
-      fd = local_open_file (self->tmp_dfd, tmpfile_name, cancellable, error);
-      (void)unlinkat (self->tmp_dfd, tmpfile_name, 0);
-
+      /* otherwise download and verify. The file is named after the
+         digest so that an interrupted download can be resumed, and
+         when caching it is in the cache dir so that it can be added
+         without a copy */
+      partial_name = g_strdup_printf ("%s%s.partial",
+                                      use_cache ? BLOB_CACHE_TMP_PREFIX : "oci-layer-",
+                                      digest + strlen ("sha256:"));
+
+      fd = flatpak_download_http_uri_resumable (self->soup_session, uri_s,
+                                                dfd, partial_name,
+                                                digest + strlen ("sha256:"),
+                                                progress_cb, user_data,
+                                                cancellable, &local_error);
       if (fd == -1)
-        return -1;
-
-      if (!flatpak_download_http_uri (self->soup_session, uri_s, out_stream,
-                                      progress_cb, user_data,
-                                      cancellable, error))
-        return -1;
-
-      if (!g_output_stream_close (out_stream, cancellable, error))
-        return -1;
-
-      checksum = checksum_fd (fd, cancellable, error);
-      if (checksum == NULL)
-        return -1;
-
-      if (strcmp (checksum, digest + strlen ("sha256:")) != 0)
         {
-          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                       "Checksum digest did not match (%s != %s)", digest, checksum);
-          return -1;
+          if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_BUSY))
+            {
+              g_propagate_error (error, g_steal_pointer (&local_error));
+              return -1;
+            }
+
+          g_debug ("%s, downloading a separate copy", local_error->message);
+          return remote_download_blob_to_tmpfile (self, uri_s, digest,
+                                                  progress_cb, user_data,
+                                                  cancellable, error);
         }
 
-      lseek (fd, 0, SEEK_SET);
+      if (use_cache)
+        blob_cache_add (self, partial_name, digest);
+      else
+        (void)unlinkat (dfd, partial_name, 0);
     }
 
   return glnx_steal_fd (&fd);
@@ -692,18 +956,42 @@ flatpak_oci_registry_load_blob (FlatpakOciRegistry  *self,
                                GError            **error)
 {
   g_autofree char *subpath = NULL;
+  g_autoptr(GBytes) bytes = NULL;
 
   g_assert (self->valid);
 
-  if (!g_str_has_prefix (digest, "sha256:"))
-    {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
-                   "Unsupported digest type %s", digest);
-      return NULL;
-    }
+  if (!validate_digest (digest, error))
+    return NULL;
 
   subpath = g_strdup_printf ("blobs/sha256/%s", digest + strlen ("sha256:"));
 
+  if (self->dfd == -1)
+    {
+      glnx_fd_close int fd = -1;
+      g_autofree char *checksum = NULL;
+
+      fd = blob_cache_open (self, digest);
+      if (fd != -1)
+        return glnx_fd_readall_bytes (fd, cancellable, error);
+
+      bytes = flatpak_oci_registry_load_file (self, subpath, cancellable, error);
+      if (bytes == NULL)
+        return NULL;
+
+      checksum = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, bytes);
+      if (strcmp (checksum, digest + strlen ("sha256:")) != 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Checksum digest did not match (%s != %s)", digest, checksum);
+          return NULL;
+        }
+
+      if (self->cache_dfd != -1)
+        blob_cache_add_bytes (self, bytes, digest);
+
+      return g_steal_pointer (&bytes);
+    }
+
   return flatpak_oci_registry_load_file (self, subpath, cancellable, error);
 }
 
@@ -797,6 +1085,37 @@ flatpak_oci_registry_chose_image (FlatpakOciRegistry   *self,
 }
 
 
+/* Layers are gzip compressed in parallel, in independent blocks like pigz
+ * does. Each block is raw deflate data, primed with the tail of the
+ * previous block as dictionary and ended with a sync flush so that the
+ * blocks concatenate into one valid deflate stream, which we wrap in a
+ * gzip header and trailer ourselves. */
+#define LAYER_BLOCK_SIZE (128 * 1024)
+#define LAYER_DICT_SIZE (32 * 1024)
+
+typedef struct
+{
+  GBytes *input;
+  GBytes *dict;
+  gboolean last;
+  int level;
+  guchar *output;
+  gsize output_len;
+  uLong crc;
+  gboolean done;
+  gboolean failed;
+} LayerBlock;
+
+static void
+layer_block_free (LayerBlock *block)
+{
+  g_bytes_unref (block->input);
+  if (block->dict)
+    g_bytes_unref (block->dict);
+  g_free (block->output);
+  g_free (block);
+}
+
 struct FlatpakOciLayerWriter
 {
   GObject parent;
@@ -806,11 +1125,26 @@ struct FlatpakOciLayerWriter
   GChecksum *uncompressed_checksum;
   GChecksum *compressed_checksum;
   struct archive *archive;
-  GZlibCompressor *compressor;
   guint64 uncompressed_size;
   guint64 compressed_size;
   char *tmp_path;
   int tmp_fd;
+
+  FlatpakOciLayerCompression compression;
+  int compression_level;
+  int n_threads;
+#ifdef HAVE_ZSTD
+  ZSTD_CCtx *zstd;
+  guchar *zstd_buffer;
+  gsize zstd_buffer_size;
+#endif
+  GThreadPool *pool;
+  GMutex mutex;
+  GCond cond;
+  GByteArray *block;       /* Uncompressed data not yet queued */
+  GBytes *prev_block;      /* Source of the dictionary for the next block */
+  GQueue pending_blocks;   /* LayerBlocks in stream order */
+  uLong crc;
 };
 
 typedef struct
@@ -832,6 +1166,8 @@ propagate_libarchive_error (GError      **error,
 static void
 flatpak_oci_layer_writer_reset (FlatpakOciLayerWriter *self)
 {
+  LayerBlock *block;
+
   if (self->tmp_path)
     {
       (void) unlinkat (self->registry->dfd, self->tmp_path, 0);
@@ -854,7 +1190,19 @@ flatpak_oci_layer_writer_reset (FlatpakOciLayerWriter *self)
       self->archive = NULL;
     }
 
-  g_clear_object (&self->compressor);
+  /* Wait for any in-flight blocks before freeing them */
+  if (self->pool)
+    {
+      g_thread_pool_free (self->pool, FALSE, TRUE);
+      self->pool = NULL;
+    }
+
+  while ((block = g_queue_pop_head (&self->pending_blocks)) != NULL)
+    layer_block_free (block);
+
+  g_byte_array_set_size (self->block, 0);
+  g_clear_pointer (&self->prev_block, g_bytes_unref);
+  self->crc = crc32 (0L, Z_NULL, 0);
 }
 
 
@@ -867,6 +1215,14 @@ flatpak_oci_layer_writer_finalize (GObject *object)
 
   g_checksum_free (self->compressed_checksum);
   g_checksum_free (self->uncompressed_checksum);
+  g_byte_array_unref (self->block);
+#ifdef HAVE_ZSTD
+  if (self->zstd)
+    ZSTD_freeCCtx (self->zstd);
+  g_free (self->zstd_buffer);
+#endif
+  g_mutex_clear (&self->mutex);
+  g_cond_clear (&self->cond);
 
   g_clear_object (&self->registry);
 
@@ -887,6 +1243,13 @@ flatpak_oci_layer_writer_init (FlatpakOciLayerWriter *self)
 {
   self->uncompressed_checksum = g_checksum_new (G_CHECKSUM_SHA256);
   self->compressed_checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  self->tmp_fd = -1;
+  self->compression_level = Z_DEFAULT_COMPRESSION;
+  self->block = g_byte_array_sized_new (LAYER_BLOCK_SIZE);
+  g_mutex_init (&self->mutex);
+  g_cond_init (&self->cond);
+  g_queue_init (&self->pending_blocks);
+  self->crc = crc32 (0L, Z_NULL, 0);
 }
 
 static int
@@ -896,67 +1259,209 @@ flatpak_oci_layer_writer_open_cb (struct archive *archive,
   return ARCHIVE_OK;
 }
 
-static gssize
-flatpak_oci_layer_writer_compress (FlatpakOciLayerWriter *self,
-                                  const void *buffer,
-                                  size_t length,
-                                  gboolean at_end)
+/* Runs in the thread pool */
+static void
+layer_block_compress (gpointer data,
+                      gpointer user_data)
 {
-  guchar compressed_buffer[8192];
-  GConverterResult res;
-  gsize total_bytes_read, bytes_read, bytes_written, to_write_len;
-  guchar *to_write;
-  g_autoptr(GError) local_error = NULL;
-  GConverterFlags flags = 0;
-  bytes_read = 0;
+  LayerBlock *block = data;
+  FlatpakOciLayerWriter *self = user_data;
+  const guchar *input;
+  gsize input_len;
+  z_stream stream = { NULL };
+  gsize output_size;
+  int res;
+
+  input = g_bytes_get_data (block->input, &input_len);
+  block->crc = crc32 (crc32 (0L, Z_NULL, 0), input, input_len);
+
+  if (deflateInit2 (&stream, block->level, Z_DEFLATED,
+                    -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      block->failed = TRUE;
+      goto out;
+    }
 
-  total_bytes_read = 0;
+  if (block->dict)
+    {
+      gsize dict_len;
+      const guchar *dict = g_bytes_get_data (block->dict, &dict_len);
+
+      deflateSetDictionary (&stream, dict, dict_len);
+    }
 
-  if (at_end)
-    flags |= G_CONVERTER_INPUT_AT_END;
+  /* Leave room for the sync flush marker, which deflateBound() doesn't count */
+  output_size = deflateBound (&stream, input_len) + 16;
+  block->output = g_malloc (output_size);
 
-  do
+  stream.next_in = (Bytef *) input;
+  stream.avail_in = input_len;
+  stream.next_out = block->output;
+  stream.avail_out = output_size;
+
+  res = deflate (&stream, block->last ? Z_FINISH : Z_SYNC_FLUSH);
+  if (block->last)
+    block->failed = res != Z_STREAM_END;
+  else
+    block->failed = res != Z_OK || stream.avail_in != 0 || stream.avail_out == 0;
+
+  block->output_len = output_size - stream.avail_out;
+
+  deflateEnd (&stream);
+
+ out:
+  g_mutex_lock (&self->mutex);
+  block->done = TRUE;
+  g_cond_broadcast (&self->cond);
+  g_mutex_unlock (&self->mutex);
+}
+
+static gboolean
+flatpak_oci_layer_writer_write_out (FlatpakOciLayerWriter *self,
+                                    const guchar          *data,
+                                    gsize                  len)
+{
+  g_checksum_update (self->compressed_checksum, data, len);
+  self->compressed_size += len;
+
+  while (len > 0)
     {
-      res = g_converter_convert (G_CONVERTER (self->compressor),
-                                 buffer, length,
-                                 compressed_buffer, sizeof (compressed_buffer),
-                                 flags, &bytes_read, &bytes_written,
-                                 &local_error);
-      if (res == G_CONVERTER_ERROR)
+      ssize_t res = write (self->tmp_fd, data, len);
+      if (res <= 0)
         {
-          archive_set_error (self->archive, EIO, "%s", local_error->message);
-          return -1;
+          if (errno == EINTR)
+            continue;
+          archive_set_error (self->archive, errno, "Write error");
+          return FALSE;
+        }
+
+      len -= res;
+      data += res;
+    }
+
+  return TRUE;
+}
+
+static void
+flatpak_oci_layer_writer_queue_block (FlatpakOciLayerWriter *self,
+                                      gboolean               last)
+{
+  LayerBlock *block = g_new0 (LayerBlock, 1);
+
+  if (self->pool == NULL)
+    self->pool = g_thread_pool_new (layer_block_compress, self,
+                                    self->n_threads > 0 ? self->n_threads : (int) g_get_num_processors (),
+                                    FALSE, NULL);
+
+  block->input = g_byte_array_free_to_bytes (self->block);
+  self->block = g_byte_array_sized_new (LAYER_BLOCK_SIZE);
+
+  if (self->prev_block)
+    {
+      gsize prev_len = g_bytes_get_size (self->prev_block);
+      gsize dict_len = MIN (prev_len, LAYER_DICT_SIZE);
+
+      block->dict = g_bytes_new_from_bytes (self->prev_block, prev_len - dict_len, dict_len);
+      g_bytes_unref (self->prev_block);
+    }
+  self->prev_block = g_bytes_ref (block->input);
+
+  block->last = last;
+  block->level = self->compression_level;
+
+  g_queue_push_tail (&self->pending_blocks, block);
+  g_thread_pool_push (self->pool, block, NULL);
+}
+
+/* Writes out compressed blocks in stream order. Unless wait_all is set
+ * this only blocks while too many blocks are in flight, to bound the
+ * memory use. */
+static gboolean
+flatpak_oci_layer_writer_flush_blocks (FlatpakOciLayerWriter *self,
+                                       gboolean               wait_all)
+{
+  guint max_pending = 2 * g_thread_pool_get_max_threads (self->pool);
+  LayerBlock *block;
+
+  while ((block = g_queue_peek_head (&self->pending_blocks)) != NULL)
+    {
+      gboolean ok;
+
+      g_mutex_lock (&self->mutex);
+      if (!block->done && !wait_all &&
+          g_queue_get_length (&self->pending_blocks) <= max_pending)
+        {
+          g_mutex_unlock (&self->mutex);
+          break;
         }
+      while (!block->done)
+        g_cond_wait (&self->cond, &self->mutex);
+      g_mutex_unlock (&self->mutex);
 
-      g_checksum_update (self->uncompressed_checksum, buffer, bytes_read);
-      g_checksum_update (self->compressed_checksum, compressed_buffer, bytes_written);
-      self->uncompressed_size += bytes_read;
-      self->compressed_size += bytes_written;
+      g_queue_pop_head (&self->pending_blocks);
 
-      to_write_len = bytes_written;
-      to_write = compressed_buffer;
-      while (to_write_len > 0)
+      if (block->failed)
         {
-          ssize_t res = write (self->tmp_fd, to_write, to_write_len);
-          if (res <= 0)
+          archive_set_error (self->archive, EIO, "Failed to compress layer");
+          layer_block_free (block);
+          return FALSE;
+        }
+
+      if (self->compressed_size == 0)
+        {
+          /* gzip header: magic, deflate, no flags, no mtime, unix */
+          static const guchar gzip_header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+
+          if (!flatpak_oci_layer_writer_write_out (self, gzip_header, sizeof (gzip_header)))
             {
-              if (errno == EINTR)
-                continue;
-              archive_set_error (self->archive, errno, "Write error");
-              return -1;
+              layer_block_free (block);
+              return FALSE;
             }
+        }
+
+      ok = flatpak_oci_layer_writer_write_out (self, block->output, block->output_len);
+      self->crc = crc32_combine (self->crc, block->crc, g_bytes_get_size (block->input));
+      layer_block_free (block);
+
+      if (!ok)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+#ifdef HAVE_ZSTD
+/* zstd does its own multithreading, so unlike gzip this just streams
+ * the data through it */
+static gboolean
+flatpak_oci_layer_writer_compress_zstd (FlatpakOciLayerWriter *self,
+                                        const void            *buffer,
+                                        size_t                 length,
+                                        gboolean               at_end)
+{
+  ZSTD_inBuffer in = { buffer, length, 0 };
+  size_t remaining;
+
+  do
+    {
+      ZSTD_outBuffer out = { self->zstd_buffer, self->zstd_buffer_size, 0 };
 
-          to_write_len -= res;
-          to_write += res;
+      remaining = ZSTD_compressStream2 (self->zstd, &out, &in,
+                                        at_end ? ZSTD_e_end : ZSTD_e_continue);
+      if (ZSTD_isError (remaining))
+        {
+          archive_set_error (self->archive, EIO, "%s", ZSTD_getErrorName (remaining));
+          return FALSE;
         }
 
-      total_bytes_read += bytes_read;
+      if (!flatpak_oci_layer_writer_write_out (self, out.dst, out.pos))
+        return FALSE;
     }
-  while ((length > 0 && bytes_read == 0) || /* Repeat if we consumed nothing */
-         (at_end && res != G_CONVERTER_FINISHED)); /* Or until finished if at_end */
+  while (at_end ? remaining != 0 : in.pos < in.size);
 
-  return total_bytes_read;
+  return TRUE;
 }
+#endif
 
 static ssize_t
 flatpak_oci_layer_writer_write_cb (struct archive *archive,
@@ -965,8 +1470,38 @@ flatpak_oci_layer_writer_write_cb (struct archive *archive,
                                    size_t length)
 {
   FlatpakOciLayerWriter *self = FLATPAK_OCI_LAYER_WRITER (client_data);
+  const guint8 *data = buffer;
+  size_t remaining = length;
+
+  g_checksum_update (self->uncompressed_checksum, buffer, length);
+  self->uncompressed_size += length;
 
-  return flatpak_oci_layer_writer_compress (self, buffer, length, FALSE);
+#ifdef HAVE_ZSTD
+  if (self->compression == FLATPAK_OCI_LAYER_COMPRESSION_ZSTD)
+    {
+      if (!flatpak_oci_layer_writer_compress_zstd (self, buffer, length, FALSE))
+        return -1;
+      return length;
+    }
+#endif
+
+  while (remaining > 0)
+    {
+      gsize n = MIN (remaining, LAYER_BLOCK_SIZE - self->block->len);
+
+      g_byte_array_append (self->block, data, n);
+      data += n;
+      remaining -= n;
+
+      if (self->block->len == LAYER_BLOCK_SIZE)
+        flatpak_oci_layer_writer_queue_block (self, FALSE);
+    }
+
+  if (self->pool != NULL &&
+      !flatpak_oci_layer_writer_flush_blocks (self, FALSE))
+    return -1;
+
+  return length;
 }
 
 static int
@@ -974,16 +1509,88 @@ flatpak_oci_layer_writer_close_cb (struct archive *archive,
                                    void *client_data)
 {
   FlatpakOciLayerWriter *self = FLATPAK_OCI_LAYER_WRITER (client_data);
-  gssize res;
-  char buffer[1] = {0};
+  guchar gzip_trailer[8];
+  guint32 isize = (guint32) self->uncompressed_size;
+
+#ifdef HAVE_ZSTD
+  if (self->compression == FLATPAK_OCI_LAYER_COMPRESSION_ZSTD)
+    {
+      if (!flatpak_oci_layer_writer_compress_zstd (self, NULL, 0, TRUE))
+        return ARCHIVE_FATAL;
+      return ARCHIVE_OK;
+    }
+#endif
+
+  flatpak_oci_layer_writer_queue_block (self, TRUE);
+  if (!flatpak_oci_layer_writer_flush_blocks (self, TRUE))
+    return ARCHIVE_FATAL;
 
-  res = flatpak_oci_layer_writer_compress (self, &buffer, 0, TRUE);
-  if (res < 0)
+  /* gzip trailer: crc32 and size modulo 2^32, both little endian */
+  gzip_trailer[0] = self->crc & 0xff;
+  gzip_trailer[1] = (self->crc >> 8) & 0xff;
+  gzip_trailer[2] = (self->crc >> 16) & 0xff;
+  gzip_trailer[3] = (self->crc >> 24) & 0xff;
+  gzip_trailer[4] = isize & 0xff;
+  gzip_trailer[5] = (isize >> 8) & 0xff;
+  gzip_trailer[6] = (isize >> 16) & 0xff;
+  gzip_trailer[7] = (isize >> 24) & 0xff;
+
+  if (!flatpak_oci_layer_writer_write_out (self, gzip_trailer, sizeof (gzip_trailer)))
     return ARCHIVE_FATAL;
 
   return ARCHIVE_OK;
 }
 
+/* Sets the compression used for the layer, the compression level (-1
+ * for the default of the format) and the number of threads used to
+ * compress it (0 to use all cpus). Must be called before anything is
+ * written to the archive. */
+gboolean
+flatpak_oci_layer_writer_set_compression (FlatpakOciLayerWriter     *self,
+                                          FlatpakOciLayerCompression compression,
+                                          int                        level,
+                                          int                        n_threads,
+                                          GError                   **error)
+{
+  g_return_val_if_fail (self->pool == NULL, FALSE);
+
+  if (compression == FLATPAK_OCI_LAYER_COMPRESSION_ZSTD)
+    {
+#ifdef HAVE_ZSTD
+      size_t res;
+
+      if (self->zstd == NULL)
+        {
+          self->zstd = ZSTD_createCCtx ();
+          self->zstd_buffer_size = ZSTD_CStreamOutSize ();
+          self->zstd_buffer = g_malloc (self->zstd_buffer_size);
+        }
+
+      res = ZSTD_CCtx_setParameter (self->zstd, ZSTD_c_compressionLevel,
+                                    level == -1 ? ZSTD_CLEVEL_DEFAULT : level);
+      if (ZSTD_isError (res))
+        return flatpak_fail (error, "Invalid zstd compression level %d", level);
+
+      /* This fails if libzstd is built without threading, which just
+         means we compress in this thread */
+      res = ZSTD_CCtx_setParameter (self->zstd, ZSTD_c_nbWorkers,
+                                    n_threads > 0 ? n_threads : (int) g_get_num_processors ());
+      if (ZSTD_isError (res))
+        g_debug ("Not using zstd worker threads: %s", ZSTD_getErrorName (res));
+#else
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Flatpak was built without zstd support");
+      return FALSE;
+#endif
+    }
+
+  self->compression = compression;
+  self->compression_level = level;
+  self->n_threads = n_threads;
+
+  return TRUE;
+}
+
 FlatpakOciLayerWriter *
 flatpak_oci_registry_write_layer (FlatpakOciRegistry    *self,
                                  GCancellable         *cancellable,
@@ -1042,7 +1649,6 @@ flatpak_oci_registry_write_layer (FlatpakOciRegistry    *self,
   oci_layer_writer->archive = g_steal_pointer (&a);
   oci_layer_writer->tmp_fd = glnx_steal_fd (&tmp_fd);
   oci_layer_writer->tmp_path = g_steal_pointer (&tmp_path);
-  oci_layer_writer->compressor = g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1);
 
   return g_steal_pointer (&oci_layer_writer);
 }
@@ -1082,7 +1688,12 @@ flatpak_oci_layer_writer_close (FlatpakOciLayerWriter  *self,
     {
       g_autofree char *digest = g_strdup_printf ("sha256:%s", g_checksum_get_string (self->compressed_checksum));
 
-      *ref_out = flatpak_oci_ref_new (FLATPAK_OCI_MEDIA_TYPE_IMAGE_LAYER, digest, self->compressed_size);
+      const char *mediatype = FLATPAK_OCI_MEDIA_TYPE_IMAGE_LAYER;
+
+      if (self->compression == FLATPAK_OCI_LAYER_COMPRESSION_ZSTD)
+        mediatype = FLATPAK_OCI_MEDIA_TYPE_IMAGE_LAYER_ZSTD;
+
+      *ref_out = flatpak_oci_ref_new (mediatype, digest, self->compressed_size);
     }
 
   return TRUE;
@@ -43,6 +43,11 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakOciRegistry, g_object_unref)
 
 GType flatpak_oci_layer_writer_get_type (void);
 
+typedef enum {
+  FLATPAK_OCI_LAYER_COMPRESSION_GZIP,
+  FLATPAK_OCI_LAYER_COMPRESSION_ZSTD,
+} FlatpakOciLayerCompression;
+
 typedef struct FlatpakOciLayerWriter FlatpakOciLayerWriter;
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakOciLayerWriter, g_object_unref)
@@ -93,6 +98,11 @@ FlatpakOciManifest    *flatpak_oci_registry_chose_image          (FlatpakOciRegi
                                                                   GError              **error);
 
 struct archive *flatpak_oci_layer_writer_get_archive (FlatpakOciLayerWriter  *self);
+gboolean        flatpak_oci_layer_writer_set_compression (FlatpakOciLayerWriter     *self,
+                                                          FlatpakOciLayerCompression compression,
+                                                          int                        level,
+                                                          int                        n_threads,
+                                                          GError                   **error);
 gboolean        flatpak_oci_layer_writer_close       (FlatpakOciLayerWriter  *self,
                                                       char                 **uncompressed_digest_out,
                                                       FlatpakOciRef         **ref_out,
@@ -2155,12 +2155,17 @@ gboolean
 flatpak_run_add_extension_args (GPtrArray    *argv_array,
                                 GKeyFile     *metakey,
                                 const char   *full_ref,
+                                char        **extensions_out,
+                                char        **ld_path_out,
                                 GCancellable *cancellable,
                                 GError      **error)
 {
   g_auto(GStrv) parts = NULL;
+  g_autoptr(GString) used_extensions = g_string_new ("");
+  g_autoptr(GString) ld_path = g_string_new ("");
   gboolean is_app;
   GList *extensions, *l;
+  gboolean has_unmaintained = FALSE;
 
   parts = g_strsplit (full_ref, "/", 0);
   if (g_strv_length (parts) != 4)
@@ -2194,10 +2199,37 @@ flatpak_run_add_extension_args (GPtrArray    *argv_array,
         add_args (argv_array,
                   "--lock-file", ref,
                   NULL);
+
+      if (used_extensions->len > 0)
+        g_string_append_c (used_extensions, ';');
+      g_string_append (used_extensions, ext->installed_id);
+      g_string_append_c (used_extensions, '=');
+      g_string_append (used_extensions, ext->commit ? ext->commit : ext->files_path);
+
+      /* Unmaintained extensions have no commit, and their path stays
+         the same when their content changes */
+      if (ext->commit == NULL)
+        has_unmaintained = TRUE;
+
+      if (ext->add_ld_path)
+        {
+          g_autofree char *ext_ld_path = g_build_filename (full_directory, ext->add_ld_path, NULL);
+
+          if (ld_path->len > 0)
+            g_string_append_c (ld_path, '\n');
+          g_string_append (ld_path, ext_ld_path);
+        }
     }
 
   g_list_free_full (extensions, (GDestroyNotify) flatpak_extension_free);
 
+  /* NULL tells the caller that the set can't be used as a cache key */
+  if (extensions_out && !has_unmaintained)
+    *extensions_out = g_string_free (g_steal_pointer (&used_extensions), FALSE);
+
+  if (ld_path_out)
+    *ld_path_out = g_string_free (g_steal_pointer (&ld_path), FALSE);
+
   return TRUE;
 }
 
@@ -3685,6 +3717,28 @@ setup_seccomp (GPtrArray  *argv_array,
 }
 #endif
 
+static void
+add_usr_links_args (GPtrArray *argv_array,
+                    GFile     *runtime_files)
+{
+  const char *usr_links[] = {"lib", "lib32", "lib64", "bin", "sbin"};
+  int i;
+
+  for (i = 0; i < G_N_ELEMENTS (usr_links); i++)
+    {
+      const char *subdir = usr_links[i];
+      g_autoptr(GFile) runtime_subdir = g_file_get_child (runtime_files, subdir);
+      if (g_file_query_exists (runtime_subdir, NULL))
+        {
+          g_autofree char *link = g_strconcat ("usr/", subdir, NULL);
+          g_autofree char *dest = g_strconcat ("/", subdir, NULL);
+          add_args (argv_array,
+                    "--symlink", link, dest,
+                    NULL);
+        }
+    }
+}
+
 gboolean
 flatpak_run_setup_base_argv (GPtrArray      *argv_array,
                              GArray         *fd_array,
@@ -3694,9 +3748,7 @@ flatpak_run_setup_base_argv (GPtrArray      *argv_array,
                              FlatpakRunFlags flags,
                              GError        **error)
 {
-  const char *usr_links[] = {"lib", "lib32", "lib64", "bin", "sbin"};
   g_autofree char *run_dir = g_strdup_printf ("/run/user/%d", getuid ());
-  int i;
   int passwd_fd = -1;
   g_autofree char *passwd_fd_str = NULL;
   g_autofree char *passwd_contents = NULL;
@@ -3818,20 +3870,7 @@ flatpak_run_setup_base_argv (GPtrArray      *argv_array,
                 NULL);
     }
 
-  for (i = 0; i < G_N_ELEMENTS (usr_links); i++)
-    {
-      const char *subdir = usr_links[i];
-      g_autoptr(GFile) runtime_subdir = g_file_get_child (runtime_files, subdir);
-      if (g_file_query_exists (runtime_subdir, NULL))
-        {
-          g_autofree char *link = g_strconcat ("usr/", subdir, NULL);
-          g_autofree char *dest = g_strconcat ("/", subdir, NULL);
-          add_args (argv_array,
-                    "--symlink", link, dest,
-                    NULL);
-        }
-    }
-
+  add_usr_links_args (argv_array, runtime_files);
 
 #ifdef ENABLE_SECCOMP
   if (!setup_seccomp (argv_array,
@@ -3871,6 +3910,264 @@ child_setup (gpointer user_data)
     fcntl (g_array_index (fd_array, int, i), F_SETFD, 0);
 }
 
+typedef struct
+{
+  GArray *fd_array;
+  int     stdin_fd;
+} AppChildSetupData;
+
+static void
+app_child_setup (gpointer user_data)
+{
+  AppChildSetupData *data = user_data;
+
+  /* This runs after GLib set up stdin, so it wins */
+  if (data->stdin_fd != -1)
+    dup2 (data->stdin_fd, STDIN_FILENO);
+
+  child_setup (data->fd_array);
+}
+
+
+/* Bump this if the layout of the generated ld.so.conf, or of the
+   checksum below, changes */
+#define LD_SO_CACHE_VERSION "2"
+
+/* Includes the terminating nul, so that adjacent fields can't run into
+   each other, e.g. the end of the app extensions and the start of the
+   runtime ones */
+static void
+ld_cache_checksum_add (GChecksum  *checksum,
+                       const char *str)
+{
+  if (str == NULL)
+    str = "";
+  g_checksum_update (checksum, (guchar *) str, strlen (str) + 1);
+}
+
+static char *
+calculate_ld_cache_checksum (FlatpakDeploy *app_deploy,
+                             FlatpakDeploy *runtime_deploy,
+                             const char    *app_extensions,
+                             const char    *runtime_extensions)
+{
+  g_autoptr(GChecksum) ld_so_checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autofree char *runtime_commit = g_file_get_basename (flatpak_deploy_get_dir (runtime_deploy));
+  g_autofree char *app_commit = NULL;
+
+  if (app_deploy)
+    app_commit = g_file_get_basename (flatpak_deploy_get_dir (app_deploy));
+
+  ld_cache_checksum_add (ld_so_checksum, LD_SO_CACHE_VERSION);
+  ld_cache_checksum_add (ld_so_checksum, app_commit);
+  ld_cache_checksum_add (ld_so_checksum, runtime_commit);
+  ld_cache_checksum_add (ld_so_checksum, app_extensions);
+  ld_cache_checksum_add (ld_so_checksum, runtime_extensions);
+
+  return g_strdup (g_checksum_get_string (ld_so_checksum));
+}
+
+/* Removes all the cache files except the one currently in use, so that
+   we don't accumulate caches for old commits */
+static void
+prune_ld_caches (GFile      *ld_so_cache_dir,
+                 const char *keep)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  struct dirent *dent;
+
+  if (!glnx_dirfd_iterator_init_at (AT_FDCWD, flatpak_file_get_path_cached (ld_so_cache_dir),
+                                    FALSE, &dfd_iter, NULL))
+    return;
+
+  while (glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, NULL, NULL) && dent != NULL)
+    {
+      /* Skip in-progress temporary files from concurrent runs */
+      if (dent->d_type != DT_REG ||
+          dent->d_name[0] == '.' ||
+          strcmp (dent->d_name, keep) == 0)
+        continue;
+
+      (void) unlinkat (dfd_iter.fd, dent->d_name, 0);
+    }
+}
+
+/* Returns an fd to an ld.so.cache matching the runtime, app and extension
+   commits, running ldconfig in a minimal sandbox if no such cache exists yet */
+static int
+regenerate_ld_cache (GFile        *app_id_dir,
+                     const char   *checksum,
+                     GFile        *runtime_files,
+                     GFile        *app_files,
+                     GPtrArray    *extension_argv,
+                     const char   *ld_so_conf,
+                     GCancellable *cancellable,
+                     GError      **error)
+{
+  g_autoptr(GFile) ld_so_cache_dir = g_file_get_child (app_id_dir, ".ld.so");
+  g_autoptr(GFile) ld_so_cache = g_file_get_child (ld_so_cache_dir, checksum);
+  g_autoptr(GFile) tmp_cache = NULL;
+  g_autoptr(GPtrArray) argv_array = NULL;
+  g_autoptr(GArray) fd_array = NULL;
+  g_auto(GStrv) envp = NULL;
+  g_autofree char *tmp_basename = NULL;
+  g_autofree char *sandbox_cache_path = NULL;
+  g_autofree char *conf_fd_str = NULL;
+  int conf_fd;
+  int ld_so_fd;
+  int exit_status;
+  int i;
+
+  ld_so_fd = open (flatpak_file_get_path_cached (ld_so_cache), O_RDONLY | O_CLOEXEC);
+  if (ld_so_fd >= 0)
+    return ld_so_fd;
+
+  g_debug ("Regenerating ld.so.cache %s", flatpak_file_get_path_cached (ld_so_cache));
+
+  if (!flatpak_mkdir_p (ld_so_cache_dir, cancellable, error))
+    return -1;
+
+  argv_array = g_ptr_array_new_with_free_func (g_free);
+  fd_array = g_array_new (FALSE, TRUE, sizeof (int));
+  g_array_set_clear_func (fd_array, clear_fd);
+
+  conf_fd = create_tmp_fd (ld_so_conf, -1, error);
+  if (conf_fd < 0)
+    return -1;
+  g_array_append_val (fd_array, conf_fd);
+  conf_fd_str = g_strdup_printf ("%d", conf_fd);
+
+  tmp_basename = g_strconcat (".", checksum, "-XXXXXX", NULL);
+  glnx_gen_temp_name (tmp_basename);
+  tmp_cache = g_file_get_child (ld_so_cache_dir, tmp_basename);
+  sandbox_cache_path = g_build_filename ("/run/ld-so-cache-dir", tmp_basename, NULL);
+
+  g_ptr_array_add (argv_array, g_strdup (flatpak_get_bwrap ()));
+  add_args (argv_array,
+            "--unshare-pid",
+            "--unshare-user-try",
+            "--unshare-ipc",
+            "--unshare-net",
+            "--proc", "/proc",
+            "--dev", "/dev",
+            "--ro-bind", flatpak_file_get_path_cached (runtime_files), "/usr",
+            "--symlink", "usr/etc", "/etc",
+            NULL);
+
+  if (app_files != NULL)
+    add_args (argv_array,
+              "--ro-bind", flatpak_file_get_path_cached (app_files), "/app",
+              NULL);
+  else
+    add_args (argv_array,
+              "--dir", "/app",
+              NULL);
+
+  add_usr_links_args (argv_array, runtime_files);
+
+  for (i = 0; i < extension_argv->len; i++)
+    g_ptr_array_add (argv_array, g_strdup (g_ptr_array_index (extension_argv, i)));
+
+  add_args (argv_array,
+            "--bind", flatpak_file_get_path_cached (ld_so_cache_dir), "/run/ld-so-cache-dir",
+            "--bind-data", conf_fd_str, "/run/flatpak/ld.so.conf",
+            "ldconfig", "-X",
+            "-C", sandbox_cache_path,
+            "-f", "/run/flatpak/ld.so.conf",
+            NULL);
+  g_ptr_array_add (argv_array, NULL);
+
+  envp = flatpak_run_get_minimal_env (FALSE);
+  envp = g_environ_setenv (envp, "PATH", "/usr/sbin:/usr/bin", TRUE);
+
+  if (!g_spawn_sync (NULL,
+                     (char **) argv_array->pdata,
+                     envp,
+                     G_SPAWN_SEARCH_PATH,
+                     child_setup, fd_array,
+                     NULL, NULL,
+                     &exit_status,
+                     error))
+    return -1;
+
+  if (exit_status != 0)
+    {
+      (void) unlink (flatpak_file_get_path_cached (tmp_cache));
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           _("ldconfig failed"));
+      return -1;
+    }
+
+  /* Rename to the final name, possibly replacing one written by a concurrent run */
+  if (rename (flatpak_file_get_path_cached (tmp_cache),
+              flatpak_file_get_path_cached (ld_so_cache)) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      (void) unlink (flatpak_file_get_path_cached (tmp_cache));
+      return -1;
+    }
+
+  ld_so_fd = open (flatpak_file_get_path_cached (ld_so_cache), O_RDONLY | O_CLOEXEC);
+  if (ld_so_fd < 0)
+    {
+      glnx_set_error_from_errno (error);
+      return -1;
+    }
+
+  prune_ld_caches (ld_so_cache_dir, checksum);
+
+  return ld_so_fd;
+}
+
+static void
+add_ld_cache_args (GPtrArray     *argv_array,
+                   GArray        *fd_array,
+                   GFile         *app_id_dir,
+                   FlatpakDeploy *app_deploy,
+                   FlatpakDeploy *runtime_deploy,
+                   GFile         *app_files,
+                   GFile         *runtime_files,
+                   GPtrArray     *extension_argv,
+                   const char    *app_extensions,
+                   const char    *app_ld_path,
+                   const char    *runtime_extensions,
+                   const char    *runtime_ld_path,
+                   GCancellable  *cancellable)
+{
+  g_autoptr(GError) my_error = NULL;
+  g_autoptr(GString) ld_so_conf = g_string_new ("");
+  g_autofree char *checksum = NULL;
+  g_autofree char *ld_so_fd_str = NULL;
+  int ld_so_fd;
+
+  /* App extensions go first, then the app, then runtime extensions
+     and finally whatever the runtime itself configures */
+  if (app_ld_path && *app_ld_path)
+    g_string_append_printf (ld_so_conf, "%s\n", app_ld_path);
+  g_string_append (ld_so_conf, "/app/lib\n");
+  if (runtime_ld_path && *runtime_ld_path)
+    g_string_append_printf (ld_so_conf, "%s\n", runtime_ld_path);
+  g_string_append (ld_so_conf, "include /etc/ld.so.conf\n");
+
+  checksum = calculate_ld_cache_checksum (app_deploy, runtime_deploy,
+                                          app_extensions, runtime_extensions);
+
+  ld_so_fd = regenerate_ld_cache (app_id_dir, checksum, runtime_files, app_files,
+                                  extension_argv, ld_so_conf->str,
+                                  cancellable, &my_error);
+  if (ld_so_fd < 0)
+    {
+      /* Not fatal, we just fall back to the runtime's own ld.so.cache */
+      g_debug ("Failed to generate ld.so.cache: %s", my_error->message);
+      return;
+    }
+
+  g_array_append_val (fd_array, ld_so_fd);
+  ld_so_fd_str = g_strdup_printf ("%d", ld_so_fd);
+  add_args (argv_array,
+            "--bind-data", ld_so_fd_str, "/etc/ld.so.cache",
+            NULL);
+}
 
 gboolean
 flatpak_run_app (const char     *app_ref,
@@ -3884,6 +4181,32 @@ flatpak_run_app (const char     *app_ref,
                  int             n_args,
                  GCancellable   *cancellable,
                  GError        **error)
+{
+  return flatpak_run_app_full (app_ref, app_deploy, extra_context,
+                               custom_runtime, custom_runtime_version,
+                               flags, custom_command, args, n_args,
+                               -1, NULL, cancellable, error);
+}
+
+/* Like flatpak_run_app(), but with FLATPAK_RUN_FLAG_BACKGROUND the
+ * sandbox can be given stdin_fd as its stdin, and if child_pid is
+ * non-NULL it is not reaped, so the caller has to waitpid() for it.
+ * Without that flag the current process is replaced, so stdin_fd must
+ * be -1 and child_pid NULL. */
+gboolean
+flatpak_run_app_full (const char     *app_ref,
+                      FlatpakDeploy  *app_deploy,
+                      FlatpakContext *extra_context,
+                      const char     *custom_runtime,
+                      const char     *custom_runtime_version,
+                      FlatpakRunFlags flags,
+                      const char     *custom_command,
+                      char           *args[],
+                      int             n_args,
+                      int             stdin_fd,
+                      GPid           *child_pid,
+                      GCancellable   *cancellable,
+                      GError        **error)
 {
   g_autoptr(FlatpakDeploy) runtime_deploy = NULL;
   g_autoptr(GFile) app_files = NULL;
@@ -3909,6 +4232,19 @@ flatpak_run_app (const char     *app_ref,
   g_autoptr(FlatpakContext) app_context = NULL;
   g_autoptr(FlatpakContext) overrides = NULL;
   g_auto(GStrv) app_ref_parts = NULL;
+  g_autoptr(GPtrArray) extension_argv = NULL;
+  g_autofree char *app_extensions = NULL;
+  g_autofree char *app_ld_path = NULL;
+  g_autofree char *runtime_extensions = NULL;
+  g_autofree char *runtime_ld_path = NULL;
+
+  if ((flags & FLATPAK_RUN_FLAG_BACKGROUND) == 0 &&
+      (stdin_fd != -1 || child_pid != NULL))
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                           "stdin_fd and child_pid need FLATPAK_RUN_FLAG_BACKGROUND");
+      return FALSE;
+    }
 
   app_ref_parts = flatpak_decompose_ref (app_ref, error);
   if (app_ref_parts == NULL)
@@ -4032,13 +4368,36 @@ flatpak_run_app (const char     *app_ref,
                                       runtime_ref, app_context, &app_info_path, error))
     return FALSE;
 
+  extension_argv = g_ptr_array_new_with_free_func (g_free);
+
   if (metakey != NULL &&
-      !flatpak_run_add_extension_args (argv_array, metakey, app_ref, cancellable, error))
+      !flatpak_run_add_extension_args (extension_argv, metakey, app_ref,
+                                       &app_extensions, &app_ld_path,
+                                       cancellable, error))
     return FALSE;
 
-  if (!flatpak_run_add_extension_args (argv_array, runtime_metakey, runtime_ref, cancellable, error))
+  if (!flatpak_run_add_extension_args (extension_argv, runtime_metakey, runtime_ref,
+                                       &runtime_extensions, &runtime_ld_path,
+                                       cancellable, error))
     return FALSE;
 
+  for (i = 0; i < extension_argv->len; i++)
+    g_ptr_array_add (argv_array, g_strdup (g_ptr_array_index (extension_argv, i)));
+
+  /* Only cache when we have a per-app directory to keep it in, and
+     when all the extensions have a commit to identify their content.
+     Unmaintained ones can change at any time, and a stale cache would
+     point to the wrong libraries. */
+  if (app_id_dir != NULL &&
+      (metakey == NULL || app_extensions != NULL) &&
+      runtime_extensions != NULL)
+    add_ld_cache_args (argv_array, fd_array, app_id_dir,
+                       app_deploy, runtime_deploy,
+                       app_files, runtime_files, extension_argv,
+                       app_extensions, app_ld_path,
+                       runtime_extensions, runtime_ld_path,
+                       cancellable);
+
   add_document_portal_args (argv_array, app_ref_parts[1]);
 
   flatpak_run_add_environment_args (argv_array, fd_array, &envp,
@@ -4119,12 +4478,18 @@ flatpak_run_app (const char     *app_ref,
 
   if ((flags & FLATPAK_RUN_FLAG_BACKGROUND) != 0)
     {
+      AppChildSetupData child_setup_data = { fd_array, stdin_fd };
+      GSpawnFlags spawn_flags = G_SPAWN_SEARCH_PATH;
+
+      if (child_pid != NULL)
+        spawn_flags |= G_SPAWN_DO_NOT_REAP_CHILD;
+
       if (!g_spawn_async (NULL,
                           (char **) real_argv_array->pdata,
                           envp,
-                          G_SPAWN_SEARCH_PATH,
-                          child_setup, fd_array,
-                          NULL,
+                          spawn_flags,
+                          app_child_setup, &child_setup_data,
+                          child_pid,
                           error))
         return FALSE;
     }
@@ -74,6 +74,8 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakContext, flatpak_context_free)
 gboolean  flatpak_run_add_extension_args (GPtrArray    *argv_array,
                                           GKeyFile     *metakey,
                                           const char   *full_ref,
+                                          char        **extensions_out,
+                                          char        **ld_path_out,
                                           GCancellable *cancellable,
                                           GError      **error);
 void     flatpak_run_add_environment_args (GPtrArray      *argv_array,
@@ -134,6 +136,19 @@ gboolean flatpak_run_app (const char     *app_ref,
                           int             n_args,
                           GCancellable   *cancellable,
                           GError        **error);
+gboolean flatpak_run_app_full (const char     *app_ref,
+                               FlatpakDeploy  *app_deploy,
+                               FlatpakContext *extra_context,
+                               const char     *custom_runtime,
+                               const char     *custom_runtime_version,
+                               FlatpakRunFlags flags,
+                               const char     *custom_command,
+                               char           *args[],
+                               int             n_args,
+                               int             stdin_fd,
+                               GPid           *child_pid,
+                               GCancellable   *cancellable,
+                               GError        **error);
 
 
 #endif /* __FLATPAK_RUN_H__ */
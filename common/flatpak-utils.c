@@ -38,6 +38,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
+#include <sys/file.h>
 
 #include <glib.h>
 #include "libglnx/libglnx.h"
@@ -1832,7 +1833,7 @@ flatpak_spawnv (GFile                *dir,
   if (subp == NULL)
     return FALSE;
 
-  loop = g_main_loop_new (NULL, FALSE);
+  loop = g_main_loop_new (g_main_context_get_thread_default (), FALSE);
 
   data.loop = loop;
   data.refs = 1;
@@ -2524,62 +2525,259 @@ flatpak_repo_parse_extra_data_sources (GVariant *extra_data_sources,
     *sha256 = ostree_checksum_bytes_peek (sha256_v);
 }
 
-#define OSTREE_GIO_FAST_QUERYINFO ("standard::name,standard::type,standard::size,standard::is-symlink,standard::symlink-target," \
-                                   "unix::device,unix::inode,unix::mode,unix::uid,unix::gid,unix::rdev")
+/* Sizes of already collected file and dirtree objects, keyed by their
+ * binary checksum. Different commits of the same app (or of its
+ * branches and arches) tend to share most of their objects, so this
+ * avoids looking at them again. Can be shared between threads. */
+typedef struct {
+  GMutex      lock;
+  GHashTable *files;
+  GHashTable *dirs;
+} ObjectSizeCache;
+
+typedef struct {
+  guint8  csum[OSTREE_SHA256_DIGEST_LEN];
+  guint64 installed_size;
+  guint64 download_size;
+} ObjectSizes;
+
+static guint
+object_sizes_hash (gconstpointer key)
+{
+  guint hash;
+
+  /* Checksums are already evenly distributed */
+  memcpy (&hash, key, sizeof (hash));
+  return hash;
+}
 
 static gboolean
-_flatpak_repo_collect_sizes (OstreeRepo   *repo,
-                             GFile        *file,
-                             GFileInfo    *file_info,
-                             guint64      *installed_size,
-                             guint64      *download_size,
-                             GCancellable *cancellable,
-                             GError      **error)
+object_sizes_equal (gconstpointer a,
+                    gconstpointer b)
+{
+  return memcmp (a, b, OSTREE_SHA256_DIGEST_LEN) == 0;
+}
+
+static ObjectSizeCache *
+object_size_cache_new (void)
 {
-  g_autoptr(GFileEnumerator) dir_enum = NULL;
-  GFileInfo *child_info_tmp;
-  g_autoptr(GError) temp_error = NULL;
+  ObjectSizeCache *cache = g_new0 (ObjectSizeCache, 1);
 
-  if (file_info != NULL && g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR)
+  g_mutex_init (&cache->lock);
+  /* The key points into the value, so only the value is freed */
+  cache->files = g_hash_table_new_full (object_sizes_hash, object_sizes_equal, NULL, g_free);
+  cache->dirs = g_hash_table_new_full (object_sizes_hash, object_sizes_equal, NULL, g_free);
+
+  return cache;
+}
+
+static void
+object_size_cache_free (ObjectSizeCache *cache)
+{
+  g_mutex_clear (&cache->lock);
+  g_hash_table_unref (cache->files);
+  g_hash_table_unref (cache->dirs);
+  g_free (cache);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ObjectSizeCache, object_size_cache_free)
+
+static gboolean
+object_size_cache_lookup (ObjectSizeCache *cache,
+                          GHashTable      *table,
+                          const guchar    *csum,
+                          guint64         *installed_size,
+                          guint64         *download_size)
+{
+  ObjectSizes *sizes;
+
+  g_mutex_lock (&cache->lock);
+  sizes = g_hash_table_lookup (table, csum);
+  if (sizes)
     {
-      const char *checksum = ostree_repo_file_get_checksum (OSTREE_REPO_FILE (file));
-      guint64 obj_size;
-      guint64 file_size = g_file_info_get_size (file_info);
+      *installed_size += sizes->installed_size;
+      *download_size += sizes->download_size;
+    }
+  g_mutex_unlock (&cache->lock);
 
-      if (installed_size)
-        *installed_size += ((file_size + 511) / 512) * 512;
+  return sizes != NULL;
+}
 
-      if (download_size)
-        {
-          if (!ostree_repo_query_object_storage_size (repo,
-                                                      OSTREE_OBJECT_TYPE_FILE, checksum,
-                                                      &obj_size, cancellable, error))
-            return FALSE;
+static void
+object_size_cache_insert (ObjectSizeCache *cache,
+                          GHashTable      *table,
+                          const guchar    *csum,
+                          guint64          installed_size,
+                          guint64          download_size)
+{
+  ObjectSizes *sizes = g_new (ObjectSizes, 1);
+
+  memcpy (sizes->csum, csum, OSTREE_SHA256_DIGEST_LEN);
+  sizes->installed_size = installed_size;
+  sizes->download_size = download_size;
+
+  g_mutex_lock (&cache->lock);
+  /* Another thread may have got here first */
+  if (g_hash_table_contains (table, sizes->csum))
+    g_free (sizes);
+  else
+    g_hash_table_add (table, sizes);
+  g_mutex_unlock (&cache->lock);
+}
 
-          *download_size += obj_size;
-        }
+static gboolean
+collect_file_sizes (OstreeRepo      *repo,
+                    ObjectSizeCache *cache,
+                    const guchar    *csum,
+                    guint64         *installed_size,
+                    guint64         *download_size,
+                    GCancellable    *cancellable,
+                    GError         **error)
+{
+  char checksum[OSTREE_SHA256_STRING_LEN + 1];
+  g_autoptr(GFileInfo) file_info = NULL;
+  guint64 file_installed_size = 0;
+  guint64 file_download_size = 0;
+
+  if (object_size_cache_lookup (cache, cache->files, csum,
+                                installed_size, download_size))
+    return TRUE;
+
+  ostree_checksum_inplace_from_bytes (csum, checksum);
+
+  if (!ostree_repo_load_file (repo, checksum, NULL, &file_info, NULL,
+                              cancellable, error))
+    return FALSE;
+
+  if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR)
+    {
+      file_installed_size = ((g_file_info_get_size (file_info) + 511) / 512) * 512;
+
+      if (!ostree_repo_query_object_storage_size (repo,
+                                                  OSTREE_OBJECT_TYPE_FILE, checksum,
+                                                  &file_download_size, cancellable, error))
+        return FALSE;
     }
 
-  if (file_info == NULL || g_file_info_get_file_type (file_info) == G_FILE_TYPE_DIRECTORY)
+  object_size_cache_insert (cache, cache->files, csum,
+                            file_installed_size, file_download_size);
+
+  *installed_size += file_installed_size;
+  *download_size += file_download_size;
+
+  return TRUE;
+}
+
+/* Walks the dirtree objects directly rather than going through
+   OstreeRepoFile, which allocates a GFile and GFileInfo per node */
+static gboolean
+collect_dirtree_sizes (OstreeRepo      *repo,
+                       ObjectSizeCache *cache,
+                       const guchar    *csum,
+                       guint64         *installed_size,
+                       guint64         *download_size,
+                       GCancellable    *cancellable,
+                       GError         **error)
+{
+  char checksum[OSTREE_SHA256_STRING_LEN + 1];
+  g_autoptr(GVariant) dirtree = NULL;
+  g_autoptr(GVariant) files = NULL;
+  g_autoptr(GVariant) dirs = NULL;
+  guint64 dir_installed_size = 0;
+  guint64 dir_download_size = 0;
+  gsize n, i;
+
+  if (object_size_cache_lookup (cache, cache->dirs, csum,
+                                installed_size, download_size))
+    return TRUE;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  ostree_checksum_inplace_from_bytes (csum, checksum);
+
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE, checksum,
+                                 &dirtree, error))
+    return FALSE;
+
+  files = g_variant_get_child_value (dirtree, 0);
+  n = g_variant_n_children (files);
+  for (i = 0; i < n; i++)
     {
-      dir_enum = g_file_enumerate_children (file, OSTREE_GIO_FAST_QUERYINFO,
-                                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                            cancellable, error);
-      if (!dir_enum)
+      const char *name;
+      g_autoptr(GVariant) csum_v = NULL;
+      const guchar *file_csum;
+
+      g_variant_get_child (files, i, "(&s@ay)", &name, &csum_v);
+      file_csum = ostree_checksum_bytes_peek_validate (csum_v, error);
+      if (file_csum == NULL)
         return FALSE;
 
+      if (!collect_file_sizes (repo, cache, file_csum,
+                               &dir_installed_size, &dir_download_size,
+                               cancellable, error))
+        return FALSE;
+    }
 
-      while ((child_info_tmp = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)))
-        {
-          g_autoptr(GFileInfo) child_info = child_info_tmp;
-          const char *name = g_file_info_get_name (child_info);
-          g_autoptr(GFile) child = g_file_get_child (file, name);
+  dirs = g_variant_get_child_value (dirtree, 1);
+  n = g_variant_n_children (dirs);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) tree_csum_v = NULL;
+      g_autoptr(GVariant) meta_csum_v = NULL;
+      const guchar *tree_csum;
 
-          if (!_flatpak_repo_collect_sizes (repo, child, child_info, installed_size, download_size, cancellable, error))
-            return FALSE;
-        }
+      g_variant_get_child (dirs, i, "(&s@ay@ay)", &name, &tree_csum_v, &meta_csum_v);
+      tree_csum = ostree_checksum_bytes_peek_validate (tree_csum_v, error);
+      if (tree_csum == NULL)
+        return FALSE;
+
+      if (!collect_dirtree_sizes (repo, cache, tree_csum,
+                                  &dir_installed_size, &dir_download_size,
+                                  cancellable, error))
+        return FALSE;
     }
 
+  object_size_cache_insert (cache, cache->dirs, csum,
+                            dir_installed_size, dir_download_size);
+
+  *installed_size += dir_installed_size;
+  *download_size += dir_download_size;
+
+  return TRUE;
+}
+
+static gboolean
+_flatpak_repo_collect_sizes (OstreeRepo      *repo,
+                             GFile           *root,
+                             guint64         *installed_size,
+                             guint64         *download_size,
+                             ObjectSizeCache *size_cache,
+                             GCancellable    *cancellable,
+                             GError         **error)
+{
+  const char *contents_checksum;
+  guint8 csum[OSTREE_SHA256_DIGEST_LEN];
+  guint64 root_installed_size = 0;
+  guint64 root_download_size = 0;
+
+  if (!ostree_repo_file_ensure_resolved (OSTREE_REPO_FILE (root), error))
+    return FALSE;
+
+  contents_checksum = ostree_repo_file_tree_get_contents_checksum (OSTREE_REPO_FILE (root));
+  ostree_checksum_inplace_to_bytes (contents_checksum, csum);
+
+  if (!collect_dirtree_sizes (repo, size_cache, csum,
+                              &root_installed_size, &root_download_size,
+                              cancellable, error))
+    return FALSE;
+
+  if (installed_size)
+    *installed_size += root_installed_size;
+  if (download_size)
+    *download_size += root_download_size;
+
   return TRUE;
 }
 
@@ -2591,7 +2789,10 @@ flatpak_repo_collect_sizes (OstreeRepo   *repo,
                             GCancellable *cancellable,
                             GError      **error)
 {
-  return _flatpak_repo_collect_sizes (repo, root, NULL, installed_size, download_size, cancellable, error);
+  g_autoptr(ObjectSizeCache) size_cache = object_size_cache_new ();
+
+  return _flatpak_repo_collect_sizes (repo, root, installed_size, download_size,
+                                      size_cache, cancellable, error);
 }
 
 
@@ -2669,6 +2870,63 @@ commit_data_free (gpointer data)
   g_free (rev_data);
 }
 
+#define MAX_PARALLEL_COMMIT_DATA 8
+
+typedef struct {
+  const char   *rev;
+  CommitData   *rev_data;
+  GError       *error;
+} CommitDataJob;
+
+typedef struct {
+  OstreeRepo   *repo;
+  ObjectSizeCache *size_cache;
+  GCancellable *cancellable;
+} CommitDataJobs;
+
+static void
+commit_data_job_free (CommitDataJob *job)
+{
+  if (job->rev_data)
+    commit_data_free (job->rev_data);
+  g_clear_error (&job->error);
+  g_free (job);
+}
+
+static void
+collect_commit_data_thread (gpointer data,
+                            gpointer user_data)
+{
+  CommitDataJob *job = data;
+  CommitDataJobs *jobs = user_data;
+  g_autoptr(GFile) root = NULL;
+  g_autoptr(GFile) metadata = NULL;
+  guint64 installed_size = 0;
+  guint64 download_size = 0;
+  g_autofree char *metadata_contents = NULL;
+
+  if (g_cancellable_set_error_if_cancelled (jobs->cancellable, &job->error))
+    return;
+
+  if (!ostree_repo_read_commit (jobs->repo, job->rev, &root, NULL, NULL, &job->error))
+    return;
+
+  if (!_flatpak_repo_collect_sizes (jobs->repo, root, &installed_size, &download_size,
+                                    jobs->size_cache, jobs->cancellable, &job->error))
+    return;
+
+  flatpak_repo_collect_extra_data_sizes (jobs->repo, job->rev, &installed_size, &download_size);
+
+  metadata = g_file_get_child (root, "metadata");
+  if (!g_file_load_contents (metadata, jobs->cancellable, &metadata_contents, NULL, NULL, NULL))
+    metadata_contents = g_strdup ("");
+
+  job->rev_data = g_new (CommitData, 1);
+  job->rev_data->installed_size = installed_size;
+  job->rev_data->download_size = download_size;
+  job->rev_data->metadata_contents = g_steal_pointer (&metadata_contents);
+}
+
 gboolean
 flatpak_repo_update (OstreeRepo   *repo,
                      const char  **gpg_key_ids,
@@ -2689,6 +2947,12 @@ flatpak_repo_update (OstreeRepo   *repo,
   g_autoptr(GList) ordered_keys = NULL;
   GList *l = NULL;
   g_autoptr(GHashTable) commit_data_cache = NULL;
+  g_autoptr(GPtrArray) commit_data_jobs = NULL;
+  g_autoptr(GHashTable) pending_revs = NULL;
+  g_autoptr(ObjectSizeCache) size_cache = NULL;
+  CommitDataJobs jobs;
+  GThreadPool *pool;
+  guint i;
 
   g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
 
@@ -2785,39 +3049,51 @@ flatpak_repo_update (OstreeRepo   *repo,
 
   ordered_keys = g_hash_table_get_keys (refs);
   ordered_keys = g_list_sort (ordered_keys, (GCompareFunc) strcmp);
+
+  /* Only the revisions that were not in the old summary need to be
+     looked at, and those are handled in parallel */
+  size_cache = object_size_cache_new ();
+  jobs.repo = repo;
+  jobs.size_cache = size_cache;
+  jobs.cancellable = cancellable;
+
+  commit_data_jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) commit_data_job_free);
+  pending_revs = g_hash_table_new (g_str_hash, g_str_equal);
+  pool = g_thread_pool_new (collect_commit_data_thread, &jobs,
+                            MIN (g_get_num_processors (), MAX_PARALLEL_COMMIT_DATA),
+                            FALSE, NULL);
+
   for (l = ordered_keys; l; l = l->next)
     {
       const char *ref = l->data;
       const char *rev = g_hash_table_lookup (refs, ref);
-      g_autoptr(GFile) root = NULL;
-      g_autoptr(GFile) metadata = NULL;
-      guint64 installed_size = 0;
-      guint64 download_size = 0;
-      g_autofree char *metadata_contents = NULL;
-      CommitData *rev_data;
+      CommitDataJob *job;
 
       /* See if we already have the info on this revision */
-      if (g_hash_table_lookup (commit_data_cache, rev))
+      if (g_hash_table_lookup (commit_data_cache, rev) ||
+          !g_hash_table_add (pending_revs, (char *) rev))
         continue;
 
-      if (!ostree_repo_read_commit (repo, rev, &root, NULL, NULL, error))
-        return FALSE;
-
-      if (!flatpak_repo_collect_sizes (repo, root, &installed_size, &download_size, cancellable, error))
-        return FALSE;
+      job = g_new0 (CommitDataJob, 1);
+      job->rev = rev;
+      g_ptr_array_add (commit_data_jobs, job);
+      g_thread_pool_push (pool, job, NULL);
+    }
 
-      flatpak_repo_collect_extra_data_sizes (repo, rev, &installed_size, &download_size);
+  g_thread_pool_free (pool, FALSE, TRUE);
 
-      metadata = g_file_get_child (root, "metadata");
-      if (!g_file_load_contents (metadata, cancellable, &metadata_contents, NULL, NULL, NULL))
-        metadata_contents = g_strdup ("");
+  for (i = 0; i < commit_data_jobs->len; i++)
+    {
+      CommitDataJob *job = g_ptr_array_index (commit_data_jobs, i);
 
-      rev_data = g_new (CommitData, 1);
-      rev_data->installed_size = installed_size;
-      rev_data->download_size = download_size;
-      rev_data->metadata_contents = g_strdup (metadata_contents);
+      if (job->error)
+        {
+          g_propagate_error (error, g_steal_pointer (&job->error));
+          return FALSE;
+        }
 
-      g_hash_table_insert (commit_data_cache, g_strdup (rev), rev_data);
+      g_hash_table_insert (commit_data_cache, g_strdup (job->rev),
+                           g_steal_pointer (&job->rev_data));
     }
 
   for (l = ordered_keys; l; l = l->next)
@@ -3059,16 +3335,12 @@ flatpak_appstream_xml_migrate (FlatpakXml *source,
 
 static gboolean
 copy_icon (const char *id,
-           GFile      *root,
+           GFile      *icons_dir,
            GFile      *dest,
            const char *size,
            GError    **error)
 {
   g_autofree char *icon_name = g_strconcat (id, ".png", NULL);
-
-  g_autoptr(GFile) icons_dir =
-    g_file_resolve_relative_path (root,
-                                  "files/share/app-info/icons/flatpak");
   g_autoptr(GFile) size_dir = g_file_get_child (icons_dir, size);
   g_autoptr(GFile) icon_file = g_file_get_child (size_dir, icon_name);
   g_autoptr(GFile) dest_dir = g_file_get_child (dest, "icons");
@@ -3114,6 +3386,7 @@ static gboolean
 extract_appstream (OstreeRepo   *repo,
                    FlatpakXml   *appstream_root,
                    const char   *ref,
+                   const char   *commit,
                    const char   *id,
                    GFile        *dest,
                    GCancellable *cancellable,
@@ -3121,6 +3394,7 @@ extract_appstream (OstreeRepo   *repo,
 {
   g_autoptr(GFile) root = NULL;
   g_autoptr(GFile) xmls_dir = NULL;
+  g_autoptr(GFile) icons_dir = NULL;
   g_autoptr(GFile) appstream_file = NULL;
   g_autoptr(GFile) metadata = NULL;
   g_autofree char *appstream_basename = NULL;
@@ -3128,7 +3402,7 @@ extract_appstream (OstreeRepo   *repo,
   g_autoptr(FlatpakXml) xml_root = NULL;
   g_autoptr(GKeyFile) keyfile = NULL;
 
-  if (!ostree_repo_read_commit (repo, ref, &root, NULL, NULL, error))
+  if (!ostree_repo_read_commit (repo, commit, &root, NULL, NULL, error))
     return FALSE;
 
   keyfile = g_key_file_new ();
@@ -3189,12 +3463,13 @@ extract_appstream (OstreeRepo   *repo,
           g_print ("Extracting icons for component %s\n", component_id_text);
           component_id_text[strlen (component_id_text) - strlen (".desktop")] = 0;
 
-          if (!copy_icon (component_id_text, root, dest, "64x64", &my_error))
+          icons_dir = g_file_resolve_relative_path (root, "files/share/app-info/icons/flatpak");
+          if (!copy_icon (component_id_text, icons_dir, dest, "64x64", &my_error))
             {
               g_print ("Error copying 64x64 icon: %s\n", my_error->message);
               g_clear_error (&my_error);
             }
-          if (!copy_icon (component_id_text, root, dest, "128x128", &my_error))
+          if (!copy_icon (component_id_text, icons_dir, dest, "128x128", &my_error))
             {
               g_print ("Error copying 128x128 icon: %s\n", my_error->message);
               g_clear_error (&my_error);
@@ -3255,6 +3530,215 @@ flatpak_appstream_xml_root_to_data (FlatpakXml *appstream_root,
   return g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (out));
 }
 
+/* Splits the components of a previously generated appstream into one
+ * appstream root per ref, based on the flatpak bundle that
+ * validate_component() added to them. */
+static GHashTable *
+appstream_components_by_ref (FlatpakXml *appstream_root)
+{
+  GHashTable *by_ref = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, (GDestroyNotify) flatpak_xml_free);
+  FlatpakXml *components;
+  FlatpakXml *component;
+  FlatpakXml *prev_component;
+
+  components = flatpak_xml_find (appstream_root, "components", NULL);
+  if (components == NULL)
+    return by_ref;
+
+  component = components->first_child;
+  prev_component = NULL;
+  while (component != NULL)
+    {
+      FlatpakXml *next = component->next_sibling;
+      FlatpakXml *bundle = NULL;
+      FlatpakXml *bundle_text = NULL;
+
+      if (g_strcmp0 (component->element_name, "component") == 0)
+        bundle = flatpak_xml_find (component, "bundle", NULL);
+      if (bundle != NULL)
+        bundle_text = flatpak_xml_find (bundle, NULL, NULL);
+
+      if (bundle_text != NULL && bundle_text->text != NULL)
+        {
+          g_autofree char *ref = g_strstrip (g_strdup (bundle_text->text));
+          FlatpakXml *ref_root = g_hash_table_lookup (by_ref, ref);
+
+          if (ref_root == NULL)
+            {
+              ref_root = flatpak_appstream_xml_new ();
+              g_hash_table_insert (by_ref, g_steal_pointer (&ref), ref_root);
+            }
+
+          flatpak_xml_add (ref_root->first_child,
+                           flatpak_xml_unlink (component, prev_component));
+        }
+      else
+        {
+          prev_component = component;
+        }
+
+      component = next;
+    }
+
+  return by_ref;
+}
+
+/* Loads the refs and commits the previous appstream commit was generated
+ * from, and its components split per ref. Any problem with it just means
+ * that we extract everything again. */
+static gboolean
+load_previous_appstream (OstreeRepo    *repo,
+                         const char    *parent,
+                         GHashTable    *old_commits,
+                         GHashTable   **old_components_out,
+                         GFile        **old_root_out,
+                         GCancellable  *cancellable,
+                         GError       **error)
+{
+  g_autoptr(GVariant) commit_v = NULL;
+  g_autoptr(GVariant) commit_metadata = NULL;
+  g_autoptr(GVariant) refs_v = NULL;
+  g_autoptr(GFile) root = NULL;
+  g_autoptr(GFile) appstream_file = NULL;
+  g_autoptr(GInputStream) in = NULL;
+  g_autoptr(FlatpakXml) xml_root = NULL;
+  g_autoptr(GError) my_error = NULL;
+  GVariantIter iter;
+  const char *ref;
+  const char *commit;
+
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, parent, &commit_v, error))
+    return FALSE;
+
+  commit_metadata = g_variant_get_child_value (commit_v, 0);
+  refs_v = g_variant_lookup_value (commit_metadata, "xa.appstream-refs", G_VARIANT_TYPE ("a{ss}"));
+  if (refs_v == NULL)
+    return TRUE;
+
+  if (!ostree_repo_read_commit (repo, parent, &root, NULL, cancellable, error))
+    return FALSE;
+
+  appstream_file = g_file_get_child (root, "appstream.xml.gz");
+  in = (GInputStream *) g_file_read (appstream_file, cancellable, &my_error);
+  if (in != NULL)
+    xml_root = flatpak_xml_parse (in, TRUE, cancellable, &my_error);
+
+  if (xml_root == NULL)
+    {
+      g_debug ("Can't load previous appstream data: %s", my_error->message);
+      return TRUE;
+    }
+
+  g_variant_iter_init (&iter, refs_v);
+  while (g_variant_iter_next (&iter, "{&s&s}", &ref, &commit))
+    g_hash_table_insert (old_commits, g_strdup (ref), g_strdup (commit));
+
+  *old_components_out = appstream_components_by_ref (xml_root);
+  *old_root_out = g_steal_pointer (&root);
+
+  return TRUE;
+}
+
+static void
+copy_reused_icons (FlatpakXml *appstream_root,
+                   GFile      *old_root,
+                   GFile      *dest)
+{
+  g_autoptr(GFile) icons_dir = g_file_get_child (old_root, "icons");
+  FlatpakXml *component;
+
+  for (component = appstream_root->first_child->first_child;
+       component != NULL;
+       component = component->next_sibling)
+    {
+      FlatpakXml *component_id, *component_id_text_node;
+      g_autofree char *component_id_text = NULL;
+      g_autoptr(GError) my_error = NULL;
+
+      if (g_strcmp0 (component->element_name, "component") != 0)
+        continue;
+
+      component_id = flatpak_xml_find (component, "id", NULL);
+      if (component_id == NULL)
+        continue;
+
+      component_id_text_node = flatpak_xml_find (component_id, NULL, NULL);
+      if (component_id_text_node == NULL || component_id_text_node->text == NULL)
+        continue;
+
+      component_id_text = g_strstrip (g_strdup (component_id_text_node->text));
+      if (!g_str_has_suffix (component_id_text, ".desktop"))
+        continue;
+
+      component_id_text[strlen (component_id_text) - strlen (".desktop")] = 0;
+
+      if (!copy_icon (component_id_text, icons_dir, dest, "64x64", &my_error))
+        {
+          g_print ("Error copying 64x64 icon: %s\n", my_error->message);
+          g_clear_error (&my_error);
+        }
+      if (!copy_icon (component_id_text, icons_dir, dest, "128x128", &my_error))
+        {
+          g_print ("Error copying 128x128 icon: %s\n", my_error->message);
+          g_clear_error (&my_error);
+        }
+    }
+}
+
+typedef struct {
+  OstreeRepo   *repo;
+  const char   *ref;
+  const char   *commit;
+  char         *id;
+  GFile        *dest;
+  FlatpakXml   *appstream_root;
+} AppstreamExtraction;
+
+static void
+appstream_extraction_free (AppstreamExtraction *extraction)
+{
+  g_free (extraction->id);
+  if (extraction->appstream_root)
+    flatpak_xml_free (extraction->appstream_root);
+  g_free (extraction);
+}
+
+/* Runs in a thread pool, each ref extracts into its own appstream root,
+   which are merged in ref order afterwards */
+static void
+extract_appstream_thread (gpointer data,
+                          gpointer user_data)
+{
+  AppstreamExtraction *extraction = data;
+  g_autoptr(GError) my_error = NULL;
+
+  if (!extract_appstream (extraction->repo, extraction->appstream_root,
+                          extraction->ref, extraction->commit, extraction->id,
+                          extraction->dest, NULL, &my_error))
+    {
+      if (g_str_has_prefix (extraction->ref, "app/"))
+        g_print ("No appstream data for %s: %s\n", extraction->ref, my_error->message);
+    }
+}
+
+static void
+appstream_merge_components (FlatpakXml *dest_root,
+                            FlatpakXml *source_root)
+{
+  FlatpakXml *components = source_root->first_child;
+
+  while (components->first_child != NULL)
+    {
+      FlatpakXml *node = flatpak_xml_unlink (components->first_child, NULL);
+
+      if (g_strcmp0 (node->element_name, "component") == 0)
+        flatpak_xml_add (dest_root->first_child, node);
+      else
+        flatpak_xml_free (node);
+    }
+}
+
 gboolean
 flatpak_repo_generate_appstream (OstreeRepo   *repo,
                                  const char  **gpg_key_ids,
@@ -3267,7 +3751,6 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
   GHashTableIter iter;
   gpointer key;
   gpointer value;
-  gboolean skip_commit = FALSE;
 
   arches = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
@@ -3311,20 +3794,40 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
       g_autofree char *branch = NULL;
       g_autoptr(FlatpakXml) appstream_root = NULL;
       g_autoptr(GBytes) xml_data = NULL;
+      g_autoptr(GPtrArray) arch_refs = g_ptr_array_new ();
+      g_autoptr(GPtrArray) extractions = g_ptr_array_new_with_free_func ((GDestroyNotify) appstream_extraction_free);
+      g_autoptr(GHashTable) old_commits = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+      g_autoptr(GHashTable) old_components = NULL;
+      g_autoptr(GFile) old_root = NULL;
+      g_autoptr(GVariantBuilder) refs_builder = g_variant_builder_new (G_VARIANT_TYPE ("a{ss}"));
+      g_autoptr(GVariantBuilder) metadata_builder = g_variant_builder_new (G_VARIANT_TYPE ("a{sv}"));
+      g_autoptr(GVariant) metadata = NULL;
+      gboolean refs_changed;
+      gboolean skip_commit = FALSE;
+      GThreadPool *pool;
+      guint i;
 
       if (g_mkdtemp_full (tmpdir, 0755) == NULL)
         return flatpak_fail (error, "Can't create temporary directory");
 
       tmpdir_file = g_file_new_for_path (tmpdir);
 
-      appstream_root = flatpak_appstream_xml_new ();
+      branch = g_strdup_printf ("appstream/%s", arch);
+
+      if (!ostree_repo_resolve_rev (repo, branch, TRUE, &parent, error))
+        return FALSE;
+
+      if (parent != NULL &&
+          !load_previous_appstream (repo, parent, old_commits,
+                                    &old_components, &old_root,
+                                    cancellable, error))
+        return FALSE;
 
       g_hash_table_iter_init (&iter2, all_refs);
       while (g_hash_table_iter_next (&iter2, &key, &value))
         {
           const char *ref = key;
           g_auto(GStrv) split = NULL;
-          g_autoptr(GError) my_error = NULL;
 
           split = flatpak_decompose_ref (ref, NULL);
           if (!split)
@@ -3333,14 +3836,79 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
           if (strcmp (split[2], arch) != 0)
             continue;
 
-          if (!extract_appstream (repo, appstream_root,
-                                  ref, split[1], tmpdir_file,
-                                  cancellable, &my_error))
+          g_ptr_array_add (arch_refs, (char *) ref);
+        }
+
+      /* Sort so that the result doesn't depend on the order in
+         which the extractions finish */
+      g_ptr_array_sort (arch_refs, flatpak_strcmp0_ptr);
+
+      refs_changed = g_hash_table_size (old_commits) != arch_refs->len;
+
+      pool = g_thread_pool_new (extract_appstream_thread, NULL,
+                                g_get_num_processors (), FALSE, NULL);
+
+      for (i = 0; i < arch_refs->len; i++)
+        {
+          const char *ref = g_ptr_array_index (arch_refs, i);
+          const char *commit = g_hash_table_lookup (all_refs, ref);
+          AppstreamExtraction *extraction = g_new0 (AppstreamExtraction, 1);
+          g_auto(GStrv) split = flatpak_decompose_ref (ref, NULL);
+
+          extraction->repo = repo;
+          extraction->ref = ref;
+          extraction->commit = commit;
+          extraction->id = g_strdup (split[1]);
+          extraction->dest = G_FILE (tmpdir_file);
+          g_ptr_array_add (extractions, extraction);
+
+          g_variant_builder_add (refs_builder, "{ss}", ref, commit);
+
+          if (g_strcmp0 (g_hash_table_lookup (old_commits, ref), commit) == 0)
             {
-              if (g_str_has_prefix (ref, "app/"))
-                g_print ("No appstream data for %s: %s\n", ref, my_error->message);
-              continue;
+              /* Unchanged since the last appstream commit, so reuse what we
+                 extracted then. If there is nothing, there was no appstream
+                 data for it then either. */
+              FlatpakXml *old_root_xml = NULL;
+              char *old_ref = NULL;
+
+              if (old_components != NULL &&
+                  g_hash_table_lookup_extended (old_components, ref,
+                                                (gpointer *) &old_ref,
+                                                (gpointer *) &old_root_xml))
+                {
+                  g_hash_table_steal (old_components, ref);
+                  g_free (old_ref);
+                  extraction->appstream_root = old_root_xml;
+                }
             }
+          else
+            {
+              refs_changed = TRUE;
+              extraction->appstream_root = flatpak_appstream_xml_new ();
+              g_thread_pool_push (pool, extraction, NULL);
+            }
+        }
+
+      /* Copy the icons of the reused refs while the others are extracted */
+      for (i = 0; i < extractions->len; i++)
+        {
+          AppstreamExtraction *extraction = g_ptr_array_index (extractions, i);
+
+          if (extraction->appstream_root != NULL &&
+              g_strcmp0 (g_hash_table_lookup (old_commits, extraction->ref), extraction->commit) == 0)
+            copy_reused_icons (extraction->appstream_root, old_root, G_FILE (tmpdir_file));
+        }
+
+      g_thread_pool_free (pool, FALSE, TRUE);
+
+      appstream_root = flatpak_appstream_xml_new ();
+      for (i = 0; i < extractions->len; i++)
+        {
+          AppstreamExtraction *extraction = g_ptr_array_index (extractions, i);
+
+          if (extraction->appstream_root != NULL)
+            appstream_merge_components (appstream_root, extraction->appstream_root);
         }
 
       xml_data = flatpak_appstream_xml_root_to_data (appstream_root, error);
@@ -3360,14 +3928,15 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
                                     error))
         return FALSE;
 
+      /* Record which commits this was generated from, so that the
+         next run can skip the refs that didn't change */
+      g_variant_builder_add (metadata_builder, "{sv}", "xa.appstream-refs",
+                             g_variant_builder_end (refs_builder));
+      metadata = g_variant_ref_sink (g_variant_builder_end (metadata_builder));
+
       if (!ostree_repo_prepare_transaction (repo, NULL, cancellable, error))
         return FALSE;
 
-      branch = g_strdup_printf ("appstream/%s", arch);
-
-      if (!ostree_repo_resolve_rev (repo, branch, TRUE, &parent, error))
-        goto out;
-
       mtree = ostree_mutable_tree_new ();
 
       modifier = ostree_repo_commit_modifier_new (OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SKIP_XATTRS,
@@ -3381,7 +3950,7 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
 
 
       /* No need to commit if nothing changed */
-      if (parent)
+      if (parent && !refs_changed)
         {
           g_autoptr(GFile) parent_root;
 
@@ -3394,18 +3963,18 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
 
       if (!skip_commit)
         {
-          if (!ostree_repo_write_commit (repo, parent, "Update", NULL, NULL,
+          if (!ostree_repo_write_commit (repo, parent, "Update", NULL, metadata,
                                          OSTREE_REPO_FILE (root),
                                          &commit_checksum, cancellable, error))
             goto out;
 
           if (gpg_key_ids)
             {
-              int i;
+              int j;
 
-              for (i = 0; gpg_key_ids[i] != NULL; i++)
+              for (j = 0; gpg_key_ids[j] != NULL; j++)
                 {
-                  const char *keyid = gpg_key_ids[i];
+                  const char *keyid = gpg_key_ids[j];
 
                   if (!ostree_repo_sign_commit (repo,
                                                 commit_checksum,
@@ -3443,6 +4012,8 @@ flatpak_extension_free (FlatpakExtension *extension)
   g_free (extension->ref);
   g_free (extension->directory);
   g_free (extension->files_path);
+  g_free (extension->commit);
+  g_free (extension->add_ld_path);
   g_free (extension);
 }
 
@@ -3462,6 +4033,16 @@ flatpak_extension_new (const char *id,
   ext->directory = g_strdup (directory);
   ext->files_path = g_file_get_path (files);
   ext->is_unmaintained = is_unmaintained;
+
+  /* Deployed extensions live in deploy/$commit/files, unmaintained ones
+     have no commit */
+  if (!is_unmaintained)
+    {
+      g_autoptr(GFile) deploy_dir = g_file_get_parent (files);
+      if (deploy_dir)
+        ext->commit = g_file_get_basename (deploy_dir);
+    }
+
   return ext;
 }
 
@@ -3490,6 +4071,7 @@ flatpak_list_extensions (GKeyFile   *metakey,
         {
           g_autofree char *directory = g_key_file_get_string (metakey, groups[i], "directory", NULL);
           g_autofree char *version = g_key_file_get_string (metakey, groups[i], "version", NULL);
+          g_autofree char *add_ld_path = g_key_file_get_string (metakey, groups[i], "add-ld-path", NULL);
           g_autofree char *ref = NULL;
           const char *branch;
           gboolean is_unmaintained = FALSE;
@@ -3516,6 +4098,7 @@ flatpak_list_extensions (GKeyFile   *metakey,
           if (files != NULL)
             {
               ext = flatpak_extension_new (extension, extension, ref, directory, files, is_unmaintained);
+              ext->add_ld_path = g_strdup (add_ld_path);
               res = g_list_prepend (res, ext);
             }
           else if (g_key_file_get_boolean (metakey, groups[i],
@@ -3538,6 +4121,7 @@ flatpak_list_extensions (GKeyFile   *metakey,
                   if (subdir_files)
                     {
                       ext = flatpak_extension_new (extension, refs[j], dir_ref, extended_dir, subdir_files, FALSE);
+                      ext->add_ld_path = g_strdup (add_ld_path);
                       ext->needs_tmpfs = needs_tmpfs;
                       needs_tmpfs = FALSE; /* Only first subdir needs a tmpfs */
                       res = g_list_prepend (res, ext);
@@ -3555,6 +4139,7 @@ flatpak_list_extensions (GKeyFile   *metakey,
                   if (subdir_files)
                     {
                       ext = flatpak_extension_new (extension, unmaintained_refs[j], dir_ref, extended_dir, subdir_files, TRUE);
+                      ext->add_ld_path = g_strdup (add_ld_path);
                       ext->needs_tmpfs = needs_tmpfs;
                       needs_tmpfs = FALSE; /* Only first subdir needs a tmpfs */
                       res = g_list_prepend (res, ext);
@@ -4093,6 +4678,176 @@ flatpak_pull_from_bundle (OstreeRepo   *repo,
   return TRUE;
 }
 
+/* Max number of layer blobs downloaded at the same time */
+#define OCI_MAX_PARALLEL_LAYER_DOWNLOADS 4
+
+typedef struct {
+  const char *digest;
+  int fd;
+  GError *error;
+  gboolean done;
+} OciLayerDownload;
+
+typedef struct {
+  FlatpakOciRegistry *registry;
+  GCancellable *cancellable;
+  GMutex mutex;
+  GCond cond;
+} OciLayerDownloads;
+
+static void
+oci_layer_download_thread (gpointer data,
+                           gpointer user_data)
+{
+  OciLayerDownload *layer = data;
+  OciLayerDownloads *downloads = user_data;
+  GError *error = NULL;
+  int fd;
+
+  fd = flatpak_oci_registry_download_blob (downloads->registry, layer->digest,
+                                           NULL, NULL,
+                                           downloads->cancellable, &error);
+
+  g_mutex_lock (&downloads->mutex);
+  layer->fd = fd;
+  layer->error = error;
+  layer->done = TRUE;
+  g_cond_broadcast (&downloads->cond);
+  g_mutex_unlock (&downloads->mutex);
+}
+
+static void
+cancel_oci_layer_downloads (GCancellable *cancellable,
+                            gpointer      user_data)
+{
+  g_cancellable_cancel (G_CANCELLABLE (user_data));
+}
+
+/* Downloads all the layers of the manifest in parallel, and imports
+   them into the mtree in order as soon as each one is available. Layers
+   have to be applied in order as later ones override earlier ones, but
+   that only serializes the imports, not the downloads. */
+static gboolean
+import_oci_layers (OstreeRepo         *repo,
+                   FlatpakOciRegistry *registry,
+                   FlatpakOciManifest *manifest,
+                   OstreeMutableTree  *archive_mtree,
+                   GCancellable       *cancellable,
+                   GError            **error)
+{
+  OciLayerDownloads downloads = { NULL };
+  g_autofree OciLayerDownload *layers = NULL;
+  GThreadPool *pool;
+  gulong cancelled_id = 0;
+  gboolean res = FALSE;
+  int n_layers;
+  int i;
+
+  for (n_layers = 0; manifest->layers[n_layers] != NULL; n_layers++)
+    {
+#ifndef HAVE_ARCHIVE_READ_SUPPORT_FILTER_ZSTD
+      /* Fail early rather than after downloading everything */
+      if (g_strcmp0 (manifest->layers[n_layers]->mediatype,
+                     FLATPAK_OCI_MEDIA_TYPE_IMAGE_LAYER_ZSTD) == 0)
+        return flatpak_fail (error, "zstd compressed OCI layers are not supported by this version of libarchive");
+#endif
+    }
+
+  layers = g_new0 (OciLayerDownload, n_layers);
+  for (i = 0; i < n_layers; i++)
+    {
+      layers[i].digest = manifest->layers[i]->digest;
+      layers[i].fd = -1;
+    }
+
+  downloads.registry = registry;
+  downloads.cancellable = g_cancellable_new ();
+  g_mutex_init (&downloads.mutex);
+  g_cond_init (&downloads.cond);
+
+  if (cancellable)
+    cancelled_id = g_cancellable_connect (cancellable,
+                                          G_CALLBACK (cancel_oci_layer_downloads),
+                                          downloads.cancellable, NULL);
+
+  pool = g_thread_pool_new (oci_layer_download_thread, &downloads,
+                            CLAMP (n_layers, 1, OCI_MAX_PARALLEL_LAYER_DOWNLOADS),
+                            FALSE, NULL);
+  for (i = 0; i < n_layers; i++)
+    g_thread_pool_push (pool, &layers[i], NULL);
+
+  for (i = 0; i < n_layers; i++)
+    {
+      OciLayerDownload *layer = &layers[i];
+      OstreeRepoImportArchiveOptions opts = { 0, };
+      free_read_archive struct archive *a = NULL;
+      glnx_fd_close int layer_fd = -1;
+
+      opts.autocreate_parents = TRUE;
+      opts.ignore_unsupported_content = TRUE;
+
+      g_mutex_lock (&downloads.mutex);
+      while (!layer->done)
+        g_cond_wait (&downloads.cond, &downloads.mutex);
+      g_mutex_unlock (&downloads.mutex);
+
+      if (layer->fd == -1)
+        {
+          g_propagate_error (error, g_steal_pointer (&layer->error));
+          goto out;
+        }
+
+      layer_fd = glnx_steal_fd (&layer->fd);
+
+      a = archive_read_new ();
+#ifdef HAVE_ARCHIVE_READ_SUPPORT_FILTER_ALL
+      archive_read_support_filter_all (a);
+#else
+      archive_read_support_compression_all (a);
+#endif
+      archive_read_support_format_all (a);
+      if (archive_read_open_fd (a, layer_fd, 64 * 1024) != ARCHIVE_OK)
+        {
+          propagate_libarchive_error (error, a);
+          goto out;
+        }
+
+      if (!ostree_repo_import_archive_to_mtree (repo, &opts, a, archive_mtree, NULL, cancellable, error))
+        goto out;
+
+      if (archive_read_close (a) != ARCHIVE_OK)
+        {
+          propagate_libarchive_error (error, a);
+          goto out;
+        }
+    }
+
+  res = TRUE;
+
+ out:
+  /* On failure, stop any downloads that are still running and
+     drop the ones that haven't started yet */
+  if (!res)
+    g_cancellable_cancel (downloads.cancellable);
+  g_thread_pool_free (pool, TRUE, TRUE);
+
+  if (cancelled_id != 0)
+    g_cancellable_disconnect (cancellable, cancelled_id);
+
+  for (i = 0; i < n_layers; i++)
+    {
+      if (layers[i].fd != -1)
+        close (layers[i].fd);
+      g_clear_error (&layers[i].error);
+    }
+
+  g_object_unref (downloads.cancellable);
+  g_mutex_clear (&downloads.mutex);
+  g_cond_clear (&downloads.cond);
+
+  return res;
+}
+
 char *
 flatpak_pull_from_oci (OstreeRepo   *repo,
                        FlatpakOciRegistry *registry,
@@ -4112,7 +4867,6 @@ flatpak_pull_from_oci (OstreeRepo   *repo,
   g_autoptr(GVariantBuilder) metadata_builder = g_variant_builder_new (G_VARIANT_TYPE ("a{sv}"));
   g_autoptr(GVariant) metadata = NULL;
   GHashTable *annotations;
-  int i;
 
   g_assert (ref != NULL);
   g_assert (g_str_has_prefix (digest, "sha256:"));
@@ -4134,44 +4888,9 @@ flatpak_pull_from_oci (OstreeRepo   *repo,
      we write all of it and then build a new mtree with the subset */
   archive_mtree = ostree_mutable_tree_new ();
 
-  for (i = 0; manifest->layers[i] != NULL; i++)
-    {
-      FlatpakOciDescriptor *layer = manifest->layers[i];
-      OstreeRepoImportArchiveOptions opts = { 0, };
-      free_read_archive struct archive *a = NULL;
-      glnx_fd_close int layer_fd = -1;
-
-      opts.autocreate_parents = TRUE;
-      opts.ignore_unsupported_content = TRUE;
-
-      layer_fd = flatpak_oci_registry_download_blob (registry, layer->digest,
-                                                     NULL, NULL,
-                                                     cancellable, error);
-      if (layer_fd == -1)
-        goto error;
-
-      a = archive_read_new ();
-#ifdef HAVE_ARCHIVE_READ_SUPPORT_FILTER_ALL
-      archive_read_support_filter_all (a);
-#else
-      archive_read_support_compression_all (a);
-#endif
-      archive_read_support_format_all (a);
-      if (archive_read_open_fd (a, layer_fd, 8192) != ARCHIVE_OK)
-        {
-          propagate_libarchive_error (error, a);
-          goto error;
-        }
-
-      if (!ostree_repo_import_archive_to_mtree (repo, &opts, a, archive_mtree, NULL, cancellable, error))
-        goto error;
-
-      if (archive_read_close (a) != ARCHIVE_OK)
-        {
-          propagate_libarchive_error (error, a);
-          goto error;
-        }
-    }
+  if (!import_oci_layers (repo, registry, manifest, archive_mtree,
+                          cancellable, error))
+    goto error;
 
   if (!ostree_repo_write_mtree (repo, archive_mtree, &archive_root, cancellable, error))
     goto error;
@@ -4430,6 +5149,10 @@ typedef struct {
   GMainLoop *loop;
   GError *error;
   GOutputStream *out;
+  GChecksum *checksum;
+  GCancellable *cancellable;
+  guint64 range_start;
+  gboolean range_ignored;
   guint64 downloaded_bytes;
   GString *content;
   char buffer[16*1024];
@@ -4483,6 +5206,9 @@ load_uri_read_cb (GObject *source, GAsyncResult *res, gpointer user_data)
           return;
         }
 
+      if (data->checksum)
+        g_checksum_update (data->checksum, (guchar *)data->buffer, n_written);
+
       data->downloaded_bytes += n_written;
     }
   else
@@ -4499,7 +5225,7 @@ load_uri_read_cb (GObject *source, GAsyncResult *res, gpointer user_data)
     }
 
   g_input_stream_read_async (stream, data->buffer, sizeof (data->buffer),
-                             G_PRIORITY_DEFAULT, NULL,
+                             G_PRIORITY_DEFAULT, data->cancellable,
                              load_uri_read_cb, data);
 }
 
@@ -4520,6 +5246,46 @@ load_uri_callback (GObject *source_object,
     }
 
   g_autoptr(SoupMessage) msg = soup_request_http_get_message ((SoupRequestHTTP*) request);
+
+  if (data->range_start > 0)
+    {
+      /* The range starts at the end of the file, so there is nothing
+         left to download */
+      if (msg->status_code == SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE)
+        {
+          g_main_loop_quit (data->loop);
+          return;
+        }
+
+      if (msg->status_code != SOUP_STATUS_PARTIAL_CONTENT &&
+          SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
+        {
+          data->range_ignored = TRUE;
+          data->error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                                             "Server does not support range requests");
+          g_main_loop_quit (data->loop);
+          return;
+        }
+
+      /* Appending anything but exactly the requested range would
+         corrupt the file */
+      if (msg->status_code == SOUP_STATUS_PARTIAL_CONTENT)
+        {
+          goffset start, end, total_length;
+
+          if (!soup_message_headers_get_content_range (msg->response_headers,
+                                                       &start, &end, &total_length) ||
+              start != (goffset) data->range_start)
+            {
+              data->range_ignored = TRUE;
+              data->error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                                                 "Server returned a different range than requested");
+              g_main_loop_quit (data->loop);
+              return;
+            }
+        }
+    }
+
   if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
     {
       GIOErrorEnum code;
@@ -4543,7 +5309,7 @@ load_uri_callback (GObject *source_object,
     }
 
   g_input_stream_read_async (in, data->buffer, sizeof (data->buffer),
-                             G_PRIORITY_DEFAULT, NULL,
+                             G_PRIORITY_DEFAULT, data->cancellable,
                              load_uri_read_cb, data);
 }
 
@@ -4596,6 +5362,7 @@ flatpak_load_http_uri (SoupSession *soup_session,
   loop = g_main_loop_new (context, TRUE);
   data.loop = loop;
   data.content = content;
+  data.cancellable = cancellable;
   data.progress = progress;
   data.user_data = user_data;
   data.last_progress_time = g_get_monotonic_time ();
@@ -4624,14 +5391,17 @@ flatpak_load_http_uri (SoupSession *soup_session,
   return bytes;
 }
 
-gboolean
-flatpak_download_http_uri (SoupSession *soup_session,
-                           const char   *uri,
-                           GOutputStream *out,
-                           FlatpakLoadUriProgress progress,
-                           gpointer      user_data,
-                           GCancellable *cancellable,
-                           GError      **error)
+static gboolean
+download_http_uri_range (SoupSession *soup_session,
+                         const char   *uri,
+                         GOutputStream *out,
+                         GChecksum    *checksum,
+                         guint64       range_start,
+                         gboolean     *range_ignored_out,
+                         FlatpakLoadUriProgress progress,
+                         gpointer      user_data,
+                         GCancellable *cancellable,
+                         GError      **error)
 {
   g_autoptr(SoupRequestHTTP) request = NULL;
   g_autoptr(GMainLoop) loop = NULL;
@@ -4646,6 +5416,10 @@ flatpak_download_http_uri (SoupSession *soup_session,
   loop = g_main_loop_new (context, TRUE);
   data.loop = loop;
   data.out = out;
+  data.checksum = checksum;
+  data.cancellable = cancellable;
+  data.range_start = range_start;
+  data.downloaded_bytes = range_start;
   data.progress = progress;
   data.user_data = user_data;
   data.last_progress_time = g_get_monotonic_time ();
@@ -4655,6 +5429,12 @@ flatpak_download_http_uri (SoupSession *soup_session,
   if (request == NULL)
     return FALSE;
 
+  if (range_start > 0)
+    {
+      g_autoptr(SoupMessage) msg = soup_request_http_get_message (request);
+      soup_message_headers_set_range (msg->request_headers, range_start, -1);
+    }
+
   soup_request_send_async (SOUP_REQUEST(request),
                            cancellable,
                            load_uri_callback, &data);
@@ -4662,17 +5442,178 @@ flatpak_download_http_uri (SoupSession *soup_session,
   g_main_loop_run (loop);
   g_main_context_pop_thread_default (context);
 
+  if (range_ignored_out)
+    *range_ignored_out = data.range_ignored;
+
   if (data.error)
     {
       g_propagate_error (error, data.error);
       return FALSE;
     }
 
-  g_debug ("Received %" G_GSIZE_FORMAT " bytes", data.downloaded_bytes);
+  g_debug ("Received %" G_GUINT64_FORMAT " bytes", data.downloaded_bytes - range_start);
 
   return TRUE;
 }
 
+/* If @checksum is non-NULL it is updated with the data as it is
+ * written to @out, so callers can verify the download without
+ * reading it back. */
+gboolean
+flatpak_download_http_uri (SoupSession *soup_session,
+                           const char   *uri,
+                           GOutputStream *out,
+                           GChecksum    *checksum,
+                           FlatpakLoadUriProgress progress,
+                           gpointer      user_data,
+                           GCancellable *cancellable,
+                           GError      **error)
+{
+  return download_http_uri_range (soup_session, uri, out, checksum, 0, NULL,
+                                  progress, user_data, cancellable, error);
+}
+
+static int
+open_locked_partial_file (int           dfd,
+                          const char   *name,
+                          GError      **error)
+{
+  while (TRUE)
+    {
+      glnx_fd_close int fd = -1;
+      struct stat fd_stbuf, path_stbuf;
+
+      fd = openat (dfd, name, O_RDWR | O_CREAT | O_CLOEXEC | O_NOCTTY, 0644);
+      if (fd == -1)
+        {
+          glnx_set_error_from_errno (error);
+          return -1;
+        }
+
+      if (flock (fd, LOCK_EX | LOCK_NB) != 0)
+        {
+          if (errno == EWOULDBLOCK)
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_BUSY,
+                         "%s is being downloaded by another process", name);
+          else
+            glnx_set_error_from_errno (error);
+          return -1;
+        }
+
+      /* Whoever held the lock before may have renamed or removed the
+         file, in which case we locked the wrong one */
+      if (fstat (fd, &fd_stbuf) != 0)
+        {
+          glnx_set_error_from_errno (error);
+          return -1;
+        }
+
+      if (fstatat (dfd, name, &path_stbuf, 0) == 0 &&
+          fd_stbuf.st_dev == path_stbuf.st_dev &&
+          fd_stbuf.st_ino == path_stbuf.st_ino)
+        return glnx_steal_fd (&fd);
+    }
+}
+
+/* Downloads @uri into the file @partial_name in @partial_dfd, and
+ * verifies that it has the sha256 @expected_sha256. If the file is
+ * left over from an earlier interrupted download we only request the
+ * rest of it with a range request. The file is locked while the
+ * returned fd (positioned at the start) is open. On success the
+ * caller is responsible for moving or removing the file. On failure
+ * it is kept, for the next try to resume from, unless the content
+ * turned out to be wrong. If another process is downloading to the
+ * same file this fails with G_IO_ERROR_BUSY. */
+int
+flatpak_download_http_uri_resumable (SoupSession *soup_session,
+                                     const char   *uri,
+                                     int           partial_dfd,
+                                     const char   *partial_name,
+                                     const char   *expected_sha256,
+                                     FlatpakLoadUriProgress progress,
+                                     gpointer      user_data,
+                                     GCancellable *cancellable,
+                                     GError      **error)
+{
+  glnx_fd_close int fd = -1;
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autoptr(GOutputStream) out = NULL;
+  g_autoptr(GError) local_error = NULL;
+  guint64 offset = 0;
+  gboolean range_ignored = FALSE;
+  char buffer[64 * 1024];
+
+  fd = open_locked_partial_file (partial_dfd, partial_name, error);
+  if (fd == -1)
+    return -1;
+
+  /* We can't save the state of the checksum, so hash what we already
+     have again. This leaves the fd at the end of the file. */
+  while (TRUE)
+    {
+      ssize_t n = read (fd, buffer, sizeof (buffer));
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          glnx_set_error_from_errno (error);
+          return -1;
+        }
+      if (n == 0)
+        break;
+
+      g_checksum_update (checksum, (guchar *) buffer, n);
+      offset += n;
+    }
+
+  if (offset > 0)
+    g_debug ("Resuming download of %s at byte %" G_GUINT64_FORMAT, uri, offset);
+
+  out = g_unix_output_stream_new (fd, FALSE);
+
+  if (!download_http_uri_range (soup_session, uri, out, checksum, offset, &range_ignored,
+                                progress, user_data, cancellable, &local_error))
+    {
+      if (!range_ignored)
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return -1;
+        }
+
+      /* The server doesn't do ranges, or not the one we asked for,
+         so start over */
+      g_clear_error (&local_error);
+      g_checksum_reset (checksum);
+      if (ftruncate (fd, 0) != 0 || lseek (fd, 0, SEEK_SET) != 0)
+        {
+          glnx_set_error_from_errno (error);
+          return -1;
+        }
+
+      if (!download_http_uri_range (soup_session, uri, out, checksum, 0, NULL,
+                                    progress, user_data, cancellable, error))
+        return -1;
+    }
+
+  if (strcmp (g_checksum_get_string (checksum), expected_sha256) != 0)
+    {
+      /* Don't resume from bad data next time */
+      (void) unlinkat (partial_dfd, partial_name, 0);
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Checksum did not match (%s != %s)", expected_sha256,
+                   g_checksum_get_string (checksum));
+      return -1;
+    }
+
+  if (lseek (fd, 0, SEEK_SET) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return -1;
+    }
+
+  return glnx_steal_fd (&fd);
+}
+
 /* Uncomment to get debug traces in /tmp/flatpak-completion-debug.txt (nice
  * to not have it interfere with stdout/stderr)
  */
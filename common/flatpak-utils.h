@@ -324,6 +324,8 @@ typedef struct
   char *ref;
   char *directory;
   char *files_path;
+  char *commit;
+  char *add_ld_path;
   gboolean needs_tmpfs;
   gboolean is_unmaintained;
 } FlatpakExtension;
@@ -552,10 +554,20 @@ GBytes * flatpak_load_http_uri (SoupSession *soup_session,
 gboolean flatpak_download_http_uri (SoupSession *soup_session,
                                     const char   *uri,
                                     GOutputStream *out,
+                                    GChecksum    *checksum,
                                     FlatpakLoadUriProgress progress,
                                     gpointer      user_data,
                                     GCancellable *cancellable,
                                     GError      **error);
+int flatpak_download_http_uri_resumable (SoupSession *soup_session,
+                                         const char   *uri,
+                                         int           partial_dfd,
+                                         const char   *partial_name,
+                                         const char   *expected_sha256,
+                                         FlatpakLoadUriProgress progress,
+                                         gpointer      user_data,
+                                         GCancellable *cancellable,
+                                         GError      **error);
 
 typedef struct {
   char *shell_cur;
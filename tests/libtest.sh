@@ -195,7 +195,7 @@ make_updated_app () {
 }
 
 setup_sdk_repo () {
-    GPGARGS="$FL_GPGARGS" . $(dirname $0)/make-test-runtime.sh org.test.Sdk bash ls cat echo readlink make mkdir cp touch > /dev/null
+    GPGARGS="$FL_GPGARGS" . $(dirname $0)/make-test-runtime.sh org.test.Sdk bash ls cat echo readlink make mkdir cp touch rm > /dev/null
     update_repo
 }
 
@@ -25,7 +25,7 @@ skip_without_bwrap
 skip_without_user_xattrs
 skip_without_python2
 
-echo "1..1"
+echo "1..2"
 
 setup_repo
 install_repo
@@ -51,3 +51,16 @@ flatpak-builder --run appdir org.test.Python.json testpython.py > testpython.out
 assert_file_has_content testpython.out ^modified$
 
 echo "ok handled pyc rewriting multiple times"
+
+cp $(dirname $0)/org.test.PythonPycache.json .
+flatpak-builder --force-clean pycachedir org.test.PythonPycache.json
+
+# The stale bytecode is removed, and the header mtime of the matching
+# one is set to the ostree checkout mtime
+assert_has_file pycachedir/files/lib/pkg/a/stale.py
+assert_not_has_file pycachedir/files/lib/pkg/a/__pycache__/stale.cpython-36.pyc
+assert_has_file pycachedir/files/lib/pkg/a/b/__pycache__/matching.cpython-36.pyc
+od -A n -t x1 -j 4 -N 4 pycachedir/files/lib/pkg/a/b/__pycache__/matching.cpython-36.pyc > pyc-mtime
+assert_file_has_content pyc-mtime '^ *00 00 00 00 *$'
+
+echo "ok handled pyc in nested __pycache__ dirs"
@@ -24,7 +24,7 @@ set -euo pipefail
 skip_without_bwrap
 skip_without_user_xattrs
 
-echo "1..3"
+echo "1..6"
 
 setup_repo
 install_repo
@@ -75,3 +75,44 @@ run --command=cat org.test.Hello2 /app/share/app-data > app_data_2
 assert_file_has_content app_data_2 version2
 
 echo "ok update"
+
+cp $(dirname $0)/test-changes.json .
+cp -a $(dirname $0)/empty-configure .
+echo "two" > changes-data
+${FLATPAK_BUILDER} --force-clean runtimedir test-changes.json
+
+# second replaces the file with a directory, so its contents are
+# changes of second and its cleanup applies to them
+assert_has_dir runtimedir/usr/share/changes/thing
+assert_has_file runtimedir/usr/share/changes/thing/kept
+assert_not_has_file runtimedir/usr/share/changes/thing/inner
+assert_has_dir runtimedir/platform/share/changes/thing
+assert_has_file runtimedir/platform/share/changes/thing/kept
+assert_not_has_file runtimedir/platform/share/changes/thing/inner
+
+echo "ok file changed to directory"
+
+# one.txt was re-added with the same content, so it is not a change of
+# second and its cleanup doesn't apply
+assert_file_has_content runtimedir/usr/share/changes/nested/a/b/one.txt '^one$'
+assert_file_has_content runtimedir/platform/share/changes/nested/a/b/one.txt '^one$'
+assert_file_has_content runtimedir/platform/share/changes/nested/a/b/two.txt '^two$'
+assert_has_dir runtimedir/platform/share/changes/removed
+assert_not_has_dir runtimedir/platform/share/changes/removed/a
+
+echo "ok nested directory removed and re-added"
+
+# Only second is rebuilt, on top of the cached first stage
+echo "two-v2" > changes-data
+${FLATPAK_BUILDER} --force-clean runtimedir test-changes.json > changes-build-out
+assert_file_has_content changes-build-out '^Cache hit for first, skipping build$'
+assert_not_file_has_content changes-build-out '^Cache hit for second'
+
+assert_has_file runtimedir/platform/share/changes/thing/kept
+assert_not_has_file runtimedir/platform/share/changes/thing/inner
+assert_file_has_content runtimedir/usr/share/changes/nested/a/b/one.txt '^one$'
+assert_file_has_content runtimedir/platform/share/changes/nested/a/b/one.txt '^one$'
+assert_file_has_content runtimedir/platform/share/changes/nested/a/b/two.txt '^two-v2$'
+assert_not_has_dir runtimedir/platform/share/changes/removed/a
+
+echo "ok rebuild after partial cache hit"
@@ -24,7 +24,7 @@ set -euo pipefail
 skip_without_bwrap
 skip_without_user_xattrs
 
-echo "1..6"
+echo "1..7"
 
 setup_repo
 
@@ -95,3 +95,26 @@ run org.test.Hello > hello_out
 assert_file_has_content hello_out '^Hello world, from a sandboxUPDATEDHTTP$'
 
 echo "ok update oci http"
+
+flatpak uninstall ${U} org.test.Hello
+
+# A manifest that points outside the blobs dir must be rejected before
+# any path is built from it
+cp -a oci-dir oci-evil
+MANIFEST=$(grep -o 'sha256:[0-9a-f]\{64\}' oci-evil/refs/latest)
+sed -e 's|sha256:[0-9a-f]\{64\}|sha256:../../../../../../../tmp/escaped|g' \
+    oci-evil/blobs/sha256/${MANIFEST#sha256:} > evil-manifest
+EVIL=$(sha256sum evil-manifest | cut -d ' ' -f 1)
+cp evil-manifest oci-evil/blobs/sha256/${EVIL}
+sed -i -e "s|${MANIFEST}|sha256:${EVIL}|" \
+    -e "s|\"size\" *: *[0-9]*|\"size\" : $(stat -c %s evil-manifest)|" oci-evil/refs/latest
+
+ostree trivial-httpd --autoexit --daemonize -p oci-evil-port `pwd`/oci-evil
+ocievilport=$(cat oci-evil-port)
+
+if ${FLATPAK} install ${U} --oci http://127.0.0.1:${ocievilport} latest 2> install-evil-error; then
+    assert_not_reached "Installed from a manifest with an invalid digest"
+fi
+assert_file_has_content install-evil-error "Invalid digest"
+
+echo "ok reject invalid oci digest"
@@ -0,0 +1,145 @@
+#include "config.h"
+#include <string.h>
+#include <glib.h>
+#include "builder-utils.h"
+
+static const char *cleanup_patterns[] = {
+  "*.la",
+  "/lib/pkgconfig",
+  "/share/*/foo",
+  "a/b",
+  "*.tar.gz",
+  NULL
+};
+
+static const char *cleanup_paths[] = {
+  "la",
+  ".la",
+  "libfoo.la",
+  "lib/libfoo.la",
+  "lib/libfoo.la.1",
+  "lib/libfoo.la/inner",
+  "lib/libfoo.so",
+  "lib/pkgconfig",
+  "lib/pkgconfig/foo.pc",
+  "lib/pkgconfigx/foo.pc",
+  "lib/lib/pkgconfig",
+  "share/foo",
+  "share/doc/foo",
+  "share/doc/foo/bar",
+  "share/doc/foobar",
+  "share/doc/x/foo",
+  "share/doc",
+  "a/b",
+  "x/a/b",
+  "a/b/c",
+  "b",
+  "foo.tar.gz",
+  "src/foo.tar.gz",
+  "src/foo.tar.gz.sig",
+  "src/foo.gz",
+  "src/tar.gz",
+  NULL
+};
+
+static GHashTable *
+collect_with_matcher (const char **patterns,
+                      const char  *add_prefix)
+{
+  g_autoptr(BuilderCleanupMatcher) matcher = builder_cleanup_matcher_new (patterns);
+  GHashTable *to_remove_ht = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  int i;
+
+  for (i = 0; cleanup_paths[i] != NULL; i++)
+    builder_cleanup_matcher_collect (matcher, cleanup_paths[i], add_prefix, to_remove_ht);
+
+  return to_remove_ht;
+}
+
+static GHashTable *
+collect_per_pattern (const char **patterns,
+                     const char  *add_prefix)
+{
+  GHashTable *to_remove_ht = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  int i, j;
+
+  for (i = 0; cleanup_paths[i] != NULL; i++)
+    for (j = 0; patterns[j] != NULL; j++)
+      flatpak_collect_matches_for_path_pattern (cleanup_paths[i], patterns[j], add_prefix, to_remove_ht);
+
+  return to_remove_ht;
+}
+
+static void
+assert_same_matches (const char **patterns,
+                     const char  *add_prefix)
+{
+  g_autoptr(GHashTable) expected = collect_per_pattern (patterns, add_prefix);
+  g_autoptr(GHashTable) matched = collect_with_matcher (patterns, add_prefix);
+  g_autoptr(BuilderCleanupMatcher) matcher = builder_cleanup_matcher_new (patterns);
+  GHashTableIter iter;
+  gpointer key;
+  int i, j;
+
+  g_hash_table_iter_init (&iter, expected);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_assert_true (g_hash_table_contains (matched, key));
+
+  g_hash_table_iter_init (&iter, matched);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_assert_true (g_hash_table_contains (expected, key));
+
+  for (i = 0; cleanup_paths[i] != NULL; i++)
+    {
+      gboolean matches = FALSE;
+
+      for (j = 0; patterns[j] != NULL; j++)
+        matches |= flatpak_matches_path_pattern (cleanup_paths[i], patterns[j]);
+
+      g_assert_cmpint (builder_cleanup_matcher_matches (matcher, cleanup_paths[i]), ==, matches);
+    }
+}
+
+static void
+test_cleanup_matcher (void)
+{
+  int i;
+
+  assert_same_matches (cleanup_patterns, NULL);
+  assert_same_matches (cleanup_patterns, "files/");
+
+  for (i = 0; cleanup_patterns[i] != NULL; i++)
+    {
+      const char *single[] = { cleanup_patterns[i], NULL };
+
+      assert_same_matches (single, NULL);
+      assert_same_matches (single, "files/");
+    }
+}
+
+static void
+test_cleanup_matcher_collect (void)
+{
+  g_autoptr(GHashTable) matched = collect_with_matcher (cleanup_patterns, "files/");
+
+  g_assert_true (g_hash_table_contains (matched, "files/lib/libfoo.la"));
+  g_assert_true (g_hash_table_contains (matched, "files/lib/pkgconfig"));
+  g_assert_true (g_hash_table_contains (matched, "files/share/doc/foo"));
+  g_assert_true (g_hash_table_contains (matched, "files/src/foo.tar.gz"));
+  g_assert_false (g_hash_table_contains (matched, "files/lib/pkgconfigx/foo.pc"));
+  g_assert_false (g_hash_table_contains (matched, "files/lib/lib/pkgconfig"));
+  g_assert_false (g_hash_table_contains (matched, "files/share/foo"));
+  g_assert_false (g_hash_table_contains (matched, "files/a/b"));
+  g_assert_false (g_hash_table_contains (matched, "files/src/foo.tar.gz.sig"));
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/builder/cleanup-matcher", test_cleanup_matcher);
+  g_test_add_func ("/builder/cleanup-matcher-collect", test_cleanup_matcher_collect);
+
+  return g_test_run ();
+}